@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include "http_packet.hpp"
+#include "server_options.hpp"
+
+namespace spiritsaway::http_server
+{
+	/// Decides whether a new request may reach the handler. It bounds the requests in the
+	/// handler at once and sheds load in the style of CoDel: when even the fastest request
+	/// of a whole interval waited longer than the target there is a standing queue, and
+	/// requests are refused at a rate that grows until the delay falls below the target.
+	///
+	/// The server has no queue of its own, so the time a request spends in the handler
+	/// stands for the queue delay. Handlers that queue work on pools or upstreams see it
+	/// grow first when the server is over capacity.
+	class admission_controller
+	{
+	public:
+		admission_controller(const admission_controller &) = delete;
+		admission_controller &operator=(const admission_controller &) = delete;
+
+		explicit admission_controller(const server_options &options);
+
+		/// Whether a request whose headers just arrived may proceed. An admitted request
+		/// must be ended by exactly one call to release.
+		bool try_admit();
+
+		/// End an admitted request, sojourn is its time in the handler or zero if it never got a reply.
+		void release(std::chrono::steady_clock::duration sojourn);
+
+		std::size_t get_in_flight() const
+		{
+			return in_flight_.load(std::memory_order_relaxed);
+		}
+
+		bool is_dropping() const
+		{
+			return dropping_.load(std::memory_order_relaxed);
+		}
+
+		/// The 503 sent to refused requests, serialized once.
+		static const reply &shed_reply();
+
+	private:
+		static std::int64_t now_us();
+
+		bool should_drop();
+
+		/// Decide whether to shed in the next interval once the current one is over.
+		void close_window(std::int64_t now);
+
+		const std::size_t max_in_flight_;
+		const std::int64_t target_us_;
+		const std::int64_t interval_us_;
+
+		std::atomic<std::size_t> in_flight_{0};
+
+		std::atomic<std::int64_t> window_end_us_{0};
+		/// Smallest sojourn seen in the current interval.
+		std::atomic<std::int64_t> window_min_us_;
+		std::atomic<bool> dropping_{false};
+		std::atomic<std::uint32_t> drop_count_{0};
+		std::atomic<std::int64_t> next_drop_us_{0};
+	};
+
+} // namespace spiritsaway::http_server
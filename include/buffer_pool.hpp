@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace spiritsaway::http_server
+{
+	struct buffer_pool_statistics
+	{
+		std::uint64_t created = 0;
+		std::uint64_t reused = 0;
+		/// Blocks in the free lists of all threads.
+		std::uint64_t idle = 0;
+	};
+
+	/// Read buffers of a fixed size, recycled through a free list per thread so that
+	/// connection churn does not go to the global allocator for them.
+	class buffer_pool
+	{
+	public:
+		static constexpr std::size_t block_size = 8192;
+
+		/// Free blocks kept per thread, further ones are freed.
+		static constexpr std::size_t max_idle_per_thread = 256;
+
+		using block = std::array<char, block_size>;
+
+		struct block_deleter
+		{
+			void operator()(block *released) const;
+		};
+		using block_ptr = std::unique_ptr<block, block_deleter>;
+
+		/// Take a block from the free list of this thread or allocate one.
+		static block_ptr acquire();
+
+		static buffer_pool_statistics get_statistics();
+	};
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "http_packet.hpp"
+
+namespace spiritsaway::http_server
+{
+	enum class content_encoding
+	{
+		identity,
+		gzip,
+		deflate
+	};
+
+	/// Get the Content-Encoding token for the encoding, empty for identity.
+	std::string_view encoding_token(content_encoding encoding);
+
+	/// Pick the encoding to use from the value of an Accept-Encoding header, honoring
+	/// q-values. Returns identity when nothing supported is acceptable or when the
+	/// library is built without zlib.
+	content_encoding negotiate_encoding(std::string_view accept_encoding);
+
+	/// An incremental gzip/deflate compressor. The zlib state behind it is borrowed from a
+	/// per-thread free list and reset instead of being set up for every reply, so a
+	/// streamed body can keep one compressor across several chunks.
+	class stream_compressor
+	{
+	public:
+		stream_compressor(const stream_compressor &) = delete;
+		stream_compressor &operator=(const stream_compressor &) = delete;
+
+		stream_compressor(content_encoding encoding, int level);
+		~stream_compressor();
+
+		/// Compress input and append the output to dest. Without finish the output is
+		/// flushed to a byte boundary so that it can be sent as a chunk on its own.
+		/// Returns false on a zlib error.
+		bool update(std::string_view input, bool finish, std::string &dest);
+
+		content_encoding encoding() const
+		{
+			return encoding_;
+		}
+
+		/// The zlib stream, only defined inside the library.
+		struct zlib_state;
+
+	private:
+		const content_encoding encoding_;
+		std::unique_ptr<zlib_state> state_;
+	};
+
+	struct compression_options
+	{
+		/// Bodies smaller than this are sent as is.
+		std::size_t min_size = 1024;
+
+		/// zlib compression level, 1 to 9.
+		int level = 6;
+
+		/// Content-Type prefixes that are already compressed and are never compressed again.
+		std::vector<std::string> skip_types = {
+			"image/", "video/", "audio/", "font/woff",
+			"application/zip", "application/gzip", "application/x-gzip",
+			"application/octet-stream", "application/pdf"};
+	};
+
+	/// Compress the content of rep with the given encoding and return the compressed reply.
+	/// A body_stream is wrapped so that its pieces are compressed as they are read, and the
+	/// reply loses its Content-Length. Returns false and leaves dest untouched if the reply
+	/// should be sent as is.
+	bool compress_reply(const reply &rep, content_encoding encoding, const compression_options &options, reply &dest);
+
+	/// Wrap a handler so that its replies are compressed according to the Accept-Encoding
+	/// header of the request.
+	request_handler make_compression_handler(request_handler next, const compression_options &options = compression_options());
+
+} // namespace spiritsaway::http_server
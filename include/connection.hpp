@@ -4,25 +4,44 @@
 
 
 #include <array>
+#include <atomic>
 #include <memory>
+#include <vector>
 #include <asio.hpp>
 
+#include "buffer_pool.hpp"
+#include "http2_session.hpp"
+#include "output_queue.hpp"
 #include "request_parser.hpp"
+#include "server_options.hpp"
+#include "websocket.hpp"
 
 namespace spiritsaway::http_server{ 
 
 class connection_manager;
+class metrics_registry;
+class admission_controller;
+class reply_mailbox;
 
-/// Represents a single connection from a client.
+/// Represents a single connection from a client. Everything but the call of the
+/// handler lives here, basic_connection adds the handler. After a reply that accepts a
+/// WebSocket upgrade the connection reads frames instead of requests and serves as the
+/// websocket_session of the upgrade. A connection that starts with the HTTP/2 preface or
+/// accepts Upgrade: h2c hands its input to an http2_session and serves as its transport.
 class connection
-  : public std::enable_shared_from_this<connection>
+  : public std::enable_shared_from_this<connection>,
+  public output_control,
+  public websocket_session,
+  public http2_transport
 {
 public:
   connection(const connection&) = delete;
   connection& operator=(const connection&) = delete;
 
   /// Construct a connection with the given socket.
-  explicit connection(asio::ip::tcp::socket socket, connection_manager& con_mgr, const request_handler& handler);
+  explicit connection(asio::ip::tcp::socket socket, connection_manager& con_mgr, std::shared_ptr<const server_options> options, admission_controller& admission, reply_mailbox& mailbox);
+
+  virtual ~connection();
 
   /// Start the first asynchronous operation for the connection.
   void start();
@@ -30,31 +49,178 @@ public:
   /// Stop all asynchronous operations associated with the connection.
   void stop();
 
-private:
-  /// Perform an asynchronous read operation.
-  void do_read();
+  /// Read the next piece of a streamed request body, used by request::body_stream.
+  void read_request_body(body_source::read_handler cb);
+
+  /// Send the reply of request request_id, must run on the strand of the connection. Used by reply_mailbox.
+  void deliver_reply(std::uint64_t request_id, reply in_reply);
+
+  /// The strand the server accepted the socket on, every handler of the connection runs on it.
+  asio::ip::tcp::socket::executor_type get_executor()
+  {
+    return socket_.get_executor();
+  }
+
+  /// Close the connection once the current reply is written instead of waiting for another
+  /// request, at once if it is idle. May be called from any thread.
+  void begin_drain();
+
+  /// Hold back and release the writes of the connection, may be called from any thread.
+  void cork() override;
+  void uncork() override;
+
+  bool send(std::string data, bool binary) override;
+  bool send(std::shared_ptr<const std::string> data, bool binary) override;
+  void close(std::uint16_t code, std::string_view reason) override;
+  std::size_t buffered_amount() const override;
+
+  void dispatch_stream(std::uint32_t stream_id, std::weak_ptr<request> req) override;
+  void run_on_connection(std::function<void()> fn) override;
+
+  /// Drop the state of the finished connection and give back its read buffer, so that it
+  /// can wait in a connection_pool. Only called once the last connection_ptr is gone.
+  void recycle();
+
+  /// Make a recycled connection serve a new socket.
+  void reset(asio::ip::tcp::socket socket);
+
+protected:
+  /// Start on the next request, read from the socket if it is not buffered yet.
+  virtual void do_read() = 0;
+
+  /// Call the handler, for the streams of HTTP/2 which do not go through do_read.
+  virtual void call_handler(std::weak_ptr<request> req, reply_handler cb) = 0;
+
+  enum class read_outcome
+  {
+    /// More data is needed, read again.
+    incomplete,
+    /// The headers or the whole request are there, call the handler.
+    request_ready,
+    /// An error reply is being written or the connection is closed.
+    finished,
+  };
+
+  /// Arm the timeout of the connection, a later call moves the deadline.
+  void arm_timer();
+
+  /// Whether the caller runs on the strand of the connection and may touch it directly.
+  bool running_in_strand();
+
+  /// Whether the connection holds no read buffer and should wait for the socket to become
+  /// readable before it takes one, see server_options::lazy_read_buffer.
+  bool wait_before_read() const;
+
+  /// The buffer for the next read, taken from the buffer_pool if the connection has none.
+  asio::mutable_buffer acquire_read_buffer();
+
+  /// Feed a completed read to the parser and the admission control.
+  read_outcome on_read(std::error_code ec, std::size_t bytes_transferred);
+
+  /// Parse the pipelined bytes that followed the last request.
+  read_outcome on_pending_input();
+
+  /// Whether the handler may be called for the next request now, false while the replies
+  /// before it wait for the socket. A write that drains the output calls do_read again.
+  bool ready_for_next_request();
 
-  /// Perform an asynchronous write operation.
-  void on_reply(const reply& in_reply);
-  void do_write();
+  /// Set up request_ for the handler, expired if the connection was stopped instead.
+  std::weak_ptr<request> begin_request();
+
+  /// The callback that gives the handler's reply to request_id, or to the HTTP/2 stream
+  /// with that id, to this connection from any thread.
+  reply_handler make_reply_handler(std::uint64_t request_id);
+
+  void on_reply(reply in_reply);
+
+  /// Queue the head of reply_ and then its body. A reply that is not may_keep_alive closes the connection.
+  void queue_reply(bool may_keep_alive);
+
+  /// The whole reply is queued, go on with the next request or close once it is written.
+  void finish_reply();
+
+  /// Write the queued output unless a write is running or the output is corked.
+  void flush_output();
 
-  void handle_request();
   void on_timeout();
 
+  void do_read_body(body_source::read_handler cb);
+
+  /// Queue the next piece of reply_.body_stream, chunked if chunked_reply_ is set.
+  void do_write_body();
+
+  /// Queue a piece of reply_.body_stream, shared_data is set instead of data for sources that share their pieces.
+  void on_body_piece(const std::string& err, std::string data, std::shared_ptr<const std::string> shared_data, bool finished);
+  void on_write_finished(std::error_code ec);
+  void count_sent(std::size_t bytes_transferred);
+
+  /// Read into a larger buffer next time if this read filled the current one.
+  void grow_read_buffer(std::size_t bytes_transferred);
+  void release_read_buffer();
+
+  void set_remote_address();
+  void release_admission();
+
+  /// Check the admission of a parsed request and turn the parser result into a read_outcome.
+  read_outcome on_parsed(request_parser::result_type result);
+
+  /// Switch to WebSocket once the 101 reply of an upgrade is queued.
+  void start_websocket();
+  void websocket_read();
+  void on_websocket_read(std::error_code ec, std::size_t bytes_transferred);
+
+  /// Handle the complete frames at the start of data, returns the bytes they took.
+  std::size_t on_websocket_input(char* data, std::size_t size);
+
+  /// Returns false once no more frames should be read.
+  bool on_websocket_frame(const websocket_frame& frame);
+
+  /// Queue the header of a frame, false if the connection no longer sends frames.
+  bool queue_websocket_header(websocket_opcode opcode, std::size_t payload_size);
+  void queue_websocket_close(std::uint16_t code, std::string_view reason);
+
+  /// Close with code because of an invalid frame or message, returns false for on_websocket_frame.
+  bool fail_websocket(std::uint16_t code);
+
+  /// Give the end of the connection to the websocket_handler and let go of it.
+  void end_websocket(std::uint16_t code, std::string_view reason);
+
+  /// Account for written bytes and tell a blocked sender once the send buffer has room.
+  void on_websocket_written();
+
+  /// Switch to HTTP/2 with the bytes read so far. The 101 reply to upgrade_request is
+  /// queued first if it is set, the request becomes stream 1.
+  void start_http2(const char* data, std::size_t size, std::shared_ptr<request> upgrade_request);
+  void http2_read();
+  void on_http2_read(std::error_code ec, std::size_t bytes_transferred);
+  void on_http2_input(const char* data, std::size_t size);
+
+  /// Write what the session queued, and close after it once the session is finished.
+  void flush_http2();
+
   /// Socket for the connection.
   asio::ip::tcp::socket socket_;
 
   /// The manager for this connection.
 
-  /// The handler used to process the incoming request.
-  const request_handler request_handler_;
+  /// Buffer for incoming data, taken from the buffer_pool of the thread.
+  buffer_pool::block_ptr buffer_;
+
+  /// Replaces buffer_ once reads of a request keep filling it.
+  std::vector<char> large_buffer_;
 
-  /// Buffer for incoming data.
-  std::array<char, 8192> buffer_;
+  /// The buffer of the read in progress.
+  asio::mutable_buffer read_buffer_;
 
   /// The incoming request.
   std::shared_ptr<request> request_;
 
+  /// Counts the requests of the connection, a reply to an older one is dropped.
+  std::uint64_t request_id_ = 0;
+
+  /// Address of the peer, copied into every request.
+  std::string remote_address_;
+
   /// The parser for the incoming request.
   request_parser request_parser_;
 
@@ -63,14 +229,188 @@ private:
   /// The reply to be sent back to the client.
   reply reply_;
 
-  std::string m_reply_str;
+  /// Whether the streamed body of reply_ is sent with chunked transfer coding.
+  bool chunked_reply_ = false;
+
+  /// Whether the connection stays open after reply_.
+  bool keep_alive_ = false;
+
+  /// Whether no byte of the next request has arrived, the connection can be closed without losing one.
+  bool waiting_for_request_ = true;
+
+  /// Set by begin_drain, no further request is read.
+  bool draining_ = false;
+
+  /// Bytes waiting for the socket.
+  output_queue output_;
+  bool writing_ = false;
+  std::size_t cork_count_ = 0;
+
+  /// Close the connection once output_ is written.
+  bool close_after_write_ = false;
+
+  /// Set while basic_connection calls the handler for buffered requests or a batch of
+  /// WebSocket frames is handled, replies given meanwhile are written together at its end.
+  bool in_request_loop_ = false;
+  bool next_request_ready_ = false;
+
+  /// do_write_body or do_read wait for a write to drain output_.
+  bool body_waiting_for_write_ = false;
+  bool read_waiting_for_write_ = false;
+
+  const std::shared_ptr<const server_options> options_;
 
   // timeout timer
   asio::basic_waitable_timer<std::chrono::steady_clock> con_timer_;
-  const std::size_t timeout_seconds_ = 5;
+  const std::size_t timeout_seconds_;
+
+  /// Metrics of the server, nullptr when they are disabled.
+  metrics_registry* const metrics_;
+
+  /// When the handler was invoked for request_.
+  std::chrono::steady_clock::time_point request_begin_;
+
+  /// Decides whether the request may reach the handler once its headers are parsed.
+  admission_controller& admission_;
+  bool admission_checked_ = false;
+
+  /// Whether the request holds an admission slot, released by the first reply.
+  std::atomic<bool> admitted_{false};
+
+  /// Carries replies from other threads to the strand of the connection.
+  reply_mailbox& mailbox_;
+
+  /// Whether the connection speaks WebSocket.
+  bool upgraded_ = false;
+
+  /// Gets the messages until the connection ends, nullptr after that.
+  std::shared_ptr<websocket_handler> websocket_;
+
+  /// Received bytes of an incomplete frame. Frames that arrive whole are handled in the read buffer.
+  std::string websocket_input_;
+
+  /// Fragments of the message being received.
+  std::string websocket_message_;
+  bool websocket_in_message_ = false;
+  bool websocket_message_binary_ = false;
+
+  /// Whether a close frame has been queued, no frame may follow it.
+  bool websocket_close_sent_ = false;
+
+  /// Mirrors output_.size() for websocket_session::send on other threads.
+  std::atomic<std::size_t> websocket_buffered_{0};
+
+  /// Set when a send found the buffer over the limit, on_writable is due.
+  std::atomic<bool> websocket_blocked_{false};
+
+  /// Set while the connection speaks HTTP/2.
+  std::unique_ptr<http2_session> http2_;
 };
 
 typedef std::shared_ptr<connection> connection_ptr;
 
-} 
+/// A connection calling a handler of a known type, so that the call is direct and can be
+/// inlined. Handler is called as handler(std::weak_ptr<request>, reply_handler) and is
+/// owned by the server, which outlives its connections.
+template <typename Handler>
+class basic_connection : public connection
+{
+public:
+  basic_connection(asio::ip::tcp::socket socket, connection_manager& con_mgr, const Handler& handler, std::shared_ptr<const server_options> options, admission_controller& admission, reply_mailbox& mailbox)
+    : connection(std::move(socket), con_mgr, std::move(options), admission, mailbox),
+    handler_(handler)
+  {
+  }
+
+protected:
+  void do_read() override
+  {
+    if (ready_for_next_request())
+    {
+      run_requests(read_outcome::incomplete);
+    }
+  }
 
+  void call_handler(std::weak_ptr<request> req, reply_handler cb) override
+  {
+    handler_(std::move(req), std::move(cb));
+  }
+
+private:
+  /// Call the handler for every request that is already buffered, handlers that reply at
+  /// once get their replies written together. Reads from the socket when the input runs out.
+  void run_requests(read_outcome outcome)
+  {
+    in_request_loop_ = true;
+    for (;;)
+    {
+      if (outcome == read_outcome::incomplete && request_parser_.has_pending_input())
+      {
+        outcome = on_pending_input();
+      }
+      if (outcome == read_outcome::incomplete)
+      {
+        read_some();
+        break;
+      }
+      if (outcome != read_outcome::request_ready)
+      {
+        break;
+      }
+      next_request_ready_ = false;
+      handle_request();
+      if (!next_request_ready_ || !ready_for_next_request())
+      {
+        break;
+      }
+      outcome = read_outcome::incomplete;
+    }
+    in_request_loop_ = false;
+    flush_output();
+  }
+
+  void read_some()
+  {
+    auto self(shared_from_this());
+    arm_timer();
+    if (wait_before_read())
+    {
+      socket_.async_wait(asio::ip::tcp::socket::wait_read,
+        [this, self](std::error_code ec)
+        {
+          if (ec)
+          {
+            on_read(ec, 0);
+            return;
+          }
+          read_now();
+        });
+      return;
+    }
+    read_now();
+  }
+
+  void read_now()
+  {
+    auto self(shared_from_this());
+    socket_.async_read_some(acquire_read_buffer(),
+      [this, self](std::error_code ec, std::size_t bytes_transferred)
+      {
+        run_requests(on_read(ec, bytes_transferred));
+      });
+  }
+
+  void handle_request()
+  {
+    auto weak_request = begin_request();
+    if (weak_request.expired())
+    {
+      return;
+    }
+    handler_(std::move(weak_request), make_reply_handler(request_id_));
+  }
+
+  const Handler& handler_;
+};
+
+} 
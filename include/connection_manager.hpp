@@ -2,6 +2,7 @@
 
 #include <set>
 #include "connection.hpp"
+#include <functional>
 #include <mutex>
 
 namespace spiritsaway::http_server
@@ -28,9 +29,16 @@ namespace spiritsaway::http_server
 		
 		std::size_t get_connection_count();
 
+		/// Call visitor for every open connection, on a copy of the set.
+		void for_each(const std::function<void(const connection_ptr &)> &visitor);
+
+		/// Called after a connection is removed, used to resume accepting.
+		void set_stop_callback(std::function<void()> callback);
+
 	private:
 		/// The managed connections.
 		std::set<connection_ptr> connections_;
 		std::mutex con_mutex_;
+		std::function<void()> stop_callback_;
 	};
 } // namespace spiritsaway::http_server
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace spiritsaway::http_server
+{
+	class connection;
+
+	struct connection_pool_statistics
+	{
+		std::uint64_t created = 0;
+		std::uint64_t reused = 0;
+		/// Closed connections waiting in the free lists of all threads.
+		std::uint64_t idle = 0;
+	};
+
+	/// Closed connection objects of one server kept for reuse, so that accepting does not
+	/// allocate a connection with its parser, timer and strings every time. Free lists are
+	/// per I/O thread, a connection goes back to the list of the thread that runs its
+	/// strand when the last connection_ptr is gone. Idle connections still own a closed
+	/// socket and timer of the server's io_context, so the pool must go before the io_context.
+	class connection_pool
+	{
+	public:
+		connection_pool(const connection_pool &) = delete;
+		connection_pool &operator=(const connection_pool &) = delete;
+
+		explicit connection_pool(std::size_t max_idle_per_thread);
+		~connection_pool();
+
+		/// Deleter of the connection_ptr, gives the connection back on its strand instead of deleting it.
+		struct recycler
+		{
+			std::shared_ptr<connection_pool> pool;
+			void operator()(connection *released) const;
+		};
+
+		/// Take a closed connection of this thread, nullptr if there is none.
+		connection *acquire();
+
+		/// Count a connection that had to be allocated.
+		void count_created()
+		{
+			created_.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		connection_pool_statistics get_statistics() const;
+
+	private:
+		struct free_list
+		{
+			std::vector<connection *> connections;
+		};
+
+		void release(connection *released);
+		free_list &local();
+
+		/// Never reused, like the id of metrics_registry.
+		const std::uint64_t id_;
+		const std::size_t max_idle_per_thread_;
+		std::mutex lists_mutex_;
+		std::vector<std::unique_ptr<free_list>> lists_;
+		std::atomic<std::uint64_t> created_{0};
+		std::atomic<std::uint64_t> reused_{0};
+		std::atomic<std::uint64_t> idle_{0};
+	};
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,45 @@
+#pragma once
+
+#ifdef HTTP_SERVER_WITH_COROUTINES
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <asio.hpp>
+#include "http_client.h"
+
+namespace spiritsaway::http_server
+{
+	/// A handler written as a coroutine, e.g.
+	///
+	///     asio::awaitable<reply> on_upload(std::shared_ptr<request> req)
+	///     {
+	///         auto [err, body] = co_await async_read_body(req);
+	///         ...
+	///         co_return rep;
+	///     }
+	///
+	/// Errors are reported as strings like the callback API. An exception that escapes
+	/// the coroutine is answered with 500.
+	using coro_request_handler = std::function<asio::awaitable<reply>(std::shared_ptr<request>)>;
+
+	/// Adapt a coroutine handler to a request_handler. The request is locked once and the
+	/// coroutine is spawned on io_context, its frames come from the per-thread recycling
+	/// allocator of asio instead of the global heap.
+	request_handler make_coro_handler(asio::io_context &io_context, coro_request_handler handler);
+
+	/// Read the whole body of req, from request::body_stream when it is streamed. Returns
+	/// the error and the body.
+	asio::awaitable<std::pair<std::string, std::string>> async_read_body(std::shared_ptr<request> req);
+
+	/// Read the next piece of a streamed body, returns the error, the data and whether it was the last piece.
+	asio::awaitable<std::tuple<std::string, std::string, bool>> async_read_some(body_source &source);
+
+	/// Send req with an http_client and return the error and the reply. With a pool the
+	/// connection is taken from and given back to it.
+	asio::awaitable<std::pair<std::string, reply>> async_http_request(asio::io_context &io_context, const std::string &server_url, const std::string &server_port, const request &req, std::uint32_t timeout_seconds, std::shared_ptr<http_client_pool> pool = nullptr);
+
+} // namespace spiritsaway::http_server
+
+#endif
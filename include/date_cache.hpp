@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace spiritsaway::http_server
+{
+	/// Per-thread cache of the "Date" and "Server" header lines spliced into every reply.
+	/// The lines are formatted into a thread local buffer at most once per second, so
+	/// sending a reply only costs a view into that buffer.
+	class date_cache
+	{
+	public:
+		/// Enable or disable the automatic Date header, it is enabled by default.
+		static void set_date_enabled(bool enabled);
+
+		/// Set the value of the automatic Server header, an empty name disables it.
+		/// Names longer than max_server_name_size are truncated.
+		static void set_server_name(const std::string &name);
+
+		/// Get the cached header lines for the calling thread, each one terminated by crlf.
+		/// Pass false for the lines the reply already carries itself.
+		static std::string_view header_lines(bool with_date, bool with_server);
+
+		static constexpr std::size_t max_server_name_size = 128;
+	};
+} // namespace spiritsaway::http_server
@@ -0,0 +1,71 @@
+#pragma once
+
+#if !defined(_WIN32)
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <asio.hpp>
+
+namespace spiritsaway::http_server
+{
+	class server_core;
+
+	/// Restart without refusing connections. The running process offers its listening
+	/// sockets on a Unix socket, a new process started with the same control path takes
+	/// them over with SCM_RIGHTS and accepts on them at once, while the old process stops
+	/// accepting and drains its connections.
+	///
+	/// In the new process call take_listeners before run, then serve so that the next
+	/// restart can take over from this process.
+	class hot_restart
+	{
+	public:
+		hot_restart(const hot_restart &) = delete;
+		hot_restart &operator=(const hot_restart &) = delete;
+
+		hot_restart(asio::io_context &io_context, const std::string &control_path);
+
+		/// Closes the listeners that were taken over but not used by run.
+		~hot_restart();
+
+		/// Ask the process serving on the control path for its listeners, blocks until they
+		/// arrive. False if no process serves there, err is set if one does but the handoff failed.
+		bool take_listeners(std::string &err);
+
+		/// Run server on the taken over listener of its address and port, or bind a new one.
+		void run(server_core &server);
+
+		/// Offer the listeners of servers to the next process on the control path. After
+		/// they have been sent on_handoff is called on the io_context, it usually calls
+		/// server_core::drain on the servers. The offer ends with the first handoff.
+		void serve(std::vector<server_core *> servers, std::function<void()> on_handoff);
+
+		/// Stop offering the listeners.
+		void close();
+
+	private:
+		struct inherited_listener
+		{
+			std::string name;
+			int fd;
+		};
+
+		void do_accept();
+		/// Send the listeners of servers_ on one control connection.
+		bool send_listeners(asio::local::stream_protocol::socket &control);
+
+		/// Most listeners passed in one handoff.
+		static constexpr std::size_t max_listeners = 16;
+
+		asio::io_context &io_context_;
+		const std::string control_path_;
+		asio::local::stream_protocol::acceptor control_acceptor_;
+		std::vector<inherited_listener> inherited_;
+		std::vector<server_core *> servers_;
+		std::function<void()> on_handoff_;
+	};
+
+} // namespace spiritsaway::http_server
+
+#endif
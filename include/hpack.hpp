@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "http_packet.hpp"
+
+namespace spiritsaway::http_server
+{
+	/// Default size of an HPACK dynamic table, SETTINGS_HEADER_TABLE_SIZE before it is changed.
+	constexpr std::size_t hpack_default_table_size = 4096;
+
+	/// The header table of one direction of an HTTP/2 connection, RFC 7541 section 2.3. Index 1
+	/// to 61 is the static table, the dynamic table follows with its newest entry first.
+	class hpack_table
+	{
+	public:
+		explicit hpack_table(std::size_t max_size = hpack_default_table_size);
+
+		/// The entry at index, nullptr if there is none.
+		const header *get(std::size_t index) const;
+
+		/// Insert an entry at the front of the dynamic table, evicting the oldest ones to make room.
+		void add(std::string name, std::string value);
+
+		/// Change the limit of the dynamic table, evicting entries that no longer fit.
+		void set_max_size(std::size_t max_size);
+
+		std::size_t max_size() const
+		{
+			return max_size_;
+		}
+
+		/// Index of an entry with name, name is lower case. value_matched tells whether the
+		/// entry also has value. Returns 0 if no entry has the name.
+		std::size_t find(std::string_view name, std::string_view value, bool &value_matched) const;
+
+		/// Entries in the static table.
+		static constexpr std::size_t static_size = 61;
+
+	private:
+		void evict(std::size_t needed);
+
+		std::deque<header> entries_;
+		/// Size of the dynamic table, the lengths of the entries plus 32 per entry.
+		std::size_t size_ = 0;
+		std::size_t max_size_;
+	};
+
+	/// Decodes the header blocks a client sends on one connection.
+	class hpack_decoder
+	{
+	public:
+		/// max_table_size is the SETTINGS_HEADER_TABLE_SIZE the server announced.
+		explicit hpack_decoder(std::size_t max_table_size = hpack_default_table_size);
+
+		/// Decode a whole header block and append its fields to headers. Returns false if the
+		/// block is invalid or its fields take more than max_list_size bytes, the table is
+		/// then out of sync and the connection must be closed.
+		bool decode(const char *data, std::size_t size, std::vector<header> &headers, std::size_t max_list_size);
+
+	private:
+		hpack_table table_;
+		const std::size_t max_table_size_;
+	};
+
+	/// Encodes the header blocks the server sends on one connection. Fields are taken from
+	/// the tables where they match, values that change with every reply are sent as
+	/// literals so that they do not push useful entries out of the dynamic table.
+	class hpack_encoder
+	{
+	public:
+		hpack_encoder();
+
+		/// Append the encoding of one field to out, name is lower case.
+		void encode(std::string_view name, std::string_view value, std::string &out);
+
+		/// Apply the SETTINGS_HEADER_TABLE_SIZE of the client, the next field is preceded by
+		/// a table size update.
+		void set_peer_max_table_size(std::size_t size);
+
+	private:
+		hpack_table table_;
+		bool size_update_pending_ = false;
+	};
+
+	/// Append an HPACK integer with an prefix_bits bit prefix, first_byte holds the bits above the prefix.
+	void hpack_encode_integer(std::uint64_t value, int prefix_bits, unsigned char first_byte, std::string &out);
+
+	/// Size of data after Huffman encoding.
+	std::size_t huffman_encoded_size(std::string_view data);
+
+	/// Append the Huffman encoding of data to out, padded with ones to a whole byte.
+	void huffman_encode(std::string_view data, std::string &out);
+
+	/// Append the decoding of a Huffman encoded string to out, false if it is invalid.
+	bool huffman_decode(const char *data, std::size_t size, std::string &out);
+
+} // namespace spiritsaway::http_server
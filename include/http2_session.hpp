@@ -0,0 +1,230 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "hpack.hpp"
+#include "http_packet.hpp"
+#include "output_queue.hpp"
+#include "server_options.hpp"
+
+namespace spiritsaway::http_server
+{
+	class admission_controller;
+	class metrics_registry;
+
+	/// Error codes of RST_STREAM and GOAWAY frames, RFC 7540 section 7.
+	namespace http2_error
+	{
+		constexpr std::uint32_t no_error = 0x0;
+		constexpr std::uint32_t protocol_error = 0x1;
+		constexpr std::uint32_t internal_error = 0x2;
+		constexpr std::uint32_t flow_control_error = 0x3;
+		constexpr std::uint32_t stream_closed = 0x5;
+		constexpr std::uint32_t frame_size_error = 0x6;
+		constexpr std::uint32_t refused_stream = 0x7;
+		constexpr std::uint32_t compression_error = 0x9;
+	}
+
+	/// The bytes every HTTP/2 client sends first.
+	constexpr std::string_view http2_client_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+	/// Whether the first bytes read from a connection may start the HTTP/2 preface.
+	bool is_http2_preface_start(const char *data, std::size_t size);
+
+	/// Whether req asks to switch the connection to HTTP/2 with Upgrade: h2c.
+	bool is_http2_upgrade(const request &req);
+
+	/// What an http2_session needs from the connection it runs on.
+	class http2_transport
+	{
+	public:
+		virtual ~http2_transport() = default;
+
+		/// Pass the request of a stream to the handler, its reply comes back to
+		/// http2_session::send_reply with the same stream id.
+		virtual void dispatch_stream(std::uint32_t stream_id, std::weak_ptr<request> req) = 0;
+
+		/// Run fn on the strand of the connection and write what it queued, unless the
+		/// connection is gone. May be called from any thread.
+		virtual void run_on_connection(std::function<void()> fn) = 0;
+	};
+
+	/// The HTTP/2 protocol of one connection, RFC 7540. Requests of concurrent streams are
+	/// dispatched as soon as they are complete, their replies are sent as they arrive in any
+	/// order and their DATA frames take turns under the flow control windows. Small frames
+	/// are gathered into one buffer and bodies are referenced where they are, so that the
+	/// frames of many streams leave in one write. Must only be used on the strand of its
+	/// connection.
+	class http2_session
+	{
+	public:
+		http2_session(const http2_session &) = delete;
+		http2_session &operator=(const http2_session &) = delete;
+
+		/// output is the output of the connection, which calls on_output_written after each write.
+		http2_session(std::weak_ptr<http2_transport> transport, output_queue &output, const server_options &options, admission_controller &admission, const std::string &remote_address, std::weak_ptr<output_control> output_control);
+
+		/// Releases the admission of streams that never got their reply.
+		~http2_session();
+
+		/// Queue the SETTINGS of the server, for a client that started with the preface.
+		void start();
+
+		/// Like start, after the 101 reply to the Upgrade: h2c request req, which becomes
+		/// stream 1. settings is its HTTP2-Settings header. Returns false if that is invalid.
+		bool start_upgraded(std::string_view settings, std::shared_ptr<request> req);
+
+		/// Handle bytes read from the socket. Returns false after a connection error.
+		bool on_input(const char *data, std::size_t size);
+
+		/// Send the reply of a stream, ignored if the stream has been reset meanwhile.
+		void send_reply(std::uint32_t stream_id, reply rep);
+
+		/// The connection wrote some output, so more DATA frames fit.
+		void on_output_written();
+
+		/// Refuse new streams and tell the client with GOAWAY. The open streams still get
+		/// their replies, then the session is finished.
+		void go_away();
+
+		/// Whether the connection should close once its output is written.
+		bool finished() const
+		{
+			return failed_ || ((going_away_ || peer_going_away_) && streams_.empty());
+		}
+
+		std::size_t open_streams() const
+		{
+			return streams_.size();
+		}
+
+	private:
+		/// Part of a body waiting for the flow control windows.
+		struct data_piece
+		{
+			std::shared_ptr<const void> owner;
+			asio::const_buffer data;
+		};
+
+		struct stream
+		{
+			std::shared_ptr<request> req;
+			/// Flow control windows, the one we send on may become negative by a SETTINGS change.
+			std::int64_t send_window = 0;
+			std::int64_t recv_window = 0;
+			bool remote_closed = false;
+			bool head_request = false;
+			/// Whether the stream holds an admission slot, released by its reply.
+			bool admitted = false;
+			std::chrono::steady_clock::time_point begin;
+
+			bool replied = false;
+			std::deque<data_piece> pending;
+			std::size_t pending_size = 0;
+			std::shared_ptr<body_source> body_stream;
+			bool body_reading = false;
+			/// Whether pending holds the rest of the body.
+			bool body_complete = false;
+			bool end_sent = false;
+			/// Set when the body_source failed, the stream is reset by the next send_pending.
+			bool body_failed = false;
+		};
+		using stream_map = std::map<std::uint32_t, stream>;
+
+		/// Handle the complete frames at the start of data, returns the bytes they took.
+		std::size_t handle_frames(const char *data, std::size_t size);
+		void handle_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id, std::string_view payload);
+		void handle_headers(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload);
+		void handle_continuation(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload);
+		void handle_header_block(std::uint32_t stream_id, bool end_stream, std::string_view block);
+		void handle_data(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload);
+		void handle_settings(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload);
+		void handle_window_update(std::uint32_t stream_id, std::string_view payload);
+		void handle_rst_stream(std::uint32_t stream_id, std::string_view payload);
+
+		/// Apply the settings of the client, false after a connection error.
+		bool apply_settings(std::string_view payload);
+
+		/// Fill req from the fields of a header block, false if they are malformed.
+		bool build_request(std::vector<header> &fields, request &req) const;
+
+		/// The request of a stream is complete, pass it to the handler. The stream may be
+		/// gone once this returns.
+		void end_of_request(std::uint32_t stream_id, stream &cur_stream);
+
+		/// Queue the HEADERS of a reply, split into CONTINUATION frames if needed.
+		void queue_headers(std::uint32_t stream_id, const std::string &block, bool end_stream);
+
+		/// Queue the DATA frames that the windows and the output allow, one frame per stream
+		/// in turn. Finished streams are erased.
+		void send_pending();
+
+		/// Queue the next DATA frame of a stream, false if it has none to send now.
+		bool send_stream_frame(std::uint32_t stream_id, stream &cur_stream);
+		void read_body(std::uint32_t stream_id, stream &cur_stream);
+		void on_body_piece(std::uint32_t stream_id, const std::string &err, std::shared_ptr<const std::string> data, bool finished);
+
+		void queue_frame_header(std::size_t length, std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id);
+		void queue_window_update(std::uint32_t stream_id, std::uint32_t increment);
+		void queue_rst_stream(std::uint32_t stream_id, std::uint32_t error_code);
+		void queue_goaway(std::uint32_t error_code);
+
+		/// Reset a stream and forget it.
+		void reset_stream(std::uint32_t stream_id, std::uint32_t error_code);
+		stream_map::iterator erase_stream(stream_map::iterator iter);
+		void connection_error(std::uint32_t error_code);
+
+		/// Move the gathered frames into the output.
+		void commit_frames();
+
+		std::weak_ptr<http2_transport> transport_;
+		output_queue &output_;
+		const server_options &options_;
+		admission_controller &admission_;
+		metrics_registry *const metrics_;
+		const std::string remote_address_;
+		const std::weak_ptr<output_control> output_control_;
+
+		hpack_decoder decoder_;
+		hpack_encoder encoder_;
+
+		/// Small frames gathered for the next push into output_.
+		std::string frames_;
+
+		/// Received bytes of an incomplete frame, frames that arrive whole are handled in the read buffer.
+		std::string input_;
+		std::size_t preface_remaining_ = http2_client_preface.size();
+		bool settings_received_ = false;
+
+		/// The stream whose header block goes on in CONTINUATION frames, 0 if none.
+		std::uint32_t continuation_stream_ = 0;
+		bool continuation_end_stream_ = false;
+		std::string header_block_;
+
+		stream_map streams_;
+		/// Highest stream id the client has opened.
+		std::uint32_t last_stream_id_ = 0;
+
+		/// Connection flow control windows.
+		std::int64_t send_window_ = 65535;
+		std::int64_t recv_window_ = 65535;
+
+		/// Settings of the client.
+		std::int64_t peer_initial_window_ = 65535;
+		std::size_t peer_max_frame_size_ = 16384;
+
+		/// Set while send_pending runs, a body piece that arrives meanwhile asks for another round.
+		bool sending_ = false;
+		bool send_again_ = false;
+
+		bool going_away_ = false;
+		bool peer_going_away_ = false;
+		bool failed_ = false;
+	};
+
+} // namespace spiritsaway::http_server
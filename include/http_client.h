@@ -5,41 +5,124 @@
 #include <iostream>
 #include <istream>
 #include <ostream>
+#include <mutex>
+#include <unordered_map>
 #include <asio.hpp>
 #include "reply_parser.h"
+#include "socket_options.hpp"
 
 namespace spiritsaway::http_server
 {
+	/// Idle keep-alive connections to upstream servers, shared by the http_clients that
+	/// talk to the same hosts so that each request does not pay for a new connection.
+	class http_client_pool
+	{
+	public:
+		http_client_pool(const http_client_pool &) = delete;
+		http_client_pool &operator=(const http_client_pool &) = delete;
+
+		explicit http_client_pool(std::size_t max_idle_per_host = 16, std::uint32_t idle_timeout_seconds = 30, const socket_options &options = socket_options());
+
+		/// Take an idle connection to the server that the peer has not closed yet.
+		bool acquire(const std::string &server_url, const std::string &server_port, asio::ip::tcp::socket &socket);
+
+		/// Give back a connection after a complete exchange so that later requests can reuse it.
+		void release(const std::string &server_url, const std::string &server_port, asio::ip::tcp::socket &&socket);
+
+		std::size_t get_idle_count();
+
+		/// Options of the new connections of the clients using this pool.
+		const socket_options &get_socket_options() const
+		{
+			return m_socket_options;
+		}
+
+	private:
+		struct idle_socket
+		{
+			asio::ip::tcp::socket socket;
+			std::chrono::steady_clock::time_point idle_since;
+		};
+		std::mutex m_mutex;
+		std::unordered_map<std::string, std::vector<idle_socket>> m_idle_sockets;
+		const std::size_t m_max_idle_per_host;
+		const std::chrono::seconds m_idle_timeout;
+		const socket_options m_socket_options;
+	};
+
 	class http_client : public std::enable_shared_from_this<http_client>
 	{
 	private:
 		asio::ip::tcp::resolver m_resolver;
 		asio::ip::tcp::socket m_socket;
 		std::function<void(const std::string &, const reply &)> m_callback;
-		const std::string m_req_str;
+		std::string m_req_str;
 		const std::string m_server_url;
 		const std::string m_server_port;
 		std::string m_header_read_buffer;
 		std::array<char, 4096> m_content_read_buffer;
 		reply m_reply;
-		std::ostringstream reply_oss;
 		// timeout timer
 		asio::basic_waitable_timer<std::chrono::steady_clock> m_timer;
 		const std::size_t m_timeout_seconds = 5;
 		reply_parser m_rep_parser;
 
+		std::shared_ptr<http_client_pool> m_pool;
+		/// Streamed body of the request, sent chunked after m_req_str.
+		std::shared_ptr<body_source> m_req_body_stream;
+		/// Whether m_socket came from m_pool, a failure before any reply data then retries on a new connection.
+		bool m_reused_socket = false;
+		/// Whether the method of the request allows such a retry.
+		const bool m_idempotent;
+		bool m_reply_started = false;
+		/// Whether the whole request including a streamed body has been written.
+		bool m_request_sent = false;
+		bool m_callback_invoked = false;
+		bool m_exchange_done = false;
+		bool m_stream_reply = false;
+		std::string m_chunk_header;
+		std::string m_chunk_data;
+		/// Pending read of the streamed reply body.
+		body_source::read_handler m_body_read_cb;
+		socket_options m_socket_options;
+
 	public:
 		http_client(asio::io_context &io_context, const std::string &server_url, const std::string &server_port, const request &req, std::function<void(const std::string &, const reply &)> callback, std::uint32_t timeout_second);
+
+		/// Construct a client that reuses keep-alive connections from pool and returns its
+		/// connection there after the reply.
+		http_client(asio::io_context &io_context, const std::string &server_url, const std::string &server_port, const request &req, std::function<void(const std::string &, const reply &)> callback, std::uint32_t timeout_second, std::shared_ptr<http_client_pool> pool);
+
+		/// Invoke the callback as soon as the reply headers arrive, the body is then read
+		/// from reply::body_stream. Must be called before run.
+		void set_stream_reply(bool enabled);
+
+		/// Options of a new connection, taken from the pool if there is one. Must be called before run.
+		void set_socket_options(const socket_options &options);
+
 		void run();
 		static std::string req_to_str(const request &req, const std::string &server_url, const std::string &server_port);
+		static std::string req_to_str(const request &req, const std::string &server_url, const std::string &server_port, bool keep_alive);
 		static std::string parse_uri(const std::string& full_path, std::string& server_url, std::string& server_port, std::string& resource_path);
 
+		/// Read the next piece of a streamed reply body, used by reply::body_stream.
+		void read_reply_body(body_source::read_handler cb);
+
 	private:
+		void do_connect();
 		void handle_resolve(const asio::error_code& error, asio::ip::tcp::resolver::iterator iterator);
 		void handle_connect(const asio::error_code &err);
 		void handle_write_request(const asio::error_code &err);
+		void write_request_body();
+		void do_read_content();
 		void handle_read_content(const asio::error_code &err, std::size_t n);
+		void do_read_body(body_source::read_handler cb);
+		void finish_exchange();
+		/// Retry an idempotent request on a new connection when a reused one turns out to be
+		/// closed, returns false if that is not possible.
+		bool retry_connect(const asio::error_code &err);
 		void invoke_callback(const std::string &err);
+		void reset_timer();
 		void on_timeout(const asio::error_code &err);
 	};
-}
\ No newline at end of file
+}
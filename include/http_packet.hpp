@@ -3,6 +3,7 @@
 #include <vector>
 #include <functional>
 #include <memory>
+#include <string_view>
 namespace spiritsaway::http_server
 {
     struct header
@@ -10,6 +11,53 @@ namespace spiritsaway::http_server
 		std::string name;
 		std::string value;
 	};
+    /// A body produced piece by piece instead of being held in one string, so that large
+    /// bodies can be forwarded without buffering them whole.
+    class body_source
+    {
+    public:
+        /// Called with an error message (empty on success), the next piece of the body and
+        /// whether it is the last one.
+        using read_handler = std::function<void(const std::string& err, std::string data, bool finished)>;
+
+        virtual ~body_source() = default;
+
+        /// Ask for the next piece of the body, at most one read may be outstanding.
+        virtual void read(read_handler cb) = 0;
+
+        /// Like read_handler, but the piece may be shared with other readers and is never changed.
+        using shared_read_handler = std::function<void(const std::string& err, std::shared_ptr<const std::string> data, bool finished)>;
+
+        /// Whether the pieces are kept in shared buffers, so that the connection should read
+        /// them with read_shared and write them without a copy.
+        virtual bool shares_pieces() const
+        {
+            return false;
+        }
+
+        /// Like read for sources that share their pieces, the default copies a piece from read.
+        virtual void read_shared(shared_read_handler cb)
+        {
+            read([cb = std::move(cb)](const std::string& err, std::string data, bool finished)
+                {
+                    cb(err, std::make_shared<const std::string>(std::move(data)), finished);
+                });
+        }
+    };
+
+    class websocket_handler;
+
+    /// Holds back the writes of a connection while a handler produces several pieces of a
+    /// reply, so that they leave in one write. Every cork must be followed by an uncork.
+    class output_control
+    {
+    public:
+        virtual ~output_control() = default;
+
+        virtual void cork() = 0;
+        virtual void uncork() = 0;
+    };
+
     /// A request received from a client.
     struct request
     {
@@ -19,6 +67,34 @@ namespace spiritsaway::http_server
         int http_version_minor;
         std::vector<header> headers;
         std::string body;
+
+        /// Set instead of body when the server streams the request body to the handler,
+        /// see server_options::stream_request_body.
+        std::shared_ptr<body_source> body_stream;
+
+        /// Address of the client that sent the request, filled in by the connection.
+        std::string remote_address;
+
+        /// The output of the connection, expired once the connection is gone.
+        std::weak_ptr<output_control> output;
+    };
+
+    /// A reply flattened into wire format. The status line is kept apart from the rest so
+    /// that the per-thread Date and Server lines can be sent between them without a copy.
+    struct serialized_reply
+    {
+        std::string status_line;
+
+        /// Headers, the empty line and the content.
+        std::string remain;
+
+        /// Whether the reply already carries its own Date or Server header.
+        bool has_date = false;
+        bool has_server = false;
+
+        /// Whether the reply carries a Connection header and whether it is Connection: close.
+        bool has_connection = false;
+        bool close_connection = false;
     };
 
     /// A reply to be sent to a client.
@@ -39,10 +115,12 @@ namespace spiritsaway::http_server
             unauthorized = 401,
             forbidden = 403,
             not_found = 404,
+            too_many_requests = 429,
             internal_server_error = 500,
             not_implemented = 501,
             bad_gateway = 502,
-            service_unavailable = 503
+            service_unavailable = 503,
+            gateway_timeout = 504
         };
         std::string status;
 
@@ -52,12 +130,48 @@ namespace spiritsaway::http_server
         /// The content to be sent in the reply.
         std::string content;
 
+        /// Wire format built ahead of time, e.g. by a response cache. When set it is sent
+        /// as is and the status, headers and content above are ignored.
+        std::shared_ptr<const serialized_reply> prebuilt;
+
+        /// When set the content is read from it after the headers have been sent. Without
+        /// a Content-Length header the body is sent chunked.
+        std::shared_ptr<body_source> body_stream;
+
+        /// Set by make_websocket_reply, the connection speaks WebSocket to it after this 101 reply.
+        std::shared_ptr<websocket_handler> websocket;
 
         std::string to_string();
 
+        /// Serialize into wire format, leaving out the cached Date and Server lines.
+        serialized_reply serialize() const;
+
+        /// Like serialize but reuses the capacity of result.
+        void serialize_into(serialized_reply& result) const;
+
+        /// Get the numeric status code from the status line, 0 if it has none.
+        int get_status_code() const;
+
         /// Get a stock reply.
         static reply stock_reply(status_type status);
     };
+    /// Compare two strings ignoring ASCII case, as header names and tokens are compared.
+    bool iequals(std::string_view a, std::string_view b);
+
+    /// Strip leading and trailing spaces and tabs.
+    std::string_view trim_spaces(std::string_view value);
+
+    /// Whether a comma separated header value contains token, compared case-insensitively.
+    /// value may be nullptr for a missing header.
+    bool has_token(const std::string* value, std::string_view token);
+
+    /// Find the value of the first header with the given name, compared case-insensitively.
+    /// Returns nullptr if there is no such header.
+    const std::string* find_header(const std::vector<header>& headers, std::string_view name);
+
+    /// Replace the value of the first header with the given name, or append a new header.
+    void set_header(std::vector<header>& headers, std::string_view name, std::string_view value);
+
     using reply_handler = std::function<void(const reply& rep)>;
     using request_handler = std::function<void(std::weak_ptr<request> req, reply_handler cb)>;
 }
\ No newline at end of file
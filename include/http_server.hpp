@@ -4,51 +4,173 @@
 #include <string>
 #include "connection.hpp"
 #include "connection_manager.hpp"
+#include "connection_pool.hpp"
+#include "admission_control.hpp"
+#include "reply_mailbox.hpp"
 
 
 namespace spiritsaway::http_server
 {
 
-	/// The top-level class of the HTTP server.
-	class server
+	/// The part of the HTTP server that does not depend on the handler type, see basic_server.
+	class server_core
 	{
 	public:
-		server(const server &) = delete;
-		server &operator=(const server &) = delete;
+		server_core(const server_core &) = delete;
+		server_core &operator=(const server_core &) = delete;
 
-		/// Construct the server to listen on the specified TCP address and port, and
-		/// serve up files from the given directory.
-		explicit server(asio::io_context &io_context, const std::string &address, const std::string &port, const request_handler &handler);
+		/// Construct the server to listen on the specified TCP address and port. io_context may
+		/// be run by several threads, every connection runs on a strand of its own.
+		server_core(asio::io_context &io_context, const std::string &address, const std::string &port, const server_options &options);
+
+		virtual ~server_core() = default;
 
 		/// Run the server's io_context loop.
 		void run();
 
+		/// Accept on a listening socket that is already bound, e.g. one handed over by hot_restart.
+		void run(const asio::ip::tcp &protocol, asio::ip::tcp::acceptor::native_handle_type listener);
+
+		/// The listening socket, for handing it to another process.
+		asio::ip::tcp::acceptor::native_handle_type native_listener()
+		{
+			return acceptor_.native_handle();
+		}
+
+		/// Close the listening socket but let the open connections go on. May be called from any thread.
+		void stop_accepting();
+
+		/// Shut down without aborting requests: stop accepting, close idle connections and
+		/// the others once their current reply is written, and close whatever is still open
+		/// after drain_timeout_seconds. Progress goes to drain_progress_handler. May be
+		/// called from any thread.
+		void drain();
+
+		bool is_draining() const
+		{
+			return draining_.load(std::memory_order_relaxed);
+		}
+
+		/// Close the listening socket and every connection. May be called from any thread,
+		/// it is done on the strand of the server unless the io_context has stopped.
 		void stop();
 
+		const std::string &get_address() const
+		{
+			return address_;
+		}
+		const std::string &get_port() const
+		{
+			return port_;
+		}
+
 		std::size_t get_connection_count();
 
+		connection_pool_statistics get_pool_statistics() const
+		{
+			return pool_->get_statistics();
+		}
+
+	protected:
+		/// Create the connection for an accepted socket.
+		virtual connection_ptr make_connection(asio::ip::tcp::socket socket) = 0;
+
 	private:
 		/// Perform an asynchronous accept operation.
 		void do_accept();
 
+		/// Check the accept_rate_limiter, a refused socket is answered and closed.
+		bool admit_remote(asio::ip::tcp::socket &socket);
+
+		/// Continue accepting if it was paused by max_connections and a connection has closed since.
+		void resume_accept();
+
+		/// Check whether the drain is over, report its progress and wait for the next tick.
+		void on_drain_tick();
+
 
 		/// The io_context used to perform asynchronous operations.
 		asio::io_context &io_context_;
 
+		/// Runs the accept, signal and drain handlers one at a time when several threads run io_context.
+		asio::strand<asio::io_context::executor_type> strand_;
+
 		/// The signal_set is used to register for process termination notifications.
 		asio::signal_set signals_;
 
 		/// Acceptor used to listen for incoming connections.
 		asio::ip::tcp::acceptor acceptor_;
 
+		const std::string address_;
+		const std::string port_;
+
+		/// Whether do_accept stopped because max_connections connections are open.
+		std::atomic<bool> accept_paused_{false};
+
+		std::atomic<bool> draining_{false};
+		asio::steady_timer drain_timer_;
+		std::chrono::steady_clock::time_point drain_begin_;
+		std::uint32_t drain_ticks_ = 0;
+
+	protected:
 		/// The connection manager which owns all live connections.
 		connection_manager connection_manager_;
 
-		/// The handler for all incoming requests.
-		const request_handler request_handler_;
+		/// Settings shared with every connection.
+		const std::shared_ptr<const server_options> options_;
 
-		const std::string address_;
-		const std::string port_;
+		admission_controller admission_;
+
+		/// Replies from handler threads on their way to the I/O threads.
+		reply_mailbox mailbox_;
+
+		/// Closed connections waiting for the next accept, shared with the connection_ptr deleters.
+		const std::shared_ptr<connection_pool> pool_;
 	};
 
+	/// The HTTP server for a handler of type Handler, called as
+	/// handler(std::weak_ptr<request>, reply_handler). The handler is stored once and
+	/// every connection calls it directly, so a lambda or function object can be inlined
+	/// into the read path instead of going through std::function.
+	template <typename Handler>
+	class basic_server : public server_core
+	{
+	public:
+		basic_server(asio::io_context &io_context, const std::string &address, const std::string &port, Handler handler, const server_options &options = server_options())
+			: server_core(io_context, address, port, options),
+			  handler_(std::move(handler))
+		{
+		}
+
+		~basic_server()
+		{
+			// connections refer to handler_
+			stop();
+		}
+
+	protected:
+		connection_ptr make_connection(asio::ip::tcp::socket socket) override
+		{
+			// every connection of this pool is a basic_connection<Handler>
+			auto con = static_cast<basic_connection<Handler> *>(pool_->acquire());
+			if (con)
+			{
+				con->reset(std::move(socket));
+			}
+			else
+			{
+				pool_->count_created();
+				con = new basic_connection<Handler>(std::move(socket), connection_manager_, handler_, options_, admission_, mailbox_);
+			}
+			return connection_ptr(con, connection_pool::recycler{pool_});
+		}
+
+	private:
+		/// The handler for all incoming requests.
+		const Handler handler_;
+	};
+
+	/// The server for type erased handlers.
+	using server = basic_server<request_handler>;
+
 } // namespace spiritsaway::http_server
\ No newline at end of file
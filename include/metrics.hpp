@@ -0,0 +1,150 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "http_packet.hpp"
+
+namespace spiritsaway::http_server
+{
+	/// A counter written by a single thread. The owner updates it without a locked
+	/// instruction, other threads may only read it.
+	class local_counter
+	{
+	public:
+		void add(std::uint64_t n)
+		{
+			value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+		std::uint64_t get() const
+		{
+			return value_.load(std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<std::uint64_t> value_{0};
+	};
+
+	/// Merged view of latency_histogram values in microseconds.
+	struct histogram_snapshot
+	{
+		std::vector<std::uint64_t> buckets;
+		std::uint64_t count = 0;
+		std::uint64_t sum_us = 0;
+
+		/// Lower bound of the bucket that holds quantile q in [0, 1], 0 when empty.
+		std::uint64_t quantile(double q) const;
+
+		/// Number of values below limit_us, exact when limit_us is a power of two.
+		std::uint64_t count_below(std::uint64_t limit_us) const;
+	};
+
+	/// Log-linear histogram of microsecond values in the style of HDR histograms: every
+	/// power of two is split into 8 buckets, so a value is known to within 12.5% from one
+	/// microsecond up to about 3 days. Single writer, like local_counter.
+	class latency_histogram
+	{
+	public:
+		static constexpr std::size_t sub_bucket_bits = 3;
+		static constexpr std::size_t sub_bucket_count = 1 << sub_bucket_bits;
+		static constexpr std::size_t max_exponent = 38;
+		static constexpr std::size_t bucket_count = (max_exponent - sub_bucket_bits + 2) * sub_bucket_count;
+
+		static std::size_t bucket_of(std::uint64_t value_us);
+		static std::uint64_t bucket_lower_bound(std::size_t index);
+
+		void record(std::uint64_t value_us);
+		void merge_into(histogram_snapshot &result) const;
+
+	private:
+		std::array<local_counter, bucket_count> buckets_;
+		local_counter sum_us_;
+	};
+
+	enum class server_metric
+	{
+		requests,
+		received_bytes,
+		sent_bytes,
+		parse_errors,
+		timeouts,
+		shed_requests,
+		replies_1xx,
+		replies_2xx,
+		replies_3xx,
+		replies_4xx,
+		replies_5xx,
+		replies_other,
+		count
+	};
+
+	/// Server metrics kept per thread and merged only when they are read, so that the
+	/// request path never writes to a cache line shared with another thread.
+	class metrics_registry
+	{
+	public:
+		/// Maximum number of routes, fixed so that the per thread tables never move.
+		static constexpr std::size_t max_routes = 64;
+
+		/// Route id of the latency of every request, measured by the connection.
+		static constexpr std::size_t all_routes = 0;
+
+		metrics_registry(const metrics_registry &) = delete;
+		metrics_registry &operator=(const metrics_registry &) = delete;
+
+		metrics_registry();
+		~metrics_registry();
+
+		/// Register a route for per route latency, returns its id or the id of a route with
+		/// the same name. When max_routes is reached all_routes is returned.
+		std::size_t add_route(const std::string &name);
+
+		void add(server_metric metric, std::uint64_t n = 1);
+		void record_latency(std::size_t route_id, std::chrono::steady_clock::duration latency);
+		/// Count a reply under the class of its status code.
+		void record_status(int status_code);
+
+		/// Sum of a metric over all threads.
+		std::uint64_t get(server_metric metric) const;
+		histogram_snapshot get_latency(std::size_t route_id) const;
+
+		/// All metrics in the Prometheus text exposition format.
+		std::string to_prometheus() const;
+
+	private:
+		/// Metrics of one thread, aligned so that neighbouring shards never share a cache line.
+		struct alignas(64) shard
+		{
+			std::array<local_counter, static_cast<std::size_t>(server_metric::count)> counters;
+			/// Created by the owning thread on first use, read by scrapes.
+			std::array<std::atomic<latency_histogram *>, max_routes> latencies{};
+			shard *next = nullptr;
+
+			~shard();
+		};
+
+		/// Shard of the calling thread, registered on the first call.
+		shard &local();
+
+		/// Never reused, so that a thread cache entry of a destroyed registry can not match a new one.
+		const std::uint64_t id_;
+		/// Lock-free list of all shards, threads only ever push to the front.
+		std::atomic<shard *> shards_{nullptr};
+
+		std::mutex route_mutex_;
+		std::array<std::string, max_routes> route_names_;
+		std::atomic<std::size_t> route_count_{0};
+	};
+
+	/// Measure the latency of next from the call to the reply under route_name.
+	request_handler make_metrics_handler(request_handler next, std::shared_ptr<metrics_registry> registry, const std::string &route_name);
+
+	/// Create a handler that serves the metrics of registry in the Prometheus text format.
+	request_handler make_metrics_endpoint_handler(std::shared_ptr<metrics_registry> registry);
+
+} // namespace spiritsaway::http_server
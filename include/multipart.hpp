@@ -0,0 +1,118 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "http_packet.hpp"
+
+namespace spiritsaway::http_server
+{
+	/// The boundary parameter of a multipart Content-Type value, empty if the type is not
+	/// multipart or has no valid boundary.
+	std::string multipart_boundary(std::string_view content_type);
+
+	/// The headers of one part of a multipart body.
+	struct multipart_part
+	{
+		std::vector<header> headers;
+
+		/// The name and filename parameters of Content-Disposition, empty if absent.
+		std::string name;
+		std::string filename;
+
+		/// The Content-Type of the part, empty if absent.
+		std::string content_type;
+	};
+
+	/// An incremental parser for multipart bodies such as multipart/form-data, RFC 7578.
+	/// The body may be fed in pieces of any size. Boundaries are found with a
+	/// Boyer-Moore-Horspool search and part data is passed on as slices of the input, only
+	/// the few bytes at the end of a piece that may start a boundary are held back.
+	class multipart_parser
+	{
+	public:
+		multipart_parser(const multipart_parser &) = delete;
+		multipart_parser &operator=(const multipart_parser &) = delete;
+
+		/// Called when the headers of a part are complete.
+		using part_handler = std::function<void(const multipart_part &part)>;
+
+		/// Called with the next slice of data of the current part, only valid during the call.
+		using data_handler = std::function<void(std::string_view data)>;
+
+		/// Called after the last data of a part.
+		using part_end_handler = std::function<void()>;
+
+		/// Parts whose headers take more than max_header_size bytes make the body invalid.
+		multipart_parser(std::string_view boundary, part_handler on_part, data_handler on_data, part_end_handler on_part_end, std::size_t max_header_size = 16 * 1024);
+
+		/// Result of parse.
+		enum class result_type
+		{
+			good,
+			bad,
+			indeterminate
+		};
+
+		/// Parse the next piece of the body. Returns good once the closing boundary has been
+		/// seen, the rest of the body is ignored. Returns bad if the body or the boundary is
+		/// invalid, indeterminate when more data is required.
+		result_type parse(const char *input, std::size_t len);
+
+	private:
+		enum class state
+		{
+			preamble,
+			boundary_end,
+			boundary_padding,
+			boundary_lf,
+			close_dash,
+			part_headers,
+			part_data,
+			epilogue,
+			failed
+		};
+
+		/// Scan data of the preamble or of a part for the delimiter, returns the bytes taken.
+		std::size_t scan_data(std::string_view input);
+
+		/// Position of the first delimiter in input, npos if there is none.
+		std::size_t find_delimiter(std::string_view input) const;
+
+		/// Position of the suffix of input that may be the start of a delimiter, input.size() if none.
+		std::size_t partial_delimiter(std::string_view input) const;
+
+		void emit_data(std::string_view data);
+		void on_delimiter();
+
+		/// Take header bytes up to the empty line, returns the bytes taken.
+		std::size_t scan_headers(std::string_view input);
+		bool parse_headers();
+
+		/// CRLF, "--" and the boundary, the first one is preceded by a CRLF carried in partial_.
+		std::string delimiter_;
+		std::array<std::size_t, 256> skip_;
+
+		part_handler on_part_;
+		data_handler on_data_;
+		part_end_handler on_part_end_;
+		const std::size_t max_header_size_;
+
+		state state_ = state::preamble;
+
+		/// The end of the last piece, a prefix of delimiter_ that the next piece may complete.
+		std::string partial_;
+
+		/// The header block of the current part, following the CRLF of its delimiter line.
+		std::string header_block_;
+		multipart_part part_;
+	};
+
+	/// Feed the body of req into parser, read from req->body_stream if the body is streamed.
+	/// done is called once, with an empty error after the closing boundary.
+	void read_multipart_body(std::shared_ptr<request> req, std::shared_ptr<multipart_parser> parser, std::function<void(const std::string &err)> done);
+
+} // namespace spiritsaway::http_server
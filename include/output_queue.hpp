@@ -0,0 +1,71 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <asio.hpp>
+
+namespace spiritsaway::http_server
+{
+	/// Bytes waiting to be written to a connection. Replies and body pieces are queued as
+	/// they become ready and leave in as few writes as possible, each write gathering up to
+	/// max_segments buffers and max_bytes bytes into one writev.
+	class output_queue
+	{
+	public:
+		output_queue(std::size_t max_bytes, std::size_t max_segments);
+
+		/// Queue data owned by the queue, empty data is ignored.
+		void push(std::string data);
+
+		/// Queue data owned by owner, which is kept alive until the data is written.
+		void push(std::shared_ptr<const void> owner, asio::const_buffer data);
+
+		bool empty() const
+		{
+			return segments_.empty();
+		}
+
+		/// Bytes not written yet.
+		std::size_t size() const
+		{
+			return size_;
+		}
+
+		/// Whether a producer should wait for a write before it queues more.
+		bool full() const
+		{
+			return size_ >= max_bytes_ || segments_.size() >= max_segments_;
+		}
+
+		/// Buffers of the next write, valid until consume.
+		const std::vector<asio::const_buffer> &prepare();
+
+		/// Drop the bytes a write has sent.
+		void consume(std::size_t bytes_transferred);
+
+		void clear();
+
+		/// An empty string that may keep the capacity of written data, to serialize the next reply into.
+		std::string take_spare();
+
+	private:
+		struct segment
+		{
+			std::string data;
+			std::shared_ptr<const void> owner;
+			/// The part not written yet, points into data or into memory of owner.
+			asio::const_buffer buffer;
+		};
+
+		const std::size_t max_bytes_;
+		const std::size_t max_segments_;
+		/// A deque so that the buffers into data stay valid while the queue grows.
+		std::deque<segment> segments_;
+		std::vector<asio::const_buffer> prepared_;
+		std::vector<std::string> spares_;
+		std::size_t size_ = 0;
+	};
+
+} // namespace spiritsaway::http_server
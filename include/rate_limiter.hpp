@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "http_packet.hpp"
+
+namespace spiritsaway::http_server
+{
+	struct rate_limit_options
+	{
+		/// Sustained rate allowed for one key.
+		double requests_per_second = 10;
+
+		/// Requests a key may send at once after being quiet.
+		std::uint32_t burst = 20;
+
+		std::size_t shard_count = 16;
+
+		/// Keys without requests for this long are dropped from the table.
+		std::uint32_t idle_seconds = 60;
+
+		/// Request header that names the client, e.g. an API key or X-Forwarded-For set by a
+		/// trusted proxy. The remote address is used when empty or missing.
+		std::string key_header;
+	};
+
+	/// Token buckets per client key. Each bucket is a single atomic in the form of the
+	/// generic cell rate algorithm, so a request that finds its key only takes a shared
+	/// lock of one shard, without allocating, and then updates the bucket with a compare
+	/// and swap. The shared lock is what lets eviction free idle buckets safely, it costs
+	/// one atomic increment on a shard picked by the key hash, the same order as the bucket
+	/// update itself.
+	class rate_limiter
+	{
+	public:
+		rate_limiter(const rate_limiter &) = delete;
+		rate_limiter &operator=(const rate_limiter &) = delete;
+
+		explicit rate_limiter(const rate_limit_options &options = rate_limit_options());
+
+		/// Take a token from the bucket of key, false if it is empty.
+		bool try_acquire(std::string_view key);
+
+		/// The key of req according to options().key_header.
+		std::string_view key_of(const request &req) const;
+
+		std::size_t get_entry_count();
+
+		const rate_limit_options &options() const
+		{
+			return options_;
+		}
+
+		/// The 429 sent to limited clients, serialized once.
+		static const reply &limited_reply();
+
+	private:
+		struct bucket
+		{
+			explicit bucket(std::string_view in_key)
+				: key(in_key)
+			{
+			}
+
+			const std::string key;
+			/// Theoretical arrival time in steady clock microseconds, the bucket is full once it is in the past.
+			std::atomic<std::int64_t> tat_us{0};
+		};
+
+		struct shard
+		{
+			std::shared_mutex mutex;
+			/// Keyed by a view of bucket::key, so that looking up a string_view does not
+			/// build a std::string.
+			std::unordered_map<std::string_view, std::unique_ptr<bucket>> buckets;
+			std::atomic<std::int64_t> next_eviction_us{0};
+		};
+
+		bool take_token(std::atomic<std::int64_t> &tat, std::int64_t now) const;
+		void evict_idle(shard &cur_shard, std::int64_t now);
+
+		const rate_limit_options options_;
+		const std::int64_t emission_interval_us_;
+		const std::int64_t burst_tolerance_us_;
+		const std::int64_t idle_us_;
+		std::vector<std::unique_ptr<shard>> shards_;
+	};
+
+	/// Answer requests over the limit of their key with 429 instead of calling next.
+	request_handler make_rate_limit_handler(request_handler next, std::shared_ptr<rate_limiter> limiter);
+
+} // namespace spiritsaway::http_server
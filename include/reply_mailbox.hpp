@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <asio.hpp>
+#include "http_packet.hpp"
+
+namespace spiritsaway::http_server
+{
+	class connection;
+
+	/// Hands replies produced on foreign threads to the I/O threads of an io_context.
+	/// Producers push onto a lock-free multi producer, single consumer queue and only the
+	/// push that finds the queue idle posts a drain, so a burst of replies from worker
+	/// threads costs one wakeup of the io_context instead of one post per reply. The drain
+	/// hands every reply to the strand of its connection, inline when the strand is idle.
+	class reply_mailbox
+	{
+	public:
+		reply_mailbox(const reply_mailbox &) = delete;
+		reply_mailbox &operator=(const reply_mailbox &) = delete;
+
+		explicit reply_mailbox(asio::io_context &io_context);
+
+		/// Drops replies that were never drained.
+		~reply_mailbox();
+
+		/// Queue rep to the request request_id of con, may be called from any thread.
+		void deliver(std::shared_ptr<connection> con, std::uint64_t request_id, reply rep);
+
+		/// Replies handed over so far and the drains that carried them.
+		std::uint64_t get_delivered_count() const
+		{
+			return delivered_count_.load(std::memory_order_relaxed);
+		}
+		std::uint64_t get_drain_count() const
+		{
+			return drain_count_.load(std::memory_order_relaxed);
+		}
+
+	private:
+		struct node
+		{
+			std::atomic<node *> next{nullptr};
+			std::shared_ptr<connection> con;
+			std::uint64_t request_id = 0;
+			reply rep;
+		};
+
+		void push(node *new_node);
+		/// Take the oldest node, nullptr when empty or when the next producer is halfway through its push.
+		node *pop();
+		void schedule_drain();
+		void drain();
+
+		/// Replies delivered per drain before the I/O thread is given back to other work.
+		static constexpr std::size_t max_batch = 256;
+
+		asio::io_context &io_context_;
+		/// Producers swap themselves in at head_, the consumer walks from tail_.
+		std::atomic<node *> head_;
+		node *tail_;
+		node stub_;
+		/// Whether a drain is posted or running.
+		std::atomic<bool> scheduled_{false};
+		std::atomic<std::uint64_t> delivered_count_{0};
+		std::atomic<std::uint64_t> drain_count_{0};
+	};
+
+} // namespace spiritsaway::http_server
@@ -1,3 +1,4 @@
+#pragma once
 
 #include <tuple>
 #include "http_parser.h"
@@ -18,9 +19,28 @@ namespace spiritsaway::http_server
 		{
 			good,
 			bad,
-			indeterminate
+			indeterminate,
+			/// The headers of a reply with a streamed body are complete, the body is
+			/// collected by later calls to parse and taken with take_body.
+			headers_ready
 		};
 
+		/// Deliver the body through take_body instead of buffering it into m_reply.
+		void set_stream_body(bool enabled);
+
+		/// The reply has no body whatever its headers say, e.g. the reply to a HEAD request.
+		void set_skip_body(bool skip);
+
+		/// Tell the parser that the peer closed the connection, which ends a body
+		/// without length.
+		result_type finish();
+
+		/// Whether the connection may be reused after this reply.
+		bool should_keep_alive() const;
+
+		/// Take the body data parsed since the last call, only used for streamed bodies.
+		std::string take_body();
+
 		/// Parse some data. The enum return value is good when a complete request has
 		/// been parsed, bad if the data is invalid, indeterminate when more data is
 		/// required. The InputIterator return value indicates how much of the input
@@ -31,6 +51,17 @@ namespace spiritsaway::http_server
 	public:
 		reply m_reply;
 		bool m_reply_complete = false;
+		bool m_headers_complete = false;
+		bool m_headers_reported = false;
+		bool m_stream_body = false;
+		bool m_skip_body = false;
+		/// Whether the last header callback was for a field name, the next name piece then continues it.
+		bool m_last_was_field = false;
+		std::string m_status_reason;
+		std::string m_pending_body;
+
+	private:
+		result_type check_result(std::size_t nparsed, std::size_t len);
 
 	private:
 		http_parser_settings m_parser_settings;
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "http_packet.hpp"
+
+namespace spiritsaway::http_server
+{
+	struct coalescing_options
+	{
+		/// Request headers that take part in the key besides the method and the uri,
+		/// requests that differ in them are never merged.
+		std::vector<std::string> key_headers = {"Accept-Encoding", "Accept", "Accept-Language"};
+	};
+
+	/// Collapses concurrent identical GET and HEAD requests into one invocation of the
+	/// wrapped handler. The first request of a key runs the handler, the requests that
+	/// arrive before it replies wait for the same reply, which is serialized once and
+	/// shared by all of them. A streamed or upgrading reply cannot be shared, it goes to
+	/// the first request and the handler runs again for each of the others.
+	class request_coalescer : public std::enable_shared_from_this<request_coalescer>
+	{
+	public:
+		request_coalescer(const request_coalescer &) = delete;
+		request_coalescer &operator=(const request_coalescer &) = delete;
+
+		request_coalescer(request_handler next, const coalescing_options &options);
+
+		/// Handle one request, suitable as a request_handler.
+		void handle_request(std::weak_ptr<request> weak_req, reply_handler cb);
+
+		/// Whether requests like req may be merged with each other, protocol upgrades and
+		/// streamed request bodies never are.
+		static bool is_coalescable(const request &req);
+
+		std::uint64_t get_invoke_count() const
+		{
+			return invoke_count_.load(std::memory_order_relaxed);
+		}
+		std::uint64_t get_coalesced_count() const
+		{
+			return coalesced_count_.load(std::memory_order_relaxed);
+		}
+
+	private:
+		struct waiter
+		{
+			std::weak_ptr<request> req;
+			reply_handler cb;
+		};
+
+		struct flight
+		{
+			std::vector<waiter> waiters;
+		};
+
+		std::string make_key(const request &req) const;
+		void on_reply(const std::string &key, const std::shared_ptr<flight> &cur_flight, const reply &rep);
+
+		const request_handler next_;
+		const coalescing_options options_;
+
+		std::mutex flight_mutex_;
+		std::unordered_map<std::string, std::shared_ptr<flight>> flights_;
+
+		std::atomic<std::uint64_t> invoke_count_{0};
+		std::atomic<std::uint64_t> coalesced_count_{0};
+	};
+
+	/// Wrap a handler with a request_coalescer. Place it inside make_cache_handler so that
+	/// only the requests that miss the cache are merged.
+	request_handler make_coalescing_handler(request_handler next, const coalescing_options &options = coalescing_options());
+
+} // namespace spiritsaway::http_server
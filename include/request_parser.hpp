@@ -1,3 +1,4 @@
+#pragma once
 
 #include <tuple>
 #include "http_parser.h"
@@ -14,26 +15,86 @@ namespace spiritsaway::http_server
 
 		void move_req(request &dest);
 
+		/// Forget the current request and all buffered input, the stream settings are kept.
+		void reset();
+
+		/// Get ready for the next request on the same connection, the input after the end
+		/// of the last one is kept for parse_pending_input.
+		void next_message();
+
+		/// Whether bytes after the end of the last request are waiting to be parsed.
+		bool has_pending_input() const
+		{
+			return !pending_input_.empty();
+		}
+
+		/// Whether the request asks to switch protocols, with Upgrade or CONNECT. Parsing stops
+		/// after such a request, the bytes after it are left in the pending input.
+		bool upgrade() const
+		{
+			return parser_.upgrade != 0;
+		}
+
+		/// Take the bytes after the last request, for a connection that switched protocols.
+		std::string take_pending_input();
+
+		/// Whether the client allows more requests on the connection, known once the headers are complete.
+		bool keep_alive() const
+		{
+			return keep_alive_;
+		}
+
 		/// Result of parse.
 		enum class result_type
 		{
 			good,
 			bad,
-			indeterminate
+			indeterminate,
+			/// The headers of a request with a streamed body are complete, the body is
+			/// collected by later calls to parse and taken with take_body.
+			headers_ready
 		};
 
+		/// Stream bodies that are chunked or longer than threshold instead of buffering
+		/// them into the request.
+		void set_stream_body(bool enabled, std::size_t threshold);
+
+		/// Whether the body of the current request is streamed.
+		bool body_streamed() const
+		{
+			return body_streamed_;
+		}
+
+		/// Take the body data parsed since the last call, only used for streamed bodies.
+		std::string take_body();
+
 		/// Parse some data. The enum return value is good when a complete request has
 		/// been parsed, bad if the data is invalid, indeterminate when more data is
-		/// required. The InputIterator return value indicates how much of the input
-		/// has been consumed.
-		///
+		/// required. Parsing stops at the end of a request, the rest of the input is
+		/// kept for parse_pending_input.
 		result_type parse(const char *input, std::size_t len);
 
+		/// Parse the bytes that followed the last request, like parse.
+		result_type parse_pending_input();
+
 	private:
 	public:
 		request req_;
 		bool req_complete_ = false;
 
+		bool headers_complete_ = false;
+
+		/// Whether headers_ready has been returned for the current request.
+		bool headers_reported_ = false;
+		bool body_streamed_ = false;
+		bool stream_body_enabled_ = false;
+		std::size_t stream_body_threshold_ = 0;
+		std::string pending_body_;
+		bool keep_alive_ = false;
+		/// Whether the last header callback was for a field name.
+		bool last_was_field_ = false;
+		std::string pending_input_;
+
 	private:
 		http_parser_settings parse_settings_;
 		http_parser parser_;
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "http_packet.hpp"
+
+namespace spiritsaway::http_server
+{
+	struct response_cache_options
+	{
+		/// Number of independently locked shards, keys are spread by hash.
+		std::size_t shard_count = 16;
+
+		/// Upper bound of the memory used by all cached replies, split evenly between shards.
+		std::size_t max_memory = 64 * 1024 * 1024;
+
+		/// Replies larger than this are never cached.
+		std::size_t max_entry_size = 1024 * 1024;
+
+		/// Variants kept per uri, storing another one drops the oldest. Bounds what a
+		/// client can add by sending new values of a header named by Vary.
+		std::size_t max_variants = 16;
+	};
+
+	/// A sharded LRU cache of serialized replies to GET requests. Keys are the method and
+	/// the uri, plus the request headers named by the Vary header of the cached reply.
+	/// Freshness comes from the Cache-Control max-age (or s-maxage) set by the handler,
+	/// and a stale-while-revalidate directive lets a stale reply be served while one
+	/// request refreshes it.
+	class response_cache
+	{
+	public:
+		response_cache(const response_cache &) = delete;
+		response_cache &operator=(const response_cache &) = delete;
+
+		explicit response_cache(const response_cache_options &options = response_cache_options());
+
+		enum class lookup_result
+		{
+			miss,
+			fresh,
+			/// Stale but within stale-while-revalidate, the caller should revalidate it.
+			stale_revalidate,
+			/// Stale and another request is already revalidating it.
+			stale
+		};
+
+		/// Look up the cached reply for req, result is set unless the lookup is a miss.
+		lookup_result lookup(const request &req, std::shared_ptr<const serialized_reply> &result);
+
+		/// Store the reply to req if it is cacheable, returns the stored wire format or
+		/// nullptr if the reply was not cached. Streamed bodies and protocol switches are
+		/// never cached.
+		std::shared_ptr<const serialized_reply> store(const request &req, const reply &rep);
+
+		/// Forget that req is being revalidated, used when the handler fails to refresh it.
+		void abort_revalidate(const request &req);
+
+		/// Whether the request can be answered from the cache at all.
+		static bool is_cacheable_request(const request &req);
+
+		struct statistics
+		{
+			std::uint64_t hits;
+			std::uint64_t stale_hits;
+			std::uint64_t misses;
+			std::uint64_t stores;
+			std::uint64_t evictions;
+			std::size_t memory;
+			std::size_t entry_count;
+		};
+		statistics get_statistics();
+
+	private:
+		using time_point = std::chrono::steady_clock::time_point;
+
+		struct variant
+		{
+			/// Values of the Vary headers of the request, joined by newlines.
+			std::string vary_key;
+			std::shared_ptr<const serialized_reply> buffer;
+			time_point fresh_until;
+			time_point stale_until;
+			bool revalidating = false;
+		};
+
+		struct entry
+		{
+			/// Method and uri.
+			std::string key;
+			/// Header names from the Vary header of the replies.
+			std::vector<std::string> vary_names;
+			/// Oldest store first.
+			std::vector<variant> variants;
+			std::size_t memory = 0;
+		};
+
+		struct shard
+		{
+			std::mutex mutex;
+			/// Most recently used entries first.
+			std::list<entry> lru;
+			std::unordered_map<std::string, std::list<entry>::iterator> index;
+			std::size_t memory = 0;
+		};
+
+		shard &shard_for(const std::string &key);
+		void evict(shard &cur_shard);
+		std::vector<variant>::iterator erase_variant(shard &cur_shard, entry &cur_entry, std::vector<variant>::iterator variant_iter);
+
+		static std::size_t memory_of(const variant &cur_variant);
+		static std::string make_key(const request &req);
+		static std::string make_vary_key(const request &req, const std::vector<std::string> &vary_names);
+
+		const response_cache_options options_;
+		const std::size_t shard_memory_;
+		std::vector<std::unique_ptr<shard>> shards_;
+
+		std::atomic<std::uint64_t> hits_{0};
+		std::atomic<std::uint64_t> stale_hits_{0};
+		std::atomic<std::uint64_t> misses_{0};
+		std::atomic<std::uint64_t> stores_{0};
+		std::atomic<std::uint64_t> evictions_{0};
+	};
+
+	/// Wrap a handler so that cacheable replies are stored in cache and repeated requests
+	/// are answered from it without invoking the handler or serializing the reply again.
+	request_handler make_cache_handler(request_handler next, std::shared_ptr<response_cache> cache);
+
+} // namespace spiritsaway::http_server
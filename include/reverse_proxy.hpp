@@ -0,0 +1,47 @@
+#pragma once
+
+#include <asio.hpp>
+#include <memory>
+#include <string>
+#include "http_client.h"
+#include "upstream_group.hpp"
+
+namespace spiritsaway::http_server
+{
+	struct proxy_options
+	{
+		std::string upstream_host;
+		std::string upstream_port = "80";
+
+		/// Seconds without progress on the upstream connection before the request fails.
+		std::uint32_t timeout_seconds = 30;
+
+		/// Idle keep-alive connections kept per upstream host.
+		std::size_t max_idle_per_host = 32;
+		std::uint32_t idle_timeout_seconds = 30;
+
+		/// Forward the upstream body as it arrives instead of buffering the whole reply.
+		bool stream_reply = true;
+
+		/// Value of the Via header added to both directions, empty to leave it out.
+		std::string via = "1.1 spiritsaway-http";
+
+		/// Request header whose value is the consistent hashing key, the uri when empty or missing.
+		std::string hash_key_header;
+	};
+
+	/// Remove the hop-by-hop headers, including the ones named by Connection, which only
+	/// describe a single connection and must not be forwarded by a proxy.
+	void strip_hop_by_hop_headers(std::vector<header> &headers);
+
+	/// Create a handler that forwards every request to the upstream server over pooled
+	/// keep-alive http_client connections. Request bodies streamed by the server (see
+	/// server_options::stream_request_body) and upstream reply bodies are forwarded piece
+	/// by piece without buffering them whole.
+	request_handler make_proxy_handler(asio::io_context &io_context, const proxy_options &options);
+
+	/// Create a handler that spreads the requests over the hosts of group, upstream_host,
+	/// upstream_port and the pool settings of options are ignored.
+	request_handler make_proxy_handler(std::shared_ptr<upstream_group> group, const proxy_options &options);
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include "socket_options.hpp"
+
+namespace spiritsaway::http_server
+{
+	class metrics_registry;
+	class rate_limiter;
+
+	/// State of a draining server, see server_core::drain.
+	struct drain_progress
+	{
+		std::size_t open_connections = 0;
+		/// Requests whose handler has not replied yet.
+		std::size_t in_flight_requests = 0;
+		std::chrono::steady_clock::duration elapsed{};
+		/// Set in the last report, when every connection has closed or the deadline has passed.
+		bool finished = false;
+		/// Connections that were still open at the deadline and have been closed.
+		std::size_t aborted_connections = 0;
+	};
+
+	/// Settings shared by the server and all of its connections.
+	struct server_options
+	{
+		/// Seconds a connection waits for the client before it is closed.
+		std::size_t timeout_seconds = 5;
+
+		/// Invoke the handler as soon as the headers of a request with a large or chunked
+		/// body are parsed, the handler then reads the body from request::body_stream.
+		bool stream_request_body = false;
+
+		/// Bodies with a Content-Length up to this size are still buffered into request::body.
+		std::size_t stream_body_threshold = 64 * 1024;
+
+		/// Where connections count requests, bytes, replies and errors, nullptr to disable.
+		std::shared_ptr<metrics_registry> metrics;
+
+		/// Stop accepting while this many connections are open, 0 for no limit.
+		std::size_t max_connections = 0;
+
+		/// Requests in the handler at once, further ones get a 503 as soon as their
+		/// headers arrive, 0 for no limit.
+		std::size_t max_in_flight_requests = 0;
+
+		/// Shed requests while even the fastest one of an interval spends longer than
+		/// this in the handler, 0 to disable. See admission_controller.
+		std::uint32_t queue_delay_target_ms = 0;
+		std::uint32_t queue_delay_interval_ms = 100;
+
+		/// Limits new connections per remote address. Over the limit the stock 429 is
+		/// written without waiting and the socket is closed, per request limits are applied
+		/// by make_rate_limit_handler.
+		std::shared_ptr<rate_limiter> accept_rate_limiter;
+
+		/// Closed connections each thread keeps for reuse by the next accept, 0 to
+		/// allocate every connection. See connection_pool.
+		std::size_t connection_pool_size = 64;
+
+		/// Connections wait for the socket to become readable before they take a read
+		/// buffer from the buffer_pool and give it back once the request is parsed, so
+		/// that idle connections hold no buffer. This is also how the io_uring build
+		/// avoids handing buffers to the kernel ahead of the data.
+		bool lazy_read_buffer = false;
+
+		/// A read that fills the read buffer makes the next read of the request use one
+		/// twice as large, up to this size.
+		std::size_t max_read_buffer_size = 64 * 1024;
+
+		/// Tuning of the listener and the accepted sockets of this server.
+		socket_options sockets;
+
+		/// Requests served on one connection, 0 closes the connection after every reply.
+		/// Pipelined requests are handled one after the other and their replies share writes.
+		std::size_t keep_alive_requests = 0;
+
+		/// Most bytes and buffers gathered into one write of a connection, see output_queue.
+		std::size_t max_write_bytes = 256 * 1024;
+		std::size_t max_write_segments = 64;
+
+		/// Largest WebSocket message after joining its fragments, a larger one closes the connection.
+		std::size_t websocket_max_message_size = 16 * 1024 * 1024;
+
+		/// Bytes a WebSocket connection may have queued before websocket_session::send returns false.
+		std::size_t websocket_send_buffer_limit = 1024 * 1024;
+
+		/// Seconds a WebSocket connection may go without reads or writes, 0 to keep it open.
+		std::uint32_t websocket_timeout_seconds = 300;
+
+		/// Speak HTTP/2 without TLS to clients that open the connection with the HTTP/2
+		/// preface or ask for it with Upgrade: h2c. Every stream goes to the handler like a
+		/// request of its own, keep_alive_requests does not limit them.
+		bool http2 = false;
+
+		/// Streams a client may have open at once on an HTTP/2 connection, further ones are refused.
+		std::uint32_t http2_max_concurrent_streams = 100;
+
+		/// Bytes a client may send on an HTTP/2 stream, and on the whole connection, ahead of
+		/// the server reading them.
+		std::uint32_t http2_window_size = 1024 * 1024;
+
+		/// Drain the server on SIGTERM instead of leaving the signal to the application.
+		bool drain_on_sigterm = false;
+
+		/// Seconds a drain waits for the open connections before it closes them.
+		std::uint32_t drain_timeout_seconds = 30;
+
+		/// Called about once a second while the server drains and once when it is done.
+		std::function<void(const drain_progress &)> drain_progress_handler;
+	};
+} // namespace spiritsaway::http_server
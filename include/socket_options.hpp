@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <asio.hpp>
+
+namespace spiritsaway::http_server
+{
+	/// TCP tuning for listeners, accepted sockets and client sockets. Zero keeps the
+	/// system default. Options the platform does not have are skipped, a failure to set
+	/// one is not an error.
+	struct socket_options
+	{
+		/// TCP_NODELAY, small replies are sent at once instead of waiting for the ACK of
+		/// the previous segment.
+		bool no_delay = true;
+
+		/// TCP_DEFER_ACCEPT on listeners, a connection is accepted only once data arrives
+		/// or this many seconds have passed. Linux only.
+		std::uint32_t defer_accept_seconds = 0;
+
+		/// TCP_FASTOPEN: the length of the pending fast open queue of listeners, and
+		/// TCP_FASTOPEN_CONNECT on client sockets when not zero.
+		std::uint32_t fast_open_queue = 0;
+
+		/// SO_SNDBUF and SO_RCVBUF in bytes. Set on listeners too, so that accepted
+		/// sockets get them before the window scale is agreed on.
+		std::uint32_t send_buffer_size = 0;
+		std::uint32_t receive_buffer_size = 0;
+
+		/// TCP_QUICKACK, ACK at once instead of delaying it. The kernel may turn it off
+		/// again, it is set once per connection. Linux only.
+		bool quick_ack = false;
+
+		/// SO_BUSY_POLL, microseconds a blocking receive spins on the device queue. Linux only.
+		std::uint32_t busy_poll_us = 0;
+	};
+
+	/// Apply the options of a listener, after open and before listen.
+	void apply_listener_options(asio::ip::tcp::acceptor &acceptor, const socket_options &options);
+
+	/// Apply the options of an accepted socket or of a client socket, which must be open.
+	void apply_socket_options(asio::ip::tcp::socket &socket, const socket_options &options, bool client);
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "http_packet.hpp"
+
+namespace spiritsaway::http_server
+{
+	/// What a channel does with a subscriber whose queue is full.
+	enum class slow_subscriber_policy
+	{
+		/// Drop its oldest queued event, the stream goes on with a gap.
+		drop_oldest,
+		/// Close its connection, the client reconnects with a fresh stream.
+		disconnect
+	};
+
+	struct sse_channel_options
+	{
+		/// Events queued for one subscriber. They only queue up once the connection's own
+		/// output is full, see server_options::max_write_bytes.
+		std::size_t max_queued_events = 256;
+
+		slow_subscriber_policy slow_policy = slow_subscriber_policy::disconnect;
+	};
+
+	/// An event in the text/event-stream format, serialized once and shared by all subscribers.
+	using sse_event = std::shared_ptr<const std::string>;
+
+	/// A Server-Sent Events channel. Clients subscribe with a request whose reply stays open,
+	/// every published event is serialized once and its buffer is written to all of them
+	/// without a copy. May be used from any thread, subscribers on different I/O threads
+	/// are fed through their own executors.
+	class sse_channel
+	{
+	public:
+		sse_channel(const sse_channel &) = delete;
+		sse_channel &operator=(const sse_channel &) = delete;
+
+		explicit sse_channel(const sse_channel_options &options = sse_channel_options());
+		~sse_channel();
+
+		/// The reply that makes the client of req a subscriber, it gets every event
+		/// published from now on until the channel is closed.
+		reply subscribe(const request &req);
+
+		/// Serialize an event, data is split into one data line per line. event_type and id
+		/// are left out when empty.
+		static sse_event make_event(std::string_view data, std::string_view event_type = std::string_view(), std::string_view id = std::string_view());
+
+		/// Send event to every subscriber.
+		void publish(sse_event event);
+		void publish(std::string_view data, std::string_view event_type = std::string_view(), std::string_view id = std::string_view())
+		{
+			publish(make_event(data, event_type, id));
+		}
+
+		/// Send a comment line. Streams without events are closed by the connection timeout,
+		/// so call this more often than server_options::timeout_seconds.
+		void heartbeat();
+
+		/// End the stream of every subscriber, later subscribers get an empty stream.
+		void close();
+
+		/// Subscribers, including those that left since the last publish.
+		std::size_t subscriber_count() const;
+
+		/// Events dropped from the queues of slow subscribers.
+		std::uint64_t dropped_events() const
+		{
+			return dropped_events_.load(std::memory_order_relaxed);
+		}
+
+		/// Subscribers closed by slow_subscriber_policy::disconnect.
+		std::uint64_t disconnected_subscribers() const
+		{
+			return disconnected_subscribers_.load(std::memory_order_relaxed);
+		}
+
+	private:
+		class subscriber;
+
+		const sse_channel_options options_;
+
+		mutable std::mutex mutex_;
+		/// Owned by the replies of the subscribers, a closed connection leaves an expired entry.
+		std::vector<std::weak_ptr<subscriber>> subscribers_;
+		bool closed_ = false;
+
+		std::atomic<std::uint64_t> dropped_events_{0};
+		std::atomic<std::uint64_t> disconnected_subscribers_{0};
+	};
+
+	/// Create a handler that subscribes every request to channel.
+	request_handler make_sse_handler(std::shared_ptr<sse_channel> channel);
+
+} // namespace spiritsaway::http_server
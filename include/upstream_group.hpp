@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "http_client.h"
+
+namespace spiritsaway::http_server
+{
+	struct upstream_endpoint
+	{
+		std::string host;
+		std::string port = "80";
+	};
+
+	class upstream_group;
+
+	/// A policy that picks the upstream for one request. Implementations only see the
+	/// hosts through upstream_group, which hides the ejected ones.
+	class load_balancer
+	{
+	public:
+		virtual ~load_balancer() = default;
+
+		/// Return the index of the chosen host, key is only used by hashing policies. Only
+		/// called for a group with at least one host.
+		virtual std::size_t pick(const upstream_group &group, std::string_view key) = 0;
+	};
+
+	enum class balance_policy
+	{
+		round_robin,
+		least_outstanding,
+		/// Compare two random hosts by outstanding requests weighted with their latency.
+		power_of_two_choices,
+		consistent_hash
+	};
+
+	struct upstream_group_options
+	{
+		balance_policy policy = balance_policy::round_robin;
+
+		/// Points per host on the consistent hashing ring.
+		std::size_t virtual_nodes = 160;
+
+		/// A host is ejected after this many failed requests in a row.
+		std::uint32_t consecutive_failures_to_eject = 5;
+
+		/// Ejection time, multiplied by the number of times the host has been ejected in a row.
+		std::uint32_t base_ejection_seconds = 30;
+		std::uint32_t max_ejection_seconds = 300;
+
+		/// At most this share of the hosts is ejected at once, but always at least one.
+		std::uint32_t max_ejection_percent = 50;
+
+		/// Also count 502, 503 and 504 replies as failures of the host.
+		bool gateway_errors_are_failures = true;
+
+		std::size_t max_idle_per_host = 32;
+		std::uint32_t idle_timeout_seconds = 30;
+
+		/// Tuning of the connections to the hosts.
+		socket_options sockets;
+	};
+
+	/// A set of equivalent upstream servers behind one name. Requests are spread over them
+	/// by a load_balancer, results of the http_client callbacks track their health
+	/// passively and hosts that keep failing are ejected for a while. Must be owned by a
+	/// shared_ptr, requests in flight keep the group alive.
+	class upstream_group : public std::enable_shared_from_this<upstream_group>
+	{
+	public:
+		upstream_group(const upstream_group &) = delete;
+		upstream_group &operator=(const upstream_group &) = delete;
+
+		upstream_group(asio::io_context &io_context, const std::vector<upstream_endpoint> &endpoints, const upstream_group_options &options = upstream_group_options());
+
+		/// Construct with a custom balancing policy, options.policy is ignored.
+		upstream_group(asio::io_context &io_context, const std::vector<upstream_endpoint> &endpoints, const upstream_group_options &options, std::unique_ptr<load_balancer> balancer);
+
+		/// Send req to the host picked for key through a pooled http_client. The callback
+		/// gets the same arguments as the http_client callback, or an error at once if the
+		/// group has no hosts.
+		void send_request(const request &req, std::string_view key, std::function<void(const std::string &, const reply &)> callback, std::uint32_t timeout_seconds, bool stream_reply);
+
+		/// Returned by request_started when there is no host to pick.
+		static constexpr std::size_t no_host = std::size_t(-1);
+
+		/// Pick a host and count the request as outstanding on it until request_finished.
+		/// Returns no_host for a group without hosts.
+		std::size_t request_started(std::string_view key);
+
+		/// Record the result of a request started on host index, err is empty on success.
+		void request_finished(std::size_t index, const std::string &err, int status_code, std::chrono::steady_clock::duration latency);
+
+		std::size_t host_count() const
+		{
+			return m_hosts.size();
+		}
+		const upstream_endpoint &endpoint(std::size_t index) const
+		{
+			return m_hosts[index]->endpoint;
+		}
+
+		/// Whether the host may get new requests. When every host is ejected they all count
+		/// as available again, a bad guess beats failing everything.
+		bool is_available(std::size_t index) const;
+
+		std::uint32_t outstanding(std::size_t index) const
+		{
+			return m_hosts[index]->outstanding.load(std::memory_order_relaxed);
+		}
+
+		/// Moving average of the request latency of the host in microseconds.
+		std::uint64_t latency_us(std::size_t index) const
+		{
+			return m_hosts[index]->ewma_latency_us.load(std::memory_order_relaxed);
+		}
+
+		std::size_t ejected_count() const
+		{
+			return m_ejected_count.load(std::memory_order_relaxed);
+		}
+
+	private:
+		struct host_state
+		{
+			upstream_endpoint endpoint;
+			std::atomic<std::uint32_t> outstanding{0};
+			std::atomic<std::uint32_t> consecutive_failures{0};
+			std::atomic<std::uint64_t> ewma_latency_us{0};
+			/// steady clock milliseconds until which the host is ejected, 0 if it is not.
+			std::atomic<std::int64_t> ejected_until_ms{0};
+			/// Times the host has been ejected without a success in between, guarded by m_ejection_mutex.
+			std::uint32_t ejection_count = 0;
+		};
+
+		void eject(host_state &host);
+		/// Bring back the hosts whose ejection time is over.
+		void reinstate_due_hosts();
+		static std::int64_t now_ms();
+
+		asio::io_context &m_io_context;
+		const upstream_group_options m_options;
+		std::vector<std::unique_ptr<host_state>> m_hosts;
+		std::unique_ptr<load_balancer> m_balancer;
+		const std::shared_ptr<http_client_pool> m_pool;
+		std::mutex m_ejection_mutex;
+		std::atomic<std::size_t> m_ejected_count{0};
+		/// Earliest end of an ejection, so that most requests skip reinstate_due_hosts.
+		std::atomic<std::int64_t> m_next_reinstate_ms{0};
+	};
+
+	/// Create the balancer implementing policy for the given hosts.
+	std::unique_ptr<load_balancer> make_load_balancer(balance_policy policy, const std::vector<upstream_endpoint> &endpoints, std::size_t virtual_nodes);
+
+} // namespace spiritsaway::http_server
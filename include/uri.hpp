@@ -0,0 +1,189 @@
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include "http_parser.h"
+
+namespace spiritsaway::http_server
+{
+	/// The parts of a request target, such as request::uri, as views into the target. Nothing
+	/// is copied or decoded, the target must outlive the view.
+	class uri_view
+	{
+	public:
+		uri_view();
+
+		/// Split target, either an origin form like /a/b?c#d or an absolute URI. The authority
+		/// form of a CONNECT request is parsed with is_connect.
+		explicit uri_view(std::string_view target, bool is_connect = false);
+
+		/// Whether the target could be parsed, all parts are empty otherwise.
+		bool valid() const
+		{
+			return valid_;
+		}
+
+		std::string_view schema() const
+		{
+			return field(UF_SCHEMA);
+		}
+		std::string_view userinfo() const
+		{
+			return field(UF_USERINFO);
+		}
+		std::string_view host() const
+		{
+			return field(UF_HOST);
+		}
+
+		/// The port of an absolute URI, 0 if the target has none.
+		std::uint16_t port() const
+		{
+			return url_.port;
+		}
+
+		/// The path, still percent-encoded, see decode_path.
+		std::string_view path() const
+		{
+			return field(UF_PATH);
+		}
+
+		/// The query without the '?', see query_params.
+		std::string_view query() const
+		{
+			return field(UF_QUERY);
+		}
+
+		std::string_view fragment() const
+		{
+			return field(UF_FRAGMENT);
+		}
+
+	private:
+		std::string_view field(http_parser_url_fields which) const
+		{
+			if (!(url_.field_set & (1 << which)))
+			{
+				return std::string_view();
+			}
+			return target_.substr(url_.field_data[which].off, url_.field_data[which].len);
+		}
+
+		std::string_view target_;
+		http_parser_url url_;
+		bool valid_ = false;
+	};
+
+	/// A name=value pair of a query string, still percent-encoded. The value is empty for a
+	/// bare name.
+	struct query_param
+	{
+		std::string_view name;
+		std::string_view value;
+	};
+
+	/// The parameters of a query string, split on '&' as they are iterated. Empty parameters
+	/// are skipped, names and values are left encoded for percent_decode.
+	class query_params
+	{
+	public:
+		class iterator
+		{
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = query_param;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const query_param *;
+			using reference = const query_param &;
+
+			iterator() = default;
+
+			reference operator*() const
+			{
+				return current_;
+			}
+			pointer operator->() const
+			{
+				return &current_;
+			}
+
+			iterator &operator++()
+			{
+				advance();
+				return *this;
+			}
+			iterator operator++(int)
+			{
+				auto old = *this;
+				advance();
+				return old;
+			}
+
+			bool operator==(const iterator &other) const
+			{
+				return current_.name.data() == other.current_.name.data() && remain_.data() == other.remain_.data();
+			}
+			bool operator!=(const iterator &other) const
+			{
+				return !(*this == other);
+			}
+
+		private:
+			friend class query_params;
+
+			explicit iterator(std::string_view query)
+				: remain_(query)
+			{
+				advance();
+			}
+
+			/// Move to the next non empty parameter, or to the end.
+			void advance();
+
+			std::string_view remain_;
+			query_param current_;
+		};
+
+		explicit query_params(std::string_view query)
+			: query_(query)
+		{
+		}
+
+		iterator begin() const
+		{
+			return iterator(query_);
+		}
+		iterator end() const
+		{
+			return iterator();
+		}
+
+		/// Set value to the raw value of the first parameter called name, name is compared
+		/// as it is encoded. Returns false if there is none.
+		bool get(std::string_view name, std::string_view &value) const;
+
+	private:
+		std::string_view query_;
+	};
+
+	/// Decode the %XX escapes of data in place, and '+' into a space if plus_as_space as
+	/// in form values. Runs without escapes are skipped with memchr. Returns the decoded
+	/// size, or std::string::npos if an escape is invalid.
+	std::size_t percent_decode_in_place(char *data, std::size_t size, bool plus_as_space = false);
+
+	/// Append the decoding of input to out, false if an escape is invalid.
+	bool percent_decode(std::string_view input, std::string &out, bool plus_as_space = false);
+
+	/// Remove the "." and ".." segments of an absolute path in place, RFC 3986 section
+	/// 5.2.4. A ".." at the root stays at the root. Returns the new size, a path that does
+	/// not start with '/' is left as it is.
+	std::size_t normalize_path_in_place(char *data, std::size_t size);
+
+	/// Decode a path and normalize it after decoding, so that escaped dots cannot climb
+	/// above the root. Returns false if the path is not absolute, an escape is invalid or
+	/// it decodes to a NUL byte.
+	bool decode_path(std::string_view path, std::string &out);
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "http_packet.hpp"
+
+namespace spiritsaway::http_server
+{
+	enum class websocket_opcode : std::uint8_t
+	{
+		continuation = 0x0,
+		text = 0x1,
+		binary = 0x2,
+		close = 0x8,
+		ping = 0x9,
+		pong = 0xa
+	};
+
+	/// Status codes of a close frame, RFC 6455 section 7.4.1.
+	namespace websocket_status
+	{
+		constexpr std::uint16_t normal = 1000;
+		constexpr std::uint16_t going_away = 1001;
+		constexpr std::uint16_t protocol_error = 1002;
+		/// Not sent on the wire, reported when the connection ended without a close frame.
+		constexpr std::uint16_t abnormal = 1006;
+		constexpr std::uint16_t message_too_big = 1009;
+	}
+
+	/// A frame parsed in place, the payload is unmasked and points into the parsed buffer.
+	struct websocket_frame
+	{
+		websocket_opcode opcode = websocket_opcode::continuation;
+		bool fin = false;
+		std::string_view payload;
+	};
+
+	enum class websocket_parse_result
+	{
+		complete,
+		incomplete,
+		bad
+	};
+
+	/// Parse the client frame at the start of data and unmask its payload in place. frame_size
+	/// is set to the size of the whole frame as soon as its header is complete, also when the
+	/// payload is still incomplete, and to 0 before.
+	websocket_parse_result parse_websocket_frame(char *data, std::size_t size, websocket_frame &frame, std::size_t &frame_size);
+
+	/// XOR data with the repeated 4 byte mask, 16 bytes at a time where SSE2 or NEON is available.
+	void unmask_websocket_payload(char *data, std::size_t size, const unsigned char mask[4]);
+
+	/// Longest header of an unmasked server frame.
+	constexpr std::size_t max_websocket_header_size = 10;
+
+	/// Write the header of an unfragmented server frame into out, returns its size.
+	std::size_t write_websocket_frame_header(char *out, websocket_opcode opcode, std::size_t payload_size);
+
+	/// The Sec-WebSocket-Accept value for the Sec-WebSocket-Key of a client.
+	std::string websocket_accept_key(std::string_view client_key);
+
+	/// Whether req asks to switch the connection to the WebSocket protocol.
+	bool is_websocket_upgrade(const request &req);
+
+	/// The server side of an upgraded connection, handed to websocket_handler::on_open.
+	/// Every method may be called from any thread, calls after the close are ignored.
+	class websocket_session
+	{
+	public:
+		virtual ~websocket_session() = default;
+
+		/// Queue a message. Returns false once more than websocket_send_buffer_limit bytes
+		/// are queued, the message is still sent but the sender should wait for
+		/// websocket_handler::on_writable before it sends more.
+		virtual bool send(std::string data, bool binary) = 0;
+
+		/// Queue a message shared with other sessions, e.g. one broadcast to many clients.
+		virtual bool send(std::shared_ptr<const std::string> data, bool binary) = 0;
+
+		/// Start the closing handshake, the connection closes once the client answers.
+		virtual void close(std::uint16_t code, std::string_view reason) = 0;
+
+		/// Bytes queued but not written to the socket yet.
+		virtual std::size_t buffered_amount() const = 0;
+	};
+
+	/// Receives the events of one WebSocket connection, always on the strand of the connection.
+	class websocket_handler
+	{
+	public:
+		virtual ~websocket_handler() = default;
+
+		/// The 101 reply has been queued, session may be used from now on.
+		virtual void on_open(std::shared_ptr<websocket_session> /*session*/)
+		{
+		}
+
+		/// A whole message arrived, fragments are joined. data is only valid during the call.
+		virtual void on_message(std::string_view data, bool binary) = 0;
+
+		/// The send buffer fell back below the limit after a send returned false.
+		virtual void on_writable()
+		{
+		}
+
+		/// Called once when the connection ends, code is websocket_status::abnormal
+		/// if it ended without a close frame from the client.
+		virtual void on_close(std::uint16_t /*code*/, std::string_view /*reason*/)
+		{
+		}
+	};
+
+	/// The reply that accepts the WebSocket upgrade req and hands the connection to handler,
+	/// or an error reply if req is not a valid upgrade.
+	reply make_websocket_reply(const request &req, std::shared_ptr<websocket_handler> handler);
+
+	/// Pass WebSocket upgrades to accept and every other request to next. accept returns
+	/// the handler for the new connection, or nullptr to refuse it with 403.
+	request_handler make_websocket_upgrade_handler(request_handler next, std::function<std::shared_ptr<websocket_handler>(const request &)> accept);
+
+} // namespace spiritsaway::http_server
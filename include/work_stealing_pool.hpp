@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "http_packet.hpp"
+
+namespace spiritsaway::http_server
+{
+	/// Worker threads for CPU heavy handlers, so that they do not stall the connections of
+	/// the I/O threads. Every worker has its own queue and idle workers steal from the
+	/// others, tasks posted by a worker stay on its queue while it keeps up.
+	class work_stealing_pool
+	{
+	public:
+		using task = std::function<void()>;
+
+		work_stealing_pool(const work_stealing_pool &) = delete;
+		work_stealing_pool &operator=(const work_stealing_pool &) = delete;
+
+		/// Start thread_count workers, 0 for one per hardware thread.
+		explicit work_stealing_pool(std::size_t thread_count = 0);
+
+		/// Runs the queued tasks and joins the workers.
+		~work_stealing_pool();
+
+		/// Queue a task, tasks posted after stop are dropped.
+		void post(task new_task);
+
+		/// Stop taking tasks, the workers exit once the queued ones are done.
+		void stop();
+
+		std::size_t get_thread_count() const
+		{
+			return threads_.size();
+		}
+
+		/// Tasks that were run by another worker than the one they were queued on.
+		std::uint64_t get_steal_count() const
+		{
+			return steal_count_.load(std::memory_order_relaxed);
+		}
+
+	private:
+		/// Aligned so that workers polling neighbouring queues do not share cache lines.
+		struct alignas(64) worker_queue
+		{
+			std::mutex mutex;
+			std::deque<task> tasks;
+		};
+
+		void worker_loop(std::size_t index);
+		bool try_pop(std::size_t index, task &result);
+
+		std::vector<std::unique_ptr<worker_queue>> queues_;
+		std::vector<std::thread> threads_;
+
+		/// Tasks queued but not taken yet.
+		std::atomic<std::size_t> pending_{0};
+		std::atomic<std::size_t> sleeping_{0};
+		std::atomic<bool> stopping_{false};
+		std::atomic<std::size_t> next_queue_{0};
+		std::atomic<std::uint64_t> steal_count_{0};
+		std::mutex sleep_mutex_;
+		std::condition_variable sleep_cv_;
+	};
+
+	/// Run next on a worker of pool instead of the I/O thread of the connection. The
+	/// connection writes the reply on its own strand whatever thread calls back.
+	request_handler make_pool_handler(request_handler next, std::shared_ptr<work_stealing_pool> pool);
+
+} // namespace spiritsaway::http_server
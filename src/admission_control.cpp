@@ -0,0 +1,124 @@
+#include "admission_control.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace spiritsaway::http_server
+{
+	admission_controller::admission_controller(const server_options &options)
+		: max_in_flight_(options.max_in_flight_requests),
+		  target_us_(std::int64_t(options.queue_delay_target_ms) * 1000),
+		  interval_us_(std::int64_t(std::max<std::uint32_t>(options.queue_delay_interval_ms, 1)) * 1000),
+		  window_min_us_(std::numeric_limits<std::int64_t>::max())
+	{
+	}
+
+	std::int64_t admission_controller::now_us()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	const reply &admission_controller::shed_reply()
+	{
+		static const reply result = []()
+		{
+			auto rep = reply::stock_reply(reply::status_type::service_unavailable);
+			rep.headers.push_back(header{"Retry-After", "1"});
+			reply prebuilt_rep;
+			prebuilt_rep.prebuilt = std::make_shared<const serialized_reply>(rep.serialize());
+			return prebuilt_rep;
+		}();
+		return result;
+	}
+
+	bool admission_controller::try_admit()
+	{
+		if (target_us_ != 0 && should_drop())
+		{
+			return false;
+		}
+		if (in_flight_.fetch_add(1, std::memory_order_relaxed) >= max_in_flight_ && max_in_flight_ != 0)
+		{
+			in_flight_.fetch_sub(1, std::memory_order_relaxed);
+			return false;
+		}
+		return true;
+	}
+
+	bool admission_controller::should_drop()
+	{
+		if (!dropping_.load(std::memory_order_relaxed))
+		{
+			return false;
+		}
+		auto now = now_us();
+		// shed requests produce no samples, the interval must also end without them
+		close_window(now);
+		if (!dropping_.load(std::memory_order_relaxed))
+		{
+			return false;
+		}
+		auto next_drop = next_drop_us_.load(std::memory_order_relaxed);
+		if (now < next_drop)
+		{
+			return false;
+		}
+		// the control law of CoDel, drops come closer together the longer the queue stands
+		auto count = drop_count_.fetch_add(1, std::memory_order_relaxed) + 1;
+		auto next = now + std::int64_t(double(interval_us_) / std::sqrt(double(count)));
+		if (!next_drop_us_.compare_exchange_strong(next_drop, next, std::memory_order_relaxed))
+		{
+			// another thread took this drop
+			drop_count_.fetch_sub(1, std::memory_order_relaxed);
+			return false;
+		}
+		return true;
+	}
+
+	void admission_controller::release(std::chrono::steady_clock::duration sojourn)
+	{
+		in_flight_.fetch_sub(1, std::memory_order_relaxed);
+		auto sojourn_us = std::chrono::duration_cast<std::chrono::microseconds>(sojourn).count();
+		if (target_us_ == 0 || sojourn_us <= 0)
+		{
+			return;
+		}
+		auto cur_min = window_min_us_.load(std::memory_order_relaxed);
+		while (sojourn_us < cur_min && !window_min_us_.compare_exchange_weak(cur_min, sojourn_us, std::memory_order_relaxed))
+		{
+		}
+
+		close_window(now_us());
+	}
+
+	void admission_controller::close_window(std::int64_t now)
+	{
+		auto window_end = window_end_us_.load(std::memory_order_relaxed);
+		if (now < window_end || !window_end_us_.compare_exchange_strong(window_end, now + interval_us_, std::memory_order_relaxed))
+		{
+			return;
+		}
+		// only the thread that closed the interval gets here
+		auto interval_min = window_min_us_.exchange(std::numeric_limits<std::int64_t>::max(), std::memory_order_relaxed);
+		if (interval_min == std::numeric_limits<std::int64_t>::max())
+		{
+			// nothing finished in the interval, that is a standing queue only if requests are still in the handler
+			interval_min = in_flight_.load(std::memory_order_relaxed) ? interval_us_ + target_us_ : 0;
+		}
+		if (interval_min <= target_us_)
+		{
+			dropping_.store(false, std::memory_order_relaxed);
+			return;
+		}
+		if (!dropping_.load(std::memory_order_relaxed))
+		{
+			// a queue that comes back soon after the last one starts near the old drop rate
+			auto prev_count = drop_count_.load(std::memory_order_relaxed);
+			bool recent = now - next_drop_us_.load(std::memory_order_relaxed) < 16 * interval_us_;
+			drop_count_.store(recent && prev_count > 2 ? prev_count - 2 : 0, std::memory_order_relaxed);
+			next_drop_us_.store(now, std::memory_order_relaxed);
+			dropping_.store(true, std::memory_order_relaxed);
+		}
+	}
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,64 @@
+#include "buffer_pool.hpp"
+#include <vector>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		std::atomic<std::uint64_t> created_count{0};
+		std::atomic<std::uint64_t> reused_count{0};
+		std::atomic<std::uint64_t> idle_count{0};
+
+		/// Frees the blocks of a thread when it exits.
+		struct thread_free_list
+		{
+			std::vector<buffer_pool::block *> blocks;
+
+			~thread_free_list()
+			{
+				idle_count.fetch_sub(blocks.size(), std::memory_order_relaxed);
+				for (auto one_block : blocks)
+				{
+					delete one_block;
+				}
+			}
+		};
+
+		thread_local thread_free_list free_list;
+	}
+
+	void buffer_pool::block_deleter::operator()(block *released) const
+	{
+		if (free_list.blocks.size() >= max_idle_per_thread)
+		{
+			delete released;
+			return;
+		}
+		free_list.blocks.push_back(released);
+		idle_count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	buffer_pool::block_ptr buffer_pool::acquire()
+	{
+		if (free_list.blocks.empty())
+		{
+			created_count.fetch_add(1, std::memory_order_relaxed);
+			return block_ptr(new block);
+		}
+		auto result = free_list.blocks.back();
+		free_list.blocks.pop_back();
+		idle_count.fetch_sub(1, std::memory_order_relaxed);
+		reused_count.fetch_add(1, std::memory_order_relaxed);
+		return block_ptr(result);
+	}
+
+	buffer_pool_statistics buffer_pool::get_statistics()
+	{
+		buffer_pool_statistics result;
+		result.created = created_count.load(std::memory_order_relaxed);
+		result.reused = reused_count.load(std::memory_order_relaxed);
+		result.idle = idle_count.load(std::memory_order_relaxed);
+		return result;
+	}
+
+} // namespace spiritsaway::http_server
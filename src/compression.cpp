@@ -0,0 +1,396 @@
+#include "compression.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+#ifdef HTTP_SERVER_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+#ifdef HTTP_SERVER_WITH_ZLIB
+		/// Parse the q-value of one Accept-Encoding element, 1000 means q=1.
+		int parse_quality(std::string_view params)
+		{
+			auto q_pos = params.find("q=");
+			if (q_pos == std::string_view::npos)
+			{
+				return 1000;
+			}
+			std::string q_str(trim_spaces(params.substr(q_pos + 2)));
+			return int(std::strtod(q_str.c_str(), nullptr) * 1000);
+		}
+
+#endif
+
+		bool has_prefix_nocase(std::string_view value, std::string_view prefix)
+		{
+			return value.size() >= prefix.size() && iequals(value.substr(0, prefix.size()), prefix);
+		}
+	} // namespace
+
+	std::string_view encoding_token(content_encoding encoding)
+	{
+		switch (encoding)
+		{
+		case content_encoding::gzip:
+			return "gzip";
+		case content_encoding::deflate:
+			return "deflate";
+		default:
+			return {};
+		}
+	}
+
+	content_encoding negotiate_encoding(std::string_view accept_encoding)
+	{
+#ifdef HTTP_SERVER_WITH_ZLIB
+		int gzip_q = -1;
+		int deflate_q = -1;
+		int any_q = -1;
+		while (!accept_encoding.empty())
+		{
+			auto comma_pos = accept_encoding.find(',');
+			auto element = accept_encoding.substr(0, comma_pos);
+			accept_encoding.remove_prefix(comma_pos == std::string_view::npos ? accept_encoding.size() : comma_pos + 1);
+
+			auto semicolon_pos = element.find(';');
+			auto token = trim_spaces(element.substr(0, semicolon_pos));
+			int q = semicolon_pos == std::string_view::npos ? 1000 : parse_quality(element.substr(semicolon_pos + 1));
+			if (iequals(token, "gzip") || iequals(token, "x-gzip"))
+			{
+				gzip_q = q;
+			}
+			else if (iequals(token, "deflate"))
+			{
+				deflate_q = q;
+			}
+			else if (token == "*")
+			{
+				any_q = q;
+			}
+		}
+		if (gzip_q < 0)
+		{
+			gzip_q = any_q;
+		}
+		if (deflate_q < 0)
+		{
+			deflate_q = any_q;
+		}
+		if (gzip_q > 0 && gzip_q >= deflate_q)
+		{
+			return content_encoding::gzip;
+		}
+		if (deflate_q > 0)
+		{
+			return content_encoding::deflate;
+		}
+#else
+		(void)accept_encoding;
+#endif
+		return content_encoding::identity;
+	}
+
+#ifdef HTTP_SERVER_WITH_ZLIB
+	struct stream_compressor::zlib_state
+	{
+		z_stream stream;
+		content_encoding encoding;
+		int level;
+
+		/// Whether deflateInit2 succeeded, e.g. it fails for a level out of range.
+		bool initialized;
+
+		zlib_state(content_encoding in_encoding, int in_level)
+			: stream(), encoding(in_encoding), level(in_level)
+		{
+			// window bits above 15 select the gzip wrapper, "deflate" in http is the zlib format
+			int window_bits = encoding == content_encoding::gzip ? 15 + 16 : 15;
+			initialized = deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+		}
+		~zlib_state()
+		{
+			if (initialized)
+			{
+				deflateEnd(&stream);
+			}
+		}
+	};
+
+	namespace
+	{
+		/// Idle zlib states of the current thread, a deflate state costs about 256KB to set up.
+		struct zlib_state_pool
+		{
+			static constexpr std::size_t max_idle_size = 16;
+			std::vector<std::unique_ptr<stream_compressor::zlib_state>> idle_states;
+		};
+		thread_local zlib_state_pool cur_thread_pool;
+	} // namespace
+
+	stream_compressor::stream_compressor(content_encoding encoding, int level)
+		: encoding_(encoding)
+	{
+		auto &idle_states = cur_thread_pool.idle_states;
+		for (auto iter = idle_states.rbegin(); iter != idle_states.rend(); ++iter)
+		{
+			if ((*iter)->encoding == encoding && (*iter)->level == level)
+			{
+				state_ = std::move(*iter);
+				idle_states.erase(std::next(iter).base());
+				deflateReset(&state_->stream);
+				return;
+			}
+		}
+		state_ = std::make_unique<zlib_state>(encoding, level);
+	}
+
+	stream_compressor::~stream_compressor()
+	{
+		auto &idle_states = cur_thread_pool.idle_states;
+		if (state_ && state_->initialized && idle_states.size() < zlib_state_pool::max_idle_size)
+		{
+			idle_states.push_back(std::move(state_));
+		}
+	}
+
+	bool stream_compressor::update(std::string_view input, bool finish, std::string &dest)
+	{
+		if (!state_->initialized)
+		{
+			return false;
+		}
+		auto &stream = state_->stream;
+		stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+		stream.avail_in = uInt(input.size());
+		int flush = finish ? Z_FINISH : Z_SYNC_FLUSH;
+		while (true)
+		{
+			auto prev_size = dest.size();
+			auto out_size = std::max<std::size_t>(deflateBound(&stream, stream.avail_in), 64);
+			dest.resize(prev_size + out_size);
+			stream.next_out = reinterpret_cast<Bytef *>(&dest[prev_size]);
+			stream.avail_out = uInt(out_size);
+			int err = deflate(&stream, flush);
+			dest.resize(dest.size() - stream.avail_out);
+			if (err == Z_STREAM_END)
+			{
+				return true;
+			}
+			if (err != Z_OK && err != Z_BUF_ERROR)
+			{
+				return false;
+			}
+			if (stream.avail_out != 0)
+			{
+				// all pending output has been flushed
+				return !finish || err == Z_STREAM_END;
+			}
+		}
+	}
+#else
+	struct stream_compressor::zlib_state
+	{
+	};
+
+	stream_compressor::stream_compressor(content_encoding encoding, int)
+		: encoding_(encoding)
+	{
+	}
+
+	stream_compressor::~stream_compressor()
+	{
+	}
+
+	bool stream_compressor::update(std::string_view, bool, std::string &)
+	{
+		return false;
+	}
+#endif
+
+	namespace
+	{
+		/// Whether the status, headers and type of rep allow compressing its body.
+		bool may_compress(const reply &rep, const compression_options &options)
+		{
+			if (rep.websocket || rep.prebuilt)
+			{
+				return false;
+			}
+			auto status_code = rep.get_status_code();
+			if (status_code == 204 || status_code == 304 || status_code == 206)
+			{
+				return false;
+			}
+			if (find_header(rep.headers, "Content-Encoding") || find_header(rep.headers, "Transfer-Encoding"))
+			{
+				return false;
+			}
+			auto content_type = find_header(rep.headers, "Content-Type");
+			if (content_type)
+			{
+				for (const auto &one_type : options.skip_types)
+				{
+					if (has_prefix_nocase(*content_type, one_type))
+					{
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+
+		/// Mark the headers of a compressed reply, its length is set by the caller.
+		void set_encoding_headers(std::vector<header> &headers, content_encoding encoding)
+		{
+			set_header(headers, "Content-Encoding", encoding_token(encoding));
+			auto vary = find_header(headers, "Vary");
+			if (!vary)
+			{
+				set_header(headers, "Vary", "Accept-Encoding");
+			}
+			else if (*vary != "*")
+			{
+				set_header(headers, "Vary", *vary + ", Accept-Encoding");
+			}
+		}
+
+		/// Compresses the pieces of another body_source as they are read, each one is
+		/// flushed so that it can be sent on its own.
+		class compressing_body_source : public body_source
+		{
+		public:
+			compressing_body_source(std::shared_ptr<body_source> source, content_encoding encoding, int level)
+				: state_(std::make_shared<stream_state>(std::move(source), encoding, level))
+			{
+			}
+
+			void read(read_handler cb) override
+			{
+				// the piece is dropped if the reader has let go of this source meanwhile
+				auto &source = *state_->source;
+				source.read([weak_state = std::weak_ptr<stream_state>(state_), cb = std::move(cb)](const std::string &err, std::string data, bool finished)
+					{
+						auto state = weak_state.lock();
+						if (!state)
+						{
+							return;
+						}
+						if (!err.empty())
+						{
+							cb(err, std::string(), false);
+							return;
+						}
+						std::string compressed;
+						if (!state->compressor.update(data, finished, compressed))
+						{
+							cb("compression failed", std::string(), false);
+							return;
+						}
+						cb(std::string(), std::move(compressed), finished);
+					});
+			}
+
+		private:
+			struct stream_state
+			{
+				stream_state(std::shared_ptr<body_source> in_source, content_encoding encoding, int level)
+					: source(std::move(in_source)), compressor(encoding, level)
+				{
+				}
+
+				std::shared_ptr<body_source> source;
+				stream_compressor compressor;
+			};
+
+			std::shared_ptr<stream_state> state_;
+		};
+	} // namespace
+
+	bool compress_reply(const reply &rep, content_encoding encoding, const compression_options &options, reply &dest)
+	{
+		if (encoding == content_encoding::identity || !may_compress(rep, options))
+		{
+			return false;
+		}
+		if (rep.body_stream)
+		{
+			// a stream is only known to be small when it tells its length
+			auto content_length = find_header(rep.headers, "Content-Length");
+			if (content_length && std::strtoull(content_length->c_str(), nullptr, 10) < options.min_size)
+			{
+				return false;
+			}
+			dest.status = rep.status;
+			dest.headers = rep.headers;
+			dest.content.clear();
+			dest.headers.erase(std::remove_if(dest.headers.begin(), dest.headers.end(), [](const header &h)
+				{
+					return iequals(h.name, "Content-Length");
+				}), dest.headers.end());
+			set_encoding_headers(dest.headers, encoding);
+			dest.body_stream = std::make_shared<compressing_body_source>(rep.body_stream, encoding, options.level);
+			return true;
+		}
+		if (rep.content.size() < options.min_size)
+		{
+			return false;
+		}
+		std::string compressed;
+		{
+			stream_compressor compressor(encoding, options.level);
+			compressed.reserve(rep.content.size() / 2);
+			if (!compressor.update(rep.content, true, compressed))
+			{
+				return false;
+			}
+		}
+		if (compressed.size() >= rep.content.size())
+		{
+			return false;
+		}
+		dest.status = rep.status;
+		dest.headers = rep.headers;
+		dest.content = std::move(compressed);
+		set_encoding_headers(dest.headers, encoding);
+		set_header(dest.headers, "Content-Length", std::to_string(dest.content.size()));
+		return true;
+	}
+
+	request_handler make_compression_handler(request_handler next, const compression_options &options)
+	{
+		auto shared_options = std::make_shared<const compression_options>(options);
+		return [next = std::move(next), shared_options](std::weak_ptr<request> weak_req, reply_handler cb)
+		{
+			auto req_ptr = weak_req.lock();
+			if (!req_ptr)
+			{
+				return;
+			}
+			auto accept_encoding = find_header(req_ptr->headers, "Accept-Encoding");
+			auto encoding = accept_encoding ? negotiate_encoding(*accept_encoding) : content_encoding::identity;
+			if (encoding == content_encoding::identity || req_ptr->method == "HEAD")
+			{
+				next(weak_req, std::move(cb));
+				return;
+			}
+			next(weak_req, [cb = std::move(cb), encoding, shared_options](const reply &rep)
+				 {
+					 reply compressed_rep;
+					 if (compress_reply(rep, encoding, *shared_options, compressed_rep))
+					 {
+						 cb(compressed_rep);
+					 }
+					 else
+					 {
+						 cb(rep);
+					 }
+				 });
+		};
+	}
+
+} // namespace spiritsaway::http_server
@@ -1,21 +1,144 @@
 
 #include "connection.hpp"
+#include <algorithm>
+#include <cstdio>
 #include <utility>
 #include <vector>
 #include "connection_manager.hpp"
+#include "date_cache.hpp"
+#include "metrics.hpp"
+#include "admission_control.hpp"
+#include "reply_mailbox.hpp"
 #include <iostream>
 
 namespace spiritsaway::http_server {
 
-	connection::connection(asio::ip::tcp::socket socket, connection_manager& con_mgr, const request_handler& handler)
+	namespace
+	{
+		/// The request::body_stream of a streamed request, reads through to the connection.
+		class connection_body_source : public body_source
+		{
+		public:
+			explicit connection_body_source(std::weak_ptr<connection> con)
+				: con_(std::move(con))
+			{
+			}
+
+			void read(read_handler cb) override
+			{
+				auto strong_con = con_.lock();
+				if (!strong_con)
+				{
+					cb("connection closed", std::string(), false);
+					return;
+				}
+				strong_con->read_request_body(std::move(cb));
+			}
+
+		private:
+			std::weak_ptr<connection> con_;
+		};
+
+		const char last_chunk[] = "0\r\n\r\n";
+		const char chunk_crlf[] = "\r\n";
+		const char http2_upgrade_reply[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	}
+
+	connection::connection(asio::ip::tcp::socket socket, connection_manager& con_mgr, std::shared_ptr<const server_options> options, admission_controller& admission, reply_mailbox& mailbox)
 		: socket_(std::move(socket)),
 		connection_manager_(con_mgr),
-		request_handler_(handler),
-		con_timer_(socket_.get_executor())
+		output_(options->max_write_bytes, options->max_write_segments),
+		options_(std::move(options)),
+		con_timer_(socket_.get_executor()),
+		timeout_seconds_(options_->timeout_seconds),
+		metrics_(options_->metrics.get()),
+		admission_(admission),
+		mailbox_(mailbox)
 	{
+		if (!options_->lazy_read_buffer)
+		{
+			buffer_ = buffer_pool::acquire();
+		}
+		request_parser_.set_stream_body(options_->stream_request_body, options_->stream_body_threshold);
+		set_remote_address();
 		std::cout << "new connection begin" << std::endl;
 	}
 
+	connection::~connection()
+	{
+		release_admission();
+	}
+
+	void connection::set_remote_address()
+	{
+		asio::error_code ec;
+		auto remote_endpoint = socket_.remote_endpoint(ec);
+		if (!ec)
+		{
+			remote_address_ = remote_endpoint.address().to_string();
+		}
+		else
+		{
+			remote_address_.clear();
+		}
+	}
+
+	void connection::release_admission()
+	{
+		if (admitted_.exchange(false))
+		{
+			admission_.release(std::chrono::steady_clock::duration::zero());
+		}
+	}
+
+	void connection::recycle()
+	{
+		release_admission();
+		asio::error_code ec;
+		socket_.close(ec);
+		con_timer_.cancel();
+		release_read_buffer();
+		request_.reset();
+		reply_ = reply();
+		chunked_reply_ = false;
+		keep_alive_ = false;
+		waiting_for_request_ = true;
+		draining_ = false;
+		output_.clear();
+		writing_ = false;
+		cork_count_ = 0;
+		close_after_write_ = false;
+		in_request_loop_ = false;
+		next_request_ready_ = false;
+		body_waiting_for_write_ = false;
+		read_waiting_for_write_ = false;
+		upgraded_ = false;
+		websocket_.reset();
+		websocket_input_.clear();
+		websocket_message_.clear();
+		websocket_in_message_ = false;
+		websocket_close_sent_ = false;
+		websocket_buffered_ = 0;
+		websocket_blocked_ = false;
+		http2_.reset();
+	}
+
+	void connection::reset(asio::ip::tcp::socket socket)
+	{
+		socket_ = std::move(socket);
+		// the new socket comes with a strand of its own, the timer must run on it too
+		con_timer_ = asio::basic_waitable_timer<std::chrono::steady_clock>(socket_.get_executor());
+		if (!options_->lazy_read_buffer)
+		{
+			buffer_ = buffer_pool::acquire();
+		}
+		request_parser_.reset();
+		admission_checked_ = false;
+		// replies to the requests of the last socket can not reach this one, their weak_ptr has expired
+		request_id_ = 0;
+		set_remote_address();
+	}
+
 	void connection::start()
 	{
 		do_read();
@@ -24,105 +147,1114 @@ namespace spiritsaway::http_server {
 	void connection::stop()
 	{
 		socket_.close();
+		con_timer_.cancel();
 	}
 
-	void connection::do_read()
+	bool connection::wait_before_read() const
 	{
-		auto self(shared_from_this());
+		return options_->lazy_read_buffer && !buffer_ && large_buffer_.empty();
+	}
 
-		if (con_timer_.expires_from_now(std::chrono::seconds(timeout_seconds_)) != 0)
+	asio::mutable_buffer connection::acquire_read_buffer()
+	{
+		if (!large_buffer_.empty())
+		{
+			read_buffer_ = asio::buffer(large_buffer_);
+		}
+		else
+		{
+			if (!buffer_)
+			{
+				buffer_ = buffer_pool::acquire();
+			}
+			read_buffer_ = asio::buffer(*buffer_);
+		}
+		return read_buffer_;
+	}
+
+	void connection::grow_read_buffer(std::size_t bytes_transferred)
+	{
+		auto cur_size = read_buffer_.size();
+		if (bytes_transferred < cur_size || cur_size >= options_->max_read_buffer_size)
 		{
-			connection_manager_.stop(self);
 			return;
 		}
+		// the read filled the buffer, more is likely waiting in the socket
+		large_buffer_.resize(std::min(cur_size * 2, options_->max_read_buffer_size));
+		buffer_.reset();
+	}
 
-		socket_.async_read_some(asio::buffer(buffer_),
-			[this, self](std::error_code ec, std::size_t bytes_transferred)
+	void connection::release_read_buffer()
+	{
+		buffer_.reset();
+		std::vector<char>().swap(large_buffer_);
+		read_buffer_ = asio::mutable_buffer();
+	}
+
+	void connection::arm_timer()
+	{
+		// a closing WebSocket gets the normal timeout to answer the close frame
+		auto cur_timeout = upgraded_ && !websocket_close_sent_ ? options_->websocket_timeout_seconds : timeout_seconds_;
+		if (!cur_timeout)
+		{
+			con_timer_.cancel();
+			return;
+		}
+		auto self(shared_from_this());
+		con_timer_.expires_from_now(std::chrono::seconds(cur_timeout));
+		con_timer_.async_wait([this, self](std::error_code ec)
 			{
-				con_timer_.cancel();
+				// a wait that completed just before the deadline was moved is not a timeout
+				if (!ec && con_timer_.expiry() <= std::chrono::steady_clock::now())
+				{
+					on_timeout();
+				}
+			});
+	}
+
+	connection::read_outcome connection::on_read(std::error_code ec, std::size_t bytes_transferred)
+	{
+		con_timer_.cancel();
 
-				if (!ec)
+		if (ec)
+		{
+			if (ec != asio::error::operation_aborted)
+			{
+				connection_manager_.stop(shared_from_this());
+			}
+			return read_outcome::finished;
+		}
+		if (metrics_)
+		{
+			metrics_->add(server_metric::received_bytes, bytes_transferred);
+		}
+		auto data = static_cast<const char*>(read_buffer_.data());
+		if (bytes_transferred)
+		{
+			if (options_->http2 && waiting_for_request_ && !request_id_ && is_http2_preface_start(data, bytes_transferred))
+			{
+				// only the first bytes of a connection may be the preface of a prior knowledge client
+				start_http2(data, bytes_transferred, nullptr);
+				return read_outcome::finished;
+			}
+			waiting_for_request_ = false;
+		}
+		auto result = request_parser_.parse(data, bytes_transferred);
+		grow_read_buffer(bytes_transferred);
+		return on_parsed(result);
+	}
+
+	connection::read_outcome connection::on_pending_input()
+	{
+		waiting_for_request_ = false;
+		return on_parsed(request_parser_.parse_pending_input());
+	}
+
+	connection::read_outcome connection::on_parsed(request_parser::result_type result)
+	{
+		if (result != request_parser::result_type::bad && request_parser_.headers_complete_ && !admission_checked_)
+		{
+			// refuse before the body is read, an overloaded server should not spend time on it
+			admission_checked_ = true;
+			if (!admission_.try_admit())
+			{
+				if (metrics_)
 				{
-					request_parser::result_type result = request_parser_.parse(buffer_.data(), bytes_transferred);
+					metrics_->add(server_metric::shed_requests);
+				}
+				reply_ = admission_controller::shed_reply();
+				queue_reply(false);
+				return read_outcome::finished;
+			}
+			admitted_ = true;
+		}
 
-					if (result == request_parser::result_type::good)
-					{
-						handle_request();
-					}
-					else if (result == request_parser::result_type::bad)
+		if (result == request_parser::result_type::good && options_->http2 && request_parser_.upgrade() && is_http2_upgrade(request_parser_.req_))
+		{
+			// the request is answered on stream 1 and is admitted there again
+			release_admission();
+			auto upgrade_request = std::make_shared<request>();
+			request_parser_.move_req(*upgrade_request);
+			auto input = request_parser_.take_pending_input();
+			request_parser_.next_message();
+			start_http2(input.data(), input.size(), std::move(upgrade_request));
+			return read_outcome::finished;
+		}
+		if (result == request_parser::result_type::good || result == request_parser::result_type::headers_ready)
+		{
+			return read_outcome::request_ready;
+		}
+		else if (result == request_parser::result_type::bad)
+		{
+			if (metrics_)
+			{
+				metrics_->add(server_metric::parse_errors);
+			}
+			reply_ = reply::stock_reply(reply::status_type::bad_request);
+			queue_reply(false);
+			return read_outcome::finished;
+		}
+		return read_outcome::incomplete;
+	}
+
+	bool connection::ready_for_next_request()
+	{
+		// buffered requests add to the output until it is full, a client that pipelines without
+		// reading the replies gets no more of them queued. Otherwise the socket is read only
+		// once the replies are written, so that a read and a write never wait on the strand
+		// together.
+		if (in_request_loop_ ? !output_.full() : !writing_ && output_.empty())
+		{
+			return true;
+		}
+		read_waiting_for_write_ = true;
+		return false;
+	}
+
+	void connection::read_request_body(body_source::read_handler cb)
+	{
+		// the handler may read from any thread, the parser is only touched by this connection's executor
+		asio::dispatch(socket_.get_executor(), [self = shared_from_this(), cb = std::move(cb)]() mutable
+			{
+				self->do_read_body(std::move(cb));
+			});
+	}
+
+	void connection::do_read_body(body_source::read_handler cb)
+	{
+		auto data = request_parser_.take_body();
+		if (!data.empty() || request_parser_.req_complete_)
+		{
+			cb(std::string(), std::move(data), request_parser_.req_complete_);
+			return;
+		}
+		auto self(shared_from_this());
+		socket_.async_read_some(acquire_read_buffer(),
+			[this, self, cb = std::move(cb)](std::error_code ec, std::size_t bytes_transferred) mutable
+			{
+				if (ec)
+				{
+					cb(ec.message(), std::string(), false);
+					return;
+				}
+				if (metrics_)
+				{
+					metrics_->add(server_metric::received_bytes, bytes_transferred);
+				}
+				if (request_parser_.parse(static_cast<const char*>(read_buffer_.data()), bytes_transferred) == request_parser::result_type::bad)
+				{
+					cb("invalid request body", std::string(), false);
+					return;
+				}
+				grow_read_buffer(bytes_transferred);
+				do_read_body(std::move(cb));
+			});
+	}
+
+	void connection::queue_reply(bool may_keep_alive)
+	{
+		bool request_is_11 = request_ && (request_->http_version_major > 1 || (request_->http_version_major == 1 && request_->http_version_minor >= 1));
+		// the connection can only carry another request once this one has been read whole
+		// the bytes after an upgrade request that is not accepted are in the other protocol
+		keep_alive_ = may_keep_alive && !draining_ && request_ && request_id_ < options_->keep_alive_requests && request_parser_.req_complete_ && request_parser_.keep_alive() && !request_parser_.upgrade();
+		chunked_reply_ = false;
+		const serialized_reply* cur_buffer = reply_.prebuilt.get();
+		serialized_reply serialized;
+		if (!cur_buffer)
+		{
+			if (reply_.body_stream && !find_header(reply_.headers, "Content-Length"))
+			{
+				// chunked coding needs both sides to speak HTTP/1.1, otherwise closing the connection ends the body
+				if (request_is_11 && reply_.status.compare(0, 8, "HTTP/1.1") == 0)
+				{
+					chunked_reply_ = true;
+					set_header(reply_.headers, "Transfer-Encoding", "chunked");
+				}
+				else
+				{
+					keep_alive_ = false;
+				}
+			}
+			serialized.status_line = output_.take_spare();
+			serialized.remain = output_.take_spare();
+			reply_.serialize_into(serialized);
+			cur_buffer = &serialized;
+		}
+		if (metrics_)
+		{
+			metrics_->record_status(reply_.get_status_code());
+		}
+		keep_alive_ = keep_alive_ && !cur_buffer->close_connection;
+		// copy the cached Date and Server lines, the thread buffer may be refreshed before the write
+		auto header_lines = output_.take_spare();
+		header_lines.assign(date_cache::header_lines(!cur_buffer->has_date, !cur_buffer->has_server));
+		if (options_->keep_alive_requests && request_ && !cur_buffer->has_connection)
+		{
+			// HTTP/1.0 on either side means close unless the reply says otherwise
+			bool reply_is_11 = cur_buffer->status_line.compare(0, 8, "HTTP/1.1") == 0;
+			if (keep_alive_ && !(request_is_11 && reply_is_11))
+			{
+				header_lines += "Connection: keep-alive\r\n";
+			}
+			else if (!keep_alive_ && request_is_11)
+			{
+				header_lines += "Connection: close\r\n";
+			}
+		}
+		if (reply_.prebuilt)
+		{
+			output_.push(reply_.prebuilt, asio::buffer(cur_buffer->status_line));
+			output_.push(std::move(header_lines));
+			output_.push(reply_.prebuilt, asio::buffer(cur_buffer->remain));
+			finish_reply();
+			return;
+		}
+		output_.push(std::move(serialized.status_line));
+		output_.push(std::move(header_lines));
+		output_.push(std::move(serialized.remain));
+		if (reply_.websocket && request_parser_.upgrade() && reply_.get_status_code() == 101)
+		{
+			start_websocket();
+			return;
+		}
+		if (reply_.body_stream)
+		{
+			do_write_body();
+			// the head leaves now even if the source has no piece yet, e.g. an idle event stream
+			if (!in_request_loop_)
+			{
+				flush_output();
+			}
+			return;
+		}
+		finish_reply();
+	}
+
+	void connection::finish_reply()
+	{
+		if (!keep_alive_)
+		{
+			close_after_write_ = true;
+			if (!in_request_loop_)
+			{
+				flush_output();
+			}
+			return;
+		}
+		request_parser_.next_message();
+		admission_checked_ = false;
+		waiting_for_request_ = !request_parser_.has_pending_input();
+		if (in_request_loop_)
+		{
+			// basic_connection goes on with the next request once the handler returns
+			next_request_ready_ = true;
+			return;
+		}
+		// the write that drains the output starts the next request, not the caller, which may
+		// be a body_source that reply_ still owns
+		read_waiting_for_write_ = true;
+		flush_output();
+	}
+
+	void connection::flush_output()
+	{
+		if (writing_ || cork_count_)
+		{
+			return;
+		}
+		if (output_.empty())
+		{
+			if (close_after_write_)
+			{
+				close_after_write_ = false;
+				on_write_finished(std::error_code());
+			}
+			return;
+		}
+		writing_ = true;
+		arm_timer();
+		auto self(shared_from_this());
+		asio::async_write(socket_, output_.prepare(),
+			[this, self](std::error_code ec, std::size_t bytes_transferred)
+			{
+				writing_ = false;
+				count_sent(bytes_transferred);
+				if (ec)
+				{
+					on_write_finished(ec);
+					return;
+				}
+				output_.consume(bytes_transferred);
+				if (upgraded_)
+				{
+					on_websocket_written();
+				}
+				if (http2_)
+				{
+					http2_->on_output_written();
+					if (http2_->finished())
 					{
-						reply_ = reply::stock_reply(reply::status_type::bad_request);
-						do_write();
+						close_after_write_ = true;
 					}
-					else
+				}
+				if (body_waiting_for_write_ && !output_.full())
+				{
+					body_waiting_for_write_ = false;
+					do_write_body();
+				}
+				if (read_waiting_for_write_ && output_.empty())
+				{
+					read_waiting_for_write_ = false;
+					do_read();
+				}
+				flush_output();
+			});
+	}
+
+	void connection::do_write_body()
+	{
+		if (output_.full())
+		{
+			body_waiting_for_write_ = true;
+			return;
+		}
+		auto weak_self = std::weak_ptr<connection>(shared_from_this());
+		if (reply_.body_stream->shares_pieces())
+		{
+			reply_.body_stream->read_shared([weak_self](const std::string& err, std::shared_ptr<const std::string> data, bool finished)
+				{
+					auto strong_self = weak_self.lock();
+					if (!strong_self)
 					{
-						do_read();
+						return;
 					}
-				}
-				else if (ec != asio::error::operation_aborted)
+					auto& con = *strong_self;
+					asio::dispatch(con.socket_.get_executor(), [strong_self, err, data = std::move(data), finished]() mutable
+						{
+							strong_self->on_body_piece(err, std::string(), std::move(data), finished);
+						});
+				});
+			return;
+		}
+		reply_.body_stream->read([weak_self](const std::string& err, std::string data, bool finished)
+			{
+				auto strong_self = weak_self.lock();
+				if (!strong_self)
 				{
-					connection_manager_.stop(shared_from_this());
+					return;
 				}
+				auto& con = *strong_self;
+				asio::dispatch(con.socket_.get_executor(), [strong_self, err, data = std::move(data), finished]() mutable
+					{
+						strong_self->on_body_piece(err, std::move(data), nullptr, finished);
+					});
 			});
 	}
 
-	void connection::do_write()
+	void connection::on_body_piece(const std::string& err, std::string data, std::shared_ptr<const std::string> shared_data, bool finished)
 	{
-		auto self(shared_from_this());
+		if (!err.empty())
+		{
+			// the head is already sent, the client can only learn of the failure by the close
+			connection_manager_.stop(shared_from_this());
+			return;
+		}
+		auto data_size = shared_data ? shared_data->size() : data.size();
+		if (chunked_reply_ && data_size)
+		{
+			char size_buffer[32];
+			auto size_len = std::snprintf(size_buffer, sizeof(size_buffer), "%zx\r\n", data_size);
+			output_.push(std::string(size_buffer, size_len));
+		}
+		if (shared_data)
+		{
+			// written straight from the piece the source shares with its other readers
+			auto buffer = asio::buffer(*shared_data);
+			output_.push(std::move(shared_data), buffer);
+		}
+		else
+		{
+			output_.push(std::move(data));
+		}
+		if (chunked_reply_ && data_size)
+		{
+			output_.push(std::shared_ptr<const void>(), asio::buffer(chunk_crlf, 2));
+		}
+		if (!finished)
+		{
+			do_write_body();
+			if (!in_request_loop_)
+			{
+				flush_output();
+			}
+			return;
+		}
+		if (chunked_reply_)
+		{
+			output_.push(std::shared_ptr<const void>(), asio::buffer(last_chunk, sizeof(last_chunk) - 1));
+		}
+		finish_reply();
+		if (!in_request_loop_)
+		{
+			flush_output();
+		}
+	}
+
+	void connection::on_write_finished(std::error_code ec)
+	{
+		if (!ec)
+		{
+			// Initiate graceful connection closure.
+			asio::error_code ignored_ec;
+			socket_.shutdown(asio::ip::tcp::socket::shutdown_both,
+				ignored_ec);
+		}
+
+		if (ec != asio::error::operation_aborted)
+		{
+			connection_manager_.stop(shared_from_this());
+		}
+	}
 
-		if (con_timer_.expires_from_now(std::chrono::seconds(timeout_seconds_)) != 0)
+	void connection::count_sent(std::size_t bytes_transferred)
+	{
+		if (metrics_)
 		{
-			connection_manager_.stop(self);
+			metrics_->add(server_metric::sent_bytes, bytes_transferred);
+		}
+	}
+
+	void connection::deliver_reply(std::uint64_t request_id, reply in_reply)
+	{
+		if (http2_)
+		{
+			http2_->send_reply(std::uint32_t(request_id), std::move(in_reply));
+			flush_http2();
 			return;
 		}
-		m_reply_str = reply_.to_string();
-		asio::async_write(socket_, asio::buffer(m_reply_str),
-			[this, self](std::error_code ec, std::size_t)
+		if (request_id == request_id_)
+		{
+			on_reply(std::move(in_reply));
+		}
+	}
+
+	void connection::begin_drain()
+	{
+		asio::dispatch(socket_.get_executor(), [self = shared_from_this()]()
 			{
-				if (!ec)
+				self->draining_ = true;
+				if (self->http2_)
+				{
+					self->http2_->go_away();
+					self->flush_http2();
+					return;
+				}
+				if (self->upgraded_)
+				{
+					self->close(websocket_status::going_away, "server shutting down");
+					return;
+				}
+				if (!self->waiting_for_request_)
+				{
+					// the reply of the request in progress closes the connection
+					return;
+				}
+				if (self->writing_ || !self->output_.empty())
 				{
-					// Initiate graceful connection closure.
-					asio::error_code ignored_ec;
-					socket_.shutdown(asio::ip::tcp::socket::shutdown_both,
-						ignored_ec);
+					self->read_waiting_for_write_ = false;
+					self->close_after_write_ = true;
+					return;
 				}
+				self->connection_manager_.stop(self);
+			});
+	}
+
+	void connection::cork()
+	{
+		asio::dispatch(socket_.get_executor(), [self = shared_from_this()]()
+			{
+				self->cork_count_++;
+			});
+	}
 
-				if (ec != asio::error::operation_aborted)
+	void connection::uncork()
+	{
+		asio::dispatch(socket_.get_executor(), [self = shared_from_this()]()
+			{
+				if (self->cork_count_ && !--self->cork_count_ && !self->in_request_loop_)
 				{
-					connection_manager_.stop(shared_from_this());
+					self->flush_output();
 				}
 			});
 	}
 
-	void connection::on_reply(const reply& in_reply)
+	void connection::on_reply(reply in_reply)
 	{
 		con_timer_.cancel();
-		reply_ = in_reply;
-		do_write();
-
+		auto handler_latency = std::chrono::steady_clock::now() - request_begin_;
+		if (admitted_.exchange(false))
+		{
+			admission_.release(handler_latency);
+		}
+		if (metrics_)
+		{
+			metrics_->record_latency(metrics_registry::all_routes, handler_latency);
+		}
+		reply_ = std::move(in_reply);
+		queue_reply(true);
 	}
+
 	void connection::on_timeout()
 	{
+		if (metrics_)
+		{
+			metrics_->add(server_metric::timeouts);
+		}
 		connection_manager_.stop(shared_from_this());
 	}
-	void connection::handle_request()
+
+	std::weak_ptr<request> connection::begin_request()
 	{
 		auto self = shared_from_this();
+		if (!socket_.is_open())
+		{
+			return std::weak_ptr<request>();
+		}
 		request_ = std::make_shared<request>();
 		request_parser_.move_req(*request_);
-		if (con_timer_.expires_from_now(std::chrono::seconds(timeout_seconds_)) != 0)
+		request_->remote_address = remote_address_;
+		request_->output = std::weak_ptr<output_control>(std::shared_ptr<output_control>(self, this));
+		request_id_++;
+		request_begin_ = std::chrono::steady_clock::now();
+		if (metrics_)
 		{
-			connection_manager_.stop(self);
-			return;
+			metrics_->add(server_metric::requests);
+		}
+		if (request_parser_.body_streamed())
+		{
+			request_->body_stream = std::make_shared<connection_body_source>(self);
 		}
-		auto weak_self = std::weak_ptr<connection>(self);
-		auto weak_request = std::weak_ptr<request>(request_);
-		request_handler_(weak_request, [weak_self](const reply& in_reply) {
+		else if (options_->lazy_read_buffer)
+		{
+			// nothing more is read for this request
+			release_read_buffer();
+		}
+		// the handler has the timeout of a read to reply
+		arm_timer();
+		return request_;
+	}
+
+	bool connection::running_in_strand()
+	{
+		// a socket that is not on a strand gets its replies through the mailbox
+		auto strand = socket_.get_executor().target<asio::strand<asio::io_context::executor_type>>();
+		return strand && strand->running_in_this_thread();
+	}
+
+	reply_handler connection::make_reply_handler(std::uint64_t request_id)
+	{
+		auto weak_self = std::weak_ptr<connection>(shared_from_this());
+		return [weak_self, request_id](const reply& in_reply) {
 			auto strong_self = weak_self.lock();
-			if (strong_self)
+			if (!strong_self)
+			{
+				return;
+			}
+			if (strong_self->running_in_strand())
+			{
+				strong_self->deliver_reply(request_id, in_reply);
+				return;
+			}
+			// replies from other threads are batched to the I/O threads, the connection is not thread safe
+			strong_self->mailbox_.deliver(std::move(strong_self), request_id, in_reply);
+			};
+	}
+
+
+	void connection::start_websocket()
+	{
+		upgraded_ = true;
+		websocket_ = std::move(reply_.websocket);
+		keep_alive_ = false;
+		// the client may have sent its first frames right behind the upgrade request
+		websocket_input_ = request_parser_.take_pending_input();
+		request_parser_.next_message();
+		websocket_buffered_ = output_.size();
+		auto self = shared_from_this();
+		websocket_->on_open(std::shared_ptr<websocket_session>(self, this));
+		if (!websocket_input_.empty())
+		{
+			auto consumed = on_websocket_input(websocket_input_.data(), websocket_input_.size());
+			websocket_input_.erase(0, consumed);
+		}
+		if (!in_request_loop_)
+		{
+			flush_output();
+		}
+		if (!close_after_write_)
+		{
+			websocket_read();
+		}
+	}
+
+	void connection::websocket_read()
+	{
+		arm_timer();
+		auto self(shared_from_this());
+		auto read_now = [this, self]()
+		{
+			socket_.async_read_some(acquire_read_buffer(),
+				[this, self](std::error_code ec, std::size_t bytes_transferred)
+				{
+					on_websocket_read(ec, bytes_transferred);
+				});
+		};
+		if (!wait_before_read())
+		{
+			read_now();
+			return;
+		}
+		socket_.async_wait(asio::ip::tcp::socket::wait_read,
+			[this, read_now](std::error_code ec)
+			{
+				if (ec)
+				{
+					on_websocket_read(ec, 0);
+					return;
+				}
+				read_now();
+			});
+	}
+
+	void connection::on_websocket_read(std::error_code ec, std::size_t bytes_transferred)
+	{
+		if (ec)
+		{
+			end_websocket(websocket_status::abnormal, std::string_view());
+			if (ec != asio::error::operation_aborted)
+			{
+				connection_manager_.stop(shared_from_this());
+			}
+			return;
+		}
+		if (metrics_)
+		{
+			metrics_->add(server_metric::received_bytes, bytes_transferred);
+		}
+		auto data = static_cast<char*>(read_buffer_.data());
+		if (websocket_input_.empty())
+		{
+			// the common case, whole frames are unmasked and handled where they were read
+			auto consumed = on_websocket_input(data, bytes_transferred);
+			websocket_input_.assign(data + consumed, bytes_transferred - consumed);
+		}
+		else
+		{
+			websocket_input_.append(data, bytes_transferred);
+			auto consumed = on_websocket_input(websocket_input_.data(), websocket_input_.size());
+			websocket_input_.erase(0, consumed);
+		}
+		if (options_->lazy_read_buffer && websocket_input_.empty())
+		{
+			// an idle WebSocket holds no read buffer, like a connection between requests
+			release_read_buffer();
+		}
+		else
+		{
+			grow_read_buffer(bytes_transferred);
+		}
+		if (!close_after_write_ && socket_.is_open())
+		{
+			websocket_read();
+		}
+	}
+
+	std::size_t connection::on_websocket_input(char* data, std::size_t size)
+	{
+		bool was_in_loop = in_request_loop_;
+		in_request_loop_ = true;
+		std::size_t offset = 0;
+		while (!close_after_write_)
+		{
+			websocket_frame frame;
+			std::size_t frame_size = 0;
+			auto result = parse_websocket_frame(data + offset, size - offset, frame, frame_size);
+			if (result == websocket_parse_result::bad)
+			{
+				fail_websocket(websocket_status::protocol_error);
+				break;
+			}
+			if (result == websocket_parse_result::incomplete)
+			{
+				if (frame_size > options_->websocket_max_message_size + max_websocket_header_size + 4)
+				{
+					fail_websocket(websocket_status::message_too_big);
+				}
+				else if (frame_size > websocket_input_.capacity())
+				{
+					websocket_input_.reserve(frame_size);
+				}
+				break;
+			}
+			offset += frame_size;
+			if (!on_websocket_frame(frame))
+			{
+				break;
+			}
+		}
+		in_request_loop_ = was_in_loop;
+		if (!in_request_loop_)
+		{
+			flush_output();
+		}
+		return offset;
+	}
+
+	bool connection::on_websocket_frame(const websocket_frame& frame)
+	{
+		switch (frame.opcode)
+		{
+		case websocket_opcode::ping:
+			if (queue_websocket_header(websocket_opcode::pong, frame.payload.size()))
+			{
+				output_.push(std::string(frame.payload));
+				websocket_buffered_ = output_.size();
+			}
+			return true;
+		case websocket_opcode::pong:
+			return true;
+		case websocket_opcode::close:
+		{
+			if (frame.payload.size() == 1)
+			{
+				return fail_websocket(websocket_status::protocol_error);
+			}
+			// a close without a status code is answered with an empty one
+			std::uint16_t code = 1005;
+			std::string_view reason;
+			if (frame.payload.size() >= 2)
+			{
+				code = std::uint16_t((static_cast<unsigned char>(frame.payload[0]) << 8) | static_cast<unsigned char>(frame.payload[1]));
+				reason = frame.payload.substr(2);
+			}
+			if (!websocket_close_sent_)
+			{
+				if (code == 1005)
+				{
+					queue_websocket_header(websocket_opcode::close, 0);
+				}
+				else
+				{
+					queue_websocket_close(code, std::string_view());
+				}
+			}
+			end_websocket(code, reason);
+			close_after_write_ = true;
+			return false;
+		}
+		case websocket_opcode::text:
+		case websocket_opcode::binary:
+			if (websocket_in_message_)
+			{
+				return fail_websocket(websocket_status::protocol_error);
+			}
+			if (frame.payload.size() > options_->websocket_max_message_size)
+			{
+				return fail_websocket(websocket_status::message_too_big);
+			}
+			if (!frame.fin)
+			{
+				websocket_in_message_ = true;
+				websocket_message_binary_ = frame.opcode == websocket_opcode::binary;
+				websocket_message_.assign(frame.payload.data(), frame.payload.size());
+				return true;
+			}
+			if (websocket_ && !websocket_close_sent_)
+			{
+				websocket_->on_message(frame.payload, frame.opcode == websocket_opcode::binary);
+			}
+			return true;
+		default:
+			if (!websocket_in_message_)
+			{
+				return fail_websocket(websocket_status::protocol_error);
+			}
+			if (websocket_message_.size() + frame.payload.size() > options_->websocket_max_message_size)
 			{
-				strong_self->on_reply(in_reply);
+				return fail_websocket(websocket_status::message_too_big);
 			}
+			websocket_message_.append(frame.payload.data(), frame.payload.size());
+			if (!frame.fin)
+			{
+				return true;
+			}
+			websocket_in_message_ = false;
+			if (websocket_ && !websocket_close_sent_)
+			{
+				websocket_->on_message(websocket_message_, websocket_message_binary_);
+			}
+			// keep the capacity for the next fragmented message
+			websocket_message_.clear();
+			return true;
+		}
+	}
+
+	bool connection::queue_websocket_header(websocket_opcode opcode, std::size_t payload_size)
+	{
+		if (websocket_close_sent_ || !socket_.is_open())
+		{
+			return false;
+		}
+		char header_buffer[max_websocket_header_size];
+		auto header_size = write_websocket_frame_header(header_buffer, opcode, payload_size);
+		output_.push(std::string(header_buffer, header_size));
+		websocket_buffered_ = output_.size();
+		if (opcode == websocket_opcode::close)
+		{
+			websocket_close_sent_ = true;
+			// the client gets the normal timeout to answer
+			arm_timer();
+		}
+		return true;
+	}
+
+	void connection::queue_websocket_close(std::uint16_t code, std::string_view reason)
+	{
+		// control frames carry at most 125 bytes
+		reason = reason.substr(0, 123);
+		std::string payload;
+		payload += char(code >> 8);
+		payload += char(code & 0xff);
+		payload += reason;
+		if (queue_websocket_header(websocket_opcode::close, payload.size()))
+		{
+			output_.push(std::move(payload));
+			websocket_buffered_ = output_.size();
+		}
+	}
+
+	bool connection::fail_websocket(std::uint16_t code)
+	{
+		queue_websocket_close(code, std::string_view());
+		end_websocket(code, std::string_view());
+		close_after_write_ = true;
+		return false;
+	}
+
+	void connection::end_websocket(std::uint16_t code, std::string_view reason)
+	{
+		if (!websocket_)
+		{
+			return;
+		}
+		// the handler usually holds the session, letting go of it breaks the cycle
+		auto handler = std::move(websocket_);
+		handler->on_close(code, reason);
+	}
+
+	void connection::on_websocket_written()
+	{
+		websocket_buffered_ = output_.size();
+		if (output_.size() < options_->websocket_send_buffer_limit && websocket_blocked_.exchange(false) && websocket_)
+		{
+			websocket_->on_writable();
+		}
+	}
+
+	bool connection::send(std::string data, bool binary)
+	{
+		bool below_limit = websocket_buffered_.load(std::memory_order_relaxed) + data.size() <= options_->websocket_send_buffer_limit;
+		asio::dispatch(socket_.get_executor(), [self = shared_from_this(), data = std::move(data), binary]() mutable
+			{
+				if (self->queue_websocket_header(binary ? websocket_opcode::binary : websocket_opcode::text, data.size()))
+				{
+					self->output_.push(std::move(data));
+					self->websocket_buffered_ = self->output_.size();
+					if (!self->in_request_loop_)
+					{
+						self->flush_output();
+					}
+				}
+			});
+		if (!below_limit)
+		{
+			websocket_blocked_ = true;
+		}
+		return below_limit;
+	}
+
+	bool connection::send(std::shared_ptr<const std::string> data, bool binary)
+	{
+		bool below_limit = websocket_buffered_.load(std::memory_order_relaxed) + data->size() <= options_->websocket_send_buffer_limit;
+		asio::dispatch(socket_.get_executor(), [self = shared_from_this(), data = std::move(data), binary]()
+			{
+				if (self->queue_websocket_header(binary ? websocket_opcode::binary : websocket_opcode::text, data->size()))
+				{
+					auto buffer = asio::buffer(*data);
+					self->output_.push(std::move(data), buffer);
+					self->websocket_buffered_ = self->output_.size();
+					if (!self->in_request_loop_)
+					{
+						self->flush_output();
+					}
+				}
+			});
+		if (!below_limit)
+		{
+			websocket_blocked_ = true;
+		}
+		return below_limit;
+	}
+
+	void connection::close(std::uint16_t code, std::string_view reason)
+	{
+		asio::dispatch(socket_.get_executor(), [self = shared_from_this(), code, reason = std::string(reason)]()
+			{
+				if (!self->upgraded_ || self->websocket_close_sent_)
+				{
+					return;
+				}
+				self->queue_websocket_close(code, reason);
+				if (!self->in_request_loop_)
+				{
+					self->flush_output();
+				}
+			});
+	}
+
+	std::size_t connection::buffered_amount() const
+	{
+		return websocket_buffered_.load(std::memory_order_relaxed);
+	}
+
+	void connection::start_http2(const char* data, std::size_t size, std::shared_ptr<request> upgrade_request)
+	{
+		auto self = shared_from_this();
+		keep_alive_ = false;
+		waiting_for_request_ = false;
+		http2_ = std::make_unique<http2_session>(std::shared_ptr<http2_transport>(self, this), output_, *options_, admission_, remote_address_, std::shared_ptr<output_control>(self, this));
+		bool was_in_loop = in_request_loop_;
+		in_request_loop_ = true;
+		if (upgrade_request)
+		{
+			output_.push(std::shared_ptr<const void>(), asio::buffer(http2_upgrade_reply, sizeof(http2_upgrade_reply) - 1));
+			// is_http2_upgrade let the request through only with the header, without it the
+			// client would be taken to have sent an empty list, which keeps the defaults
+			auto settings = find_header(upgrade_request->headers, "HTTP2-Settings");
+			http2_->start_upgraded(settings ? std::string_view(*settings) : std::string_view(), std::move(upgrade_request));
+		}
+		else
+		{
+			http2_->start();
+		}
+		if (size)
+		{
+			http2_->on_input(data, size);
+		}
+		in_request_loop_ = was_in_loop;
+		flush_http2();
+		if (!close_after_write_)
+		{
+			http2_read();
+		}
+	}
+
+	void connection::http2_read()
+	{
+		arm_timer();
+		auto self(shared_from_this());
+		auto read_now = [this, self]()
+		{
+			socket_.async_read_some(acquire_read_buffer(),
+				[this, self](std::error_code ec, std::size_t bytes_transferred)
+				{
+					on_http2_read(ec, bytes_transferred);
+				});
+		};
+		if (!wait_before_read())
+		{
+			read_now();
+			return;
+		}
+		socket_.async_wait(asio::ip::tcp::socket::wait_read,
+			[this, read_now](std::error_code ec)
+			{
+				if (ec)
+				{
+					on_http2_read(ec, 0);
+					return;
+				}
+				read_now();
+			});
+	}
+
+	void connection::on_http2_read(std::error_code ec, std::size_t bytes_transferred)
+	{
+		if (ec)
+		{
+			if (ec != asio::error::operation_aborted)
+			{
+				connection_manager_.stop(shared_from_this());
+			}
+			return;
+		}
+		if (metrics_)
+		{
+			metrics_->add(server_metric::received_bytes, bytes_transferred);
+		}
+		on_http2_input(static_cast<const char*>(read_buffer_.data()), bytes_transferred);
+		if (options_->lazy_read_buffer)
+		{
+			// the session keeps the bytes of an incomplete frame itself
+			release_read_buffer();
+		}
+		else
+		{
+			grow_read_buffer(bytes_transferred);
+		}
+		if (!close_after_write_ && socket_.is_open())
+		{
+			http2_read();
+		}
+	}
+
+	void connection::on_http2_input(const char* data, std::size_t size)
+	{
+		// replies that the handlers give at once leave together after the whole read
+		bool was_in_loop = in_request_loop_;
+		in_request_loop_ = true;
+		http2_->on_input(data, size);
+		in_request_loop_ = was_in_loop;
+		flush_http2();
+	}
+
+	void connection::flush_http2()
+	{
+		if (http2_->finished())
+		{
+			close_after_write_ = true;
+		}
+		if (!in_request_loop_)
+		{
+			flush_output();
+		}
+	}
+
+	void connection::dispatch_stream(std::uint32_t stream_id, std::weak_ptr<request> req)
+	{
+		call_handler(std::move(req), make_reply_handler(stream_id));
+	}
+
+	void connection::run_on_connection(std::function<void()> fn)
+	{
+		asio::dispatch(socket_.get_executor(), [self = shared_from_this(), fn = std::move(fn)]()
+			{
+				if (!self->http2_)
+				{
+					return;
+				}
+				fn();
+				self->flush_http2();
 			});
 	}
 }
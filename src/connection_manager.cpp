@@ -15,17 +15,40 @@ namespace spiritsaway::http_server
             std::lock_guard<std::mutex> guard(con_mutex_);
             connections_.insert(c);
         }
-        c->start();
+        // the first read may complete on another thread while start is still running unless both are on the strand
+        auto executor = c->get_executor();
+        asio::dispatch(executor, [c]()
+            {
+                c->start();
+            });
     }
 
     void connection_manager::stop(connection_ptr c)
     {
+        bool removed = false;
         {
             std::lock_guard<std::mutex> guard(con_mutex_);
-            connections_.erase(c);
+            removed = connections_.erase(c) != 0;
         }
 
         c->stop();
+        if (removed && stop_callback_)
+        {
+            stop_callback_();
+        }
+    }
+
+    void connection_manager::for_each(const std::function<void(const connection_ptr &)> &visitor)
+    {
+        std::vector<connection_ptr> con_copys;
+        {
+            std::lock_guard<std::mutex> guard(con_mutex_);
+            con_copys.insert(con_copys.end(), connections_.begin(), connections_.end());
+        }
+        for (const auto &c : con_copys)
+        {
+            visitor(c);
+        }
     }
 
     void connection_manager::stop_all()
@@ -38,9 +61,19 @@ namespace spiritsaway::http_server
         }
         for (auto c : con_copys)
         {
-            c->stop();
+            // a handler of the connection may be running on another thread
+            auto executor = c->get_executor();
+            asio::dispatch(executor, [c]()
+                {
+                    c->stop();
+                });
         }
     }
+    void connection_manager::set_stop_callback(std::function<void()> callback)
+    {
+        stop_callback_ = std::move(callback);
+    }
+
     std::size_t connection_manager::get_connection_count()
     {
         std::lock_guard<std::mutex> guard(con_mutex_);
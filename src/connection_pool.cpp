@@ -0,0 +1,105 @@
+#include "connection_pool.hpp"
+#include "connection.hpp"
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		std::atomic<std::uint64_t> next_pool_id{1};
+	}
+
+	connection_pool::connection_pool(std::size_t max_idle_per_thread)
+		: id_(next_pool_id.fetch_add(1, std::memory_order_relaxed)),
+		  max_idle_per_thread_(max_idle_per_thread)
+	{
+	}
+
+	connection_pool::~connection_pool()
+	{
+		for (auto &one_list : lists_)
+		{
+			for (auto one_connection : one_list->connections)
+			{
+				delete one_connection;
+			}
+		}
+	}
+
+	connection_pool::free_list &connection_pool::local()
+	{
+		thread_local std::vector<std::pair<std::uint64_t, free_list *>> thread_lists;
+		for (const auto &one_pair : thread_lists)
+		{
+			if (one_pair.first == id_)
+			{
+				return *one_pair.second;
+			}
+		}
+		free_list *result = nullptr;
+		{
+			std::lock_guard<std::mutex> guard(lists_mutex_);
+			lists_.push_back(std::make_unique<free_list>());
+			result = lists_.back().get();
+		}
+		thread_lists.emplace_back(id_, result);
+		return *result;
+	}
+
+	connection *connection_pool::acquire()
+	{
+		if (max_idle_per_thread_ == 0)
+		{
+			return nullptr;
+		}
+		auto &cur_list = local();
+		if (cur_list.connections.empty())
+		{
+			return nullptr;
+		}
+		auto result = cur_list.connections.back();
+		cur_list.connections.pop_back();
+		idle_.fetch_sub(1, std::memory_order_relaxed);
+		reused_.fetch_add(1, std::memory_order_relaxed);
+		return result;
+	}
+
+	void connection_pool::release(connection *released)
+	{
+		if (max_idle_per_thread_ == 0)
+		{
+			delete released;
+			return;
+		}
+		auto &cur_list = local();
+		if (cur_list.connections.size() >= max_idle_per_thread_)
+		{
+			delete released;
+			return;
+		}
+		released->recycle();
+		cur_list.connections.push_back(released);
+		idle_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void connection_pool::recycler::operator()(connection *released) const
+	{
+		// the last reference may go on a worker thread, the connection is reset on its own strand
+		// and kept by the I/O thread that runs it. A post that never runs deletes it.
+		std::unique_ptr<connection> owned(released);
+		auto executor = released->get_executor();
+		asio::post(executor, [pool = pool, owned = std::move(owned)]() mutable
+			{
+				pool->release(owned.release());
+			});
+	}
+
+	connection_pool_statistics connection_pool::get_statistics() const
+	{
+		connection_pool_statistics result;
+		result.created = created_.load(std::memory_order_relaxed);
+		result.reused = reused_.load(std::memory_order_relaxed);
+		result.idle = idle_.load(std::memory_order_relaxed);
+		return result;
+	}
+
+} // namespace spiritsaway::http_server
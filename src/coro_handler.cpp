@@ -0,0 +1,111 @@
+#include "coro_handler.hpp"
+
+#ifdef HTTP_SERVER_WITH_COROUTINES
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		asio::awaitable<void> run_coro_handler(coro_request_handler handler, std::shared_ptr<request> req, reply_handler cb)
+		{
+			reply rep;
+			bool failed = false;
+			try
+			{
+				rep = co_await handler(std::move(req));
+			}
+			catch (const std::exception &)
+			{
+				failed = true;
+			}
+			if (failed)
+			{
+				rep = reply::stock_reply(reply::status_type::internal_server_error);
+			}
+			cb(rep);
+		}
+
+		/// Complete handler on its associated executor, so that the coroutine resumes there and
+		/// not on whatever thread the operation called back on.
+		template <typename Handler, typename... Args>
+		void complete_on_executor(std::shared_ptr<Handler> handler, Args... args)
+		{
+			auto executor = asio::get_associated_executor(*handler);
+			asio::dispatch(executor, [handler = std::move(handler), ... args = std::move(args)]() mutable
+				{
+					std::move(*handler)(std::move(args)...);
+				});
+		}
+	}
+
+	request_handler make_coro_handler(asio::io_context &io_context, coro_request_handler handler)
+	{
+		return [&io_context, handler = std::move(handler)](std::weak_ptr<request> weak_req, reply_handler cb)
+		{
+			auto req_ptr = weak_req.lock();
+			if (!req_ptr)
+			{
+				return;
+			}
+			asio::co_spawn(io_context, run_coro_handler(handler, std::move(req_ptr), std::move(cb)), asio::detached);
+		};
+	}
+
+	asio::awaitable<std::tuple<std::string, std::string, bool>> async_read_some(body_source &source)
+	{
+		return asio::async_initiate<decltype(asio::use_awaitable), void(std::string, std::string, bool)>(
+			[&source](auto handler)
+			{
+				// body_source takes a copyable std::function, asio completion handlers are move only
+				auto shared_handler = std::make_shared<decltype(handler)>(std::move(handler));
+				source.read([shared_handler](const std::string &err, std::string data, bool finished)
+					{
+						complete_on_executor(shared_handler, err, std::move(data), finished);
+					});
+			},
+			asio::use_awaitable);
+	}
+
+	asio::awaitable<std::pair<std::string, std::string>> async_read_body(std::shared_ptr<request> req)
+	{
+		if (!req->body_stream)
+		{
+			co_return std::make_pair(std::string(), std::move(req->body));
+		}
+		std::string body;
+		while (true)
+		{
+			auto [err, data, finished] = co_await async_read_some(*req->body_stream);
+			if (!err.empty())
+			{
+				co_return std::make_pair(err, std::string());
+			}
+			body += data;
+			if (finished)
+			{
+				co_return std::make_pair(std::string(), std::move(body));
+			}
+		}
+	}
+
+	asio::awaitable<std::pair<std::string, reply>> async_http_request(asio::io_context &io_context, const std::string &server_url, const std::string &server_port, const request &req, std::uint32_t timeout_seconds, std::shared_ptr<http_client_pool> pool)
+	{
+		auto [err, rep] = co_await asio::async_initiate<decltype(asio::use_awaitable), void(std::string, reply)>(
+			[&](auto handler)
+			{
+				auto shared_handler = std::make_shared<decltype(handler)>(std::move(handler));
+				auto callback = [shared_handler](const std::string &err, const reply &rep)
+				{
+					complete_on_executor(shared_handler, err, rep);
+				};
+				auto client = pool ? std::make_shared<http_client>(io_context, server_url, server_port, req, callback, timeout_seconds, pool)
+								   : std::make_shared<http_client>(io_context, server_url, server_port, req, callback, timeout_seconds);
+				client->run();
+			},
+			asio::use_awaitable);
+		co_return std::make_pair(std::move(err), std::move(rep));
+	}
+
+} // namespace spiritsaway::http_server
+
+#endif
@@ -0,0 +1,129 @@
+#include "date_cache.hpp"
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		const char *const day_names[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+		const char *const month_names[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+										   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+		std::atomic<bool> date_enabled{true};
+
+		/// Bumped on every set_server_name so that threads rebuild their buffer.
+		std::atomic<std::uint32_t> server_name_generation{1};
+		std::mutex server_name_mutex;
+		std::string server_name;
+
+		struct thread_header_buffer
+		{
+			std::time_t formatted_second = 0;
+			std::uint32_t generation = 0;
+			std::size_t date_size = 0;
+			std::size_t total_size = 0;
+			std::array<char, 64 + date_cache::max_server_name_size> data;
+		};
+		thread_local thread_header_buffer cur_thread_buffer;
+
+		char *append(char *dest, const char *src, std::size_t len)
+		{
+			std::memcpy(dest, src, len);
+			return dest + len;
+		}
+		char *append_two_digits(char *dest, int value)
+		{
+			*dest++ = char('0' + value / 10);
+			*dest++ = char('0' + value % 10);
+			return dest;
+		}
+
+		/// Format "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n", returns the size written.
+		std::size_t format_date_line(char *dest, std::time_t now)
+		{
+			std::tm tm_now;
+#ifdef _WIN32
+			gmtime_s(&tm_now, &now);
+#else
+			gmtime_r(&now, &tm_now);
+#endif
+			char *p = dest;
+			p = append(p, "Date: ", 6);
+			p = append(p, day_names[tm_now.tm_wday], 3);
+			p = append(p, ", ", 2);
+			p = append_two_digits(p, tm_now.tm_mday);
+			*p++ = ' ';
+			p = append(p, month_names[tm_now.tm_mon], 3);
+			*p++ = ' ';
+			int year = tm_now.tm_year + 1900;
+			p = append_two_digits(p, year / 100);
+			p = append_two_digits(p, year % 100);
+			*p++ = ' ';
+			p = append_two_digits(p, tm_now.tm_hour);
+			*p++ = ':';
+			p = append_two_digits(p, tm_now.tm_min);
+			*p++ = ':';
+			p = append_two_digits(p, tm_now.tm_sec);
+			p = append(p, " GMT\r\n", 6);
+			return std::size_t(p - dest);
+		}
+
+		void refresh_server_line(thread_header_buffer &buffer)
+		{
+			char *p = buffer.data.data() + buffer.date_size;
+			std::lock_guard<std::mutex> guard(server_name_mutex);
+			buffer.generation = server_name_generation.load(std::memory_order_relaxed);
+			if (!server_name.empty())
+			{
+				p = append(p, "Server: ", 8);
+				p = append(p, server_name.data(), server_name.size());
+				p = append(p, "\r\n", 2);
+			}
+			buffer.total_size = std::size_t(p - buffer.data.data());
+		}
+	} // namespace
+
+	void date_cache::set_date_enabled(bool enabled)
+	{
+		date_enabled.store(enabled, std::memory_order_relaxed);
+	}
+
+	void date_cache::set_server_name(const std::string &name)
+	{
+		std::lock_guard<std::mutex> guard(server_name_mutex);
+		server_name = name.substr(0, max_server_name_size);
+		server_name_generation.fetch_add(1, std::memory_order_release);
+	}
+
+	std::string_view date_cache::header_lines(bool with_date, bool with_server)
+	{
+		auto &buffer = cur_thread_buffer;
+		auto now = std::time(nullptr);
+		if (now != buffer.formatted_second)
+		{
+			// the server line is moved behind the freshly formatted date line
+			buffer.formatted_second = now;
+			buffer.date_size = format_date_line(buffer.data.data(), now);
+			buffer.generation = 0;
+		}
+		if (buffer.generation != server_name_generation.load(std::memory_order_acquire))
+		{
+			refresh_server_line(buffer);
+		}
+		with_date = with_date && date_enabled.load(std::memory_order_relaxed);
+		std::string_view result(buffer.data.data(), buffer.total_size);
+		if (!with_date)
+		{
+			result.remove_prefix(buffer.date_size);
+		}
+		if (!with_server)
+		{
+			result.remove_suffix(buffer.total_size - buffer.date_size);
+		}
+		return result;
+	}
+} // namespace spiritsaway::http_server
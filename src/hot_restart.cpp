@@ -0,0 +1,213 @@
+#include "hot_restart.hpp"
+
+#if !defined(_WIN32)
+
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "http_server.hpp"
+
+#if !defined(MSG_CMSG_CLOEXEC)
+#define MSG_CMSG_CLOEXEC 0
+#endif
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		/// Listeners are matched by the address and port the servers were created with.
+		std::string listener_name(const server_core &server)
+		{
+			return server.get_address() + ":" + server.get_port();
+		}
+	}
+
+	hot_restart::hot_restart(asio::io_context &io_context, const std::string &control_path)
+		: io_context_(io_context),
+		  control_path_(control_path),
+		  control_acceptor_(io_context)
+	{
+	}
+
+	hot_restart::~hot_restart()
+	{
+		for (const auto &one_listener : inherited_)
+		{
+			::close(one_listener.fd);
+		}
+	}
+
+	bool hot_restart::take_listeners(std::string &err)
+	{
+		asio::local::stream_protocol::socket control(io_context_);
+		asio::error_code ec;
+		control.connect(asio::local::stream_protocol::endpoint(control_path_), ec);
+		if (ec)
+		{
+			// no old process, the first start
+			return false;
+		}
+
+		std::string names(4096, '\0');
+		iovec data_vec;
+		data_vec.iov_base = &names[0];
+		data_vec.iov_len = names.size();
+		alignas(cmsghdr) char control_buffer[CMSG_SPACE(sizeof(int) * max_listeners)];
+		msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &data_vec;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control_buffer;
+		msg.msg_controllen = sizeof(control_buffer);
+		auto received = ::recvmsg(control.native_handle(), &msg, MSG_CMSG_CLOEXEC);
+		if (received <= 0)
+		{
+			err = received < 0 ? std::strerror(errno) : "control connection closed";
+			return false;
+		}
+		names.resize(received);
+
+		std::vector<int> fds;
+		for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			{
+				continue;
+			}
+			auto fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			auto fd_begin = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+			fds.insert(fds.end(), fd_begin, fd_begin + fd_count);
+		}
+		// one name per line, in the order of the descriptors
+		std::size_t name_begin = 0;
+		for (auto one_fd : fds)
+		{
+			auto name_end = names.find('\n', name_begin);
+			if (name_end == std::string::npos)
+			{
+				::close(one_fd);
+				continue;
+			}
+			inherited_.push_back(inherited_listener{names.substr(name_begin, name_end - name_begin), one_fd});
+			name_begin = name_end + 1;
+		}
+		if (msg.msg_flags & MSG_CTRUNC)
+		{
+			err = "more listeners than " + std::to_string(max_listeners);
+		}
+		return true;
+	}
+
+	void hot_restart::run(server_core &server)
+	{
+		auto name = listener_name(server);
+		for (auto iter = inherited_.begin(); iter != inherited_.end(); ++iter)
+		{
+			if (iter->name != name)
+			{
+				continue;
+			}
+			sockaddr_storage local_address;
+			socklen_t address_len = sizeof(local_address);
+			std::memset(&local_address, 0, sizeof(local_address));
+			::getsockname(iter->fd, reinterpret_cast<sockaddr *>(&local_address), &address_len);
+			auto protocol = local_address.ss_family == AF_INET6 ? asio::ip::tcp::v6() : asio::ip::tcp::v4();
+			auto fd = iter->fd;
+			inherited_.erase(iter);
+			server.run(protocol, fd);
+			return;
+		}
+		server.run();
+	}
+
+	void hot_restart::serve(std::vector<server_core *> servers, std::function<void()> on_handoff)
+	{
+		servers_ = std::move(servers);
+		on_handoff_ = std::move(on_handoff);
+		// the path of the previous process, it has already handed over or is gone
+		::unlink(control_path_.c_str());
+		asio::local::stream_protocol::endpoint endpoint(control_path_);
+		control_acceptor_.open(endpoint.protocol());
+		control_acceptor_.bind(endpoint);
+		control_acceptor_.listen();
+		do_accept();
+	}
+
+	void hot_restart::close()
+	{
+		asio::error_code ignored_ec;
+		control_acceptor_.close(ignored_ec);
+	}
+
+	void hot_restart::do_accept()
+	{
+		control_acceptor_.async_accept([this](std::error_code ec, asio::local::stream_protocol::socket control)
+			{
+				if (ec)
+				{
+					return;
+				}
+				if (!send_listeners(control))
+				{
+					// the new process can try again
+					do_accept();
+					return;
+				}
+				// the path now belongs to the new process, it unlinks and binds it again
+				close();
+				if (on_handoff_)
+				{
+					on_handoff_();
+				}
+			});
+	}
+
+	bool hot_restart::send_listeners(asio::local::stream_protocol::socket &control)
+	{
+		std::string names;
+		std::vector<int> fds;
+		for (auto one_server : servers_)
+		{
+			if (fds.size() == max_listeners)
+			{
+				break;
+			}
+			names += listener_name(*one_server);
+			names += '\n';
+			fds.push_back(one_server->native_listener());
+		}
+		if (fds.empty())
+		{
+			names = "\n";
+		}
+
+		iovec data_vec;
+		data_vec.iov_base = &names[0];
+		data_vec.iov_len = names.size();
+		alignas(cmsghdr) char control_buffer[CMSG_SPACE(sizeof(int) * max_listeners)];
+		std::memset(control_buffer, 0, sizeof(control_buffer));
+		msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &data_vec;
+		msg.msg_iovlen = 1;
+		if (!fds.empty())
+		{
+			msg.msg_control = control_buffer;
+			msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+			auto cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+			std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+		}
+		// a single short message, the control socket is still blocking
+		return ::sendmsg(control.native_handle(), &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(names.size());
+	}
+
+} // namespace spiritsaway::http_server
+
+#endif
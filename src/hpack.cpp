@@ -0,0 +1,628 @@
+#include "hpack.hpp"
+#include <algorithm>
+#include <array>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		const header static_table[hpack_table::static_size] = {
+			{":authority", ""},
+			{":method", "GET"},
+			{":method", "POST"},
+			{":path", "/"},
+			{":path", "/index.html"},
+			{":scheme", "http"},
+			{":scheme", "https"},
+			{":status", "200"},
+			{":status", "204"},
+			{":status", "206"},
+			{":status", "304"},
+			{":status", "400"},
+			{":status", "404"},
+			{":status", "500"},
+			{"accept-charset", ""},
+			{"accept-encoding", "gzip, deflate"},
+			{"accept-language", ""},
+			{"accept-ranges", ""},
+			{"accept", ""},
+			{"access-control-allow-origin", ""},
+			{"age", ""},
+			{"allow", ""},
+			{"authorization", ""},
+			{"cache-control", ""},
+			{"content-disposition", ""},
+			{"content-encoding", ""},
+			{"content-language", ""},
+			{"content-length", ""},
+			{"content-location", ""},
+			{"content-range", ""},
+			{"content-type", ""},
+			{"cookie", ""},
+			{"date", ""},
+			{"etag", ""},
+			{"expect", ""},
+			{"expires", ""},
+			{"from", ""},
+			{"host", ""},
+			{"if-match", ""},
+			{"if-modified-since", ""},
+			{"if-none-match", ""},
+			{"if-range", ""},
+			{"if-unmodified-since", ""},
+			{"last-modified", ""},
+			{"link", ""},
+			{"location", ""},
+			{"max-forwards", ""},
+			{"proxy-authenticate", ""},
+			{"proxy-authorization", ""},
+			{"range", ""},
+			{"referer", ""},
+			{"refresh", ""},
+			{"retry-after", ""},
+			{"server", ""},
+			{"set-cookie", ""},
+			{"strict-transport-security", ""},
+			{"transfer-encoding", ""},
+			{"user-agent", ""},
+			{"vary", ""},
+			{"via", ""},
+			{"www-authenticate", ""},
+		};
+
+		/// Per entry overhead of the dynamic table size.
+		constexpr std::size_t entry_overhead = 32;
+
+		struct huffman_code
+		{
+			std::uint32_t code;
+			int bits;
+		};
+
+		/// The code of every byte and of EOS, RFC 7541 appendix B.
+		const huffman_code huffman_codes[257] = {
+			{0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+			{0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+			{0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+			{0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+			{0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+			{0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+			{0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+			{0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+			{0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+			{0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+			{0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+			{0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+			{0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+			{0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+			{0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+			{0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+			{0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+			{0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+			{0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+			{0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+			{0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+			{0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+			{0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+			{0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+			{0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+			{0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+			{0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+			{0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+			{0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+			{0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+			{0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+			{0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+			{0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+			{0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+			{0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+			{0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+			{0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+			{0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+			{0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+			{0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+			{0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+			{0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+			{0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+			{0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+			{0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+			{0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+			{0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+			{0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+			{0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+			{0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+			{0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+			{0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+			{0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+			{0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+			{0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+			{0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+			{0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+			{0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+			{0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+			{0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+			{0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+			{0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+			{0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+			{0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+			{0x3fffffff, 30},
+		};
+
+		constexpr int max_code_bits = 30;
+
+		/// The code is canonical, so the codes of one length are consecutive numbers and a
+		/// code left aligned to 30 bits is smaller than every longer one. Decoding compares
+		/// the next 30 bits with the end of each length instead of walking a tree bit by bit.
+		struct huffman_decode_table
+		{
+			/// One past the last code of each length, left aligned to 30 bits.
+			std::array<std::uint32_t, max_code_bits + 1> limit{};
+			std::array<std::uint32_t, max_code_bits + 1> first_code{};
+			/// Position of the first symbol of each length in symbols.
+			std::array<std::uint32_t, max_code_bits + 1> offset{};
+			/// Symbols ordered by code.
+			std::array<std::uint16_t, 257> symbols{};
+			/// Lengths that have codes, shortest first.
+			std::vector<int> lengths;
+
+			huffman_decode_table()
+			{
+				std::array<std::uint32_t, max_code_bits + 1> count{};
+				for (const auto &one_code : huffman_codes)
+				{
+					count[one_code.bits]++;
+				}
+				std::uint32_t next_offset = 0;
+				for (int bits = 1; bits <= max_code_bits; bits++)
+				{
+					offset[bits] = next_offset;
+					next_offset += count[bits];
+				}
+				std::array<std::uint32_t, max_code_bits + 1> filled{};
+				for (std::uint16_t symbol = 0; symbol < 257; symbol++)
+				{
+					auto bits = huffman_codes[symbol].bits;
+					if (!filled[bits])
+					{
+						first_code[bits] = huffman_codes[symbol].code;
+					}
+					symbols[offset[bits] + filled[bits]++] = symbol;
+				}
+				for (int bits = 1; bits <= max_code_bits; bits++)
+				{
+					if (count[bits])
+					{
+						lengths.push_back(bits);
+						limit[bits] = (first_code[bits] + count[bits]) << (max_code_bits - bits);
+					}
+				}
+			}
+		};
+
+		const huffman_decode_table &decode_table()
+		{
+			static const huffman_decode_table table;
+			return table;
+		}
+
+		bool decode_integer(const unsigned char *&p, const unsigned char *end, int prefix_bits, std::uint64_t &value)
+		{
+			std::uint64_t prefix_max = (1u << prefix_bits) - 1;
+			value = *p++ & prefix_max;
+			if (value < prefix_max)
+			{
+				return true;
+			}
+			// no field needs more than 28 bits, refuse longer encodings before they overflow
+			for (int shift = 0; shift <= 28; shift += 7)
+			{
+				if (p == end)
+				{
+					return false;
+				}
+				auto cur_byte = *p++;
+				value += std::uint64_t(cur_byte & 0x7f) << shift;
+				if (!(cur_byte & 0x80))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		bool decode_string(const unsigned char *&p, const unsigned char *end, std::string &out)
+		{
+			if (p == end)
+			{
+				return false;
+			}
+			bool huffman = (*p & 0x80) != 0;
+			std::uint64_t length = 0;
+			if (!decode_integer(p, end, 7, length) || length > std::uint64_t(end - p))
+			{
+				return false;
+			}
+			auto data = reinterpret_cast<const char *>(p);
+			p += length;
+			out.clear();
+			if (huffman)
+			{
+				return huffman_decode(data, std::size_t(length), out);
+			}
+			out.assign(data, std::size_t(length));
+			return true;
+		}
+
+		void encode_string(std::string_view data, std::string &out)
+		{
+			auto huffman_size = huffman_encoded_size(data);
+			if (huffman_size < data.size())
+			{
+				hpack_encode_integer(huffman_size, 7, 0x80, out);
+				huffman_encode(data, out);
+				return;
+			}
+			hpack_encode_integer(data.size(), 7, 0, out);
+			out.append(data.data(), data.size());
+		}
+
+		enum class field_indexing
+		{
+			incremental,
+			/// The value changes with every reply, it would only evict useful entries.
+			without,
+			/// Secrets, intermediaries must not index them either.
+			never
+		};
+
+		field_indexing indexing_of(std::string_view name)
+		{
+			if (name == "set-cookie" || name == "authorization" || name == "proxy-authorization")
+			{
+				return field_indexing::never;
+			}
+			if (name == "content-length" || name == "date" || name == "etag" || name == "last-modified" || name == "expires" || name == "age" || name == "content-range" || name == ":path")
+			{
+				return field_indexing::without;
+			}
+			return field_indexing::incremental;
+		}
+	}
+
+	hpack_table::hpack_table(std::size_t max_size)
+		: max_size_(max_size)
+	{
+	}
+
+	const header *hpack_table::get(std::size_t index) const
+	{
+		if (!index)
+		{
+			return nullptr;
+		}
+		if (index <= static_size)
+		{
+			return &static_table[index - 1];
+		}
+		index -= static_size + 1;
+		if (index >= entries_.size())
+		{
+			return nullptr;
+		}
+		return &entries_[index];
+	}
+
+	void hpack_table::add(std::string name, std::string value)
+	{
+		auto entry_size = name.size() + value.size() + entry_overhead;
+		if (entry_size > max_size_)
+		{
+			// an entry larger than the table empties it and is not added
+			entries_.clear();
+			size_ = 0;
+			return;
+		}
+		evict(entry_size);
+		entries_.push_front(header{std::move(name), std::move(value)});
+		size_ += entry_size;
+	}
+
+	void hpack_table::set_max_size(std::size_t max_size)
+	{
+		max_size_ = max_size;
+		evict(0);
+	}
+
+	void hpack_table::evict(std::size_t needed)
+	{
+		while (!entries_.empty() && size_ + needed > max_size_)
+		{
+			size_ -= entries_.back().name.size() + entries_.back().value.size() + entry_overhead;
+			entries_.pop_back();
+		}
+	}
+
+	std::size_t hpack_table::find(std::string_view name, std::string_view value, bool &value_matched) const
+	{
+		std::size_t name_index = 0;
+		value_matched = false;
+		for (std::size_t i = 0; i < static_size; i++)
+		{
+			if (static_table[i].name != name)
+			{
+				continue;
+			}
+			if (static_table[i].value == value)
+			{
+				value_matched = true;
+				return i + 1;
+			}
+			if (!name_index)
+			{
+				name_index = i + 1;
+			}
+		}
+		for (std::size_t i = 0; i < entries_.size(); i++)
+		{
+			if (entries_[i].name != name)
+			{
+				continue;
+			}
+			if (entries_[i].value == value)
+			{
+				value_matched = true;
+				return static_size + 1 + i;
+			}
+			if (!name_index)
+			{
+				name_index = static_size + 1 + i;
+			}
+		}
+		return name_index;
+	}
+
+	hpack_decoder::hpack_decoder(std::size_t max_table_size)
+		: table_(max_table_size),
+		max_table_size_(max_table_size)
+	{
+	}
+
+	bool hpack_decoder::decode(const char *data, std::size_t size, std::vector<header> &headers, std::size_t max_list_size)
+	{
+		auto p = reinterpret_cast<const unsigned char *>(data);
+		auto end = p + size;
+		std::size_t list_size = 0;
+		bool field_seen = false;
+		std::string name;
+		std::string value;
+		while (p != end)
+		{
+			auto first_byte = *p;
+			std::uint64_t index = 0;
+			if (first_byte & 0x80)
+			{
+				if (!decode_integer(p, end, 7, index))
+				{
+					return false;
+				}
+				auto entry = table_.get(std::size_t(index));
+				if (!entry)
+				{
+					return false;
+				}
+				name = entry->name;
+				value = entry->value;
+			}
+			else if ((first_byte & 0xe0) == 0x20)
+			{
+				// a table size update is only allowed before the first field
+				std::uint64_t new_size = 0;
+				if (field_seen || !decode_integer(p, end, 5, new_size) || new_size > max_table_size_)
+				{
+					return false;
+				}
+				table_.set_max_size(std::size_t(new_size));
+				continue;
+			}
+			else
+			{
+				bool incremental = (first_byte & 0x40) != 0;
+				if (!decode_integer(p, end, incremental ? 6 : 4, index))
+				{
+					return false;
+				}
+				if (index)
+				{
+					auto entry = table_.get(std::size_t(index));
+					if (!entry)
+					{
+						return false;
+					}
+					name = entry->name;
+				}
+				else if (!decode_string(p, end, name))
+				{
+					return false;
+				}
+				if (!decode_string(p, end, value))
+				{
+					return false;
+				}
+				if (incremental)
+				{
+					table_.add(name, value);
+				}
+			}
+			field_seen = true;
+			list_size += name.size() + value.size() + entry_overhead;
+			if (list_size > max_list_size)
+			{
+				return false;
+			}
+			headers.push_back(header{std::move(name), std::move(value)});
+		}
+		return true;
+	}
+
+	hpack_encoder::hpack_encoder()
+	{
+	}
+
+	void hpack_encoder::set_peer_max_table_size(std::size_t size)
+	{
+		// a larger table than the default would only cost memory
+		auto new_size = std::min(size, hpack_default_table_size);
+		if (new_size == table_.max_size())
+		{
+			return;
+		}
+		table_.set_max_size(new_size);
+		size_update_pending_ = true;
+	}
+
+	void hpack_encoder::encode(std::string_view name, std::string_view value, std::string &out)
+	{
+		if (size_update_pending_)
+		{
+			size_update_pending_ = false;
+			hpack_encode_integer(table_.max_size(), 5, 0x20, out);
+		}
+		bool value_matched = false;
+		auto index = table_.find(name, value, value_matched);
+		if (value_matched)
+		{
+			hpack_encode_integer(index, 7, 0x80, out);
+			return;
+		}
+		auto indexing = indexing_of(name);
+		switch (indexing)
+		{
+		case field_indexing::incremental:
+			hpack_encode_integer(index, 6, 0x40, out);
+			break;
+		case field_indexing::without:
+			hpack_encode_integer(index, 4, 0, out);
+			break;
+		case field_indexing::never:
+			hpack_encode_integer(index, 4, 0x10, out);
+			break;
+		}
+		if (!index)
+		{
+			encode_string(name, out);
+		}
+		encode_string(value, out);
+		if (indexing == field_indexing::incremental)
+		{
+			table_.add(std::string(name), std::string(value));
+		}
+	}
+
+	void hpack_encode_integer(std::uint64_t value, int prefix_bits, unsigned char first_byte, std::string &out)
+	{
+		std::uint64_t prefix_max = (1u << prefix_bits) - 1;
+		if (value < prefix_max)
+		{
+			out += char(first_byte | value);
+			return;
+		}
+		out += char(first_byte | prefix_max);
+		value -= prefix_max;
+		while (value >= 0x80)
+		{
+			out += char((value & 0x7f) | 0x80);
+			value >>= 7;
+		}
+		out += char(value);
+	}
+
+	std::size_t huffman_encoded_size(std::string_view data)
+	{
+		std::size_t bits = 0;
+		for (auto c : data)
+		{
+			bits += huffman_codes[static_cast<unsigned char>(c)].bits;
+		}
+		return (bits + 7) / 8;
+	}
+
+	void huffman_encode(std::string_view data, std::string &out)
+	{
+		// only the low pending_bits bits of pending are still to be written
+		std::uint64_t pending = 0;
+		int pending_bits = 0;
+		for (auto c : data)
+		{
+			const auto &cur_code = huffman_codes[static_cast<unsigned char>(c)];
+			pending = (pending << cur_code.bits) | cur_code.code;
+			pending_bits += cur_code.bits;
+			while (pending_bits >= 8)
+			{
+				pending_bits -= 8;
+				out += char(pending >> pending_bits);
+			}
+		}
+		if (pending_bits)
+		{
+			// the padding is the start of EOS, all ones
+			out += char((pending << (8 - pending_bits)) | (0xff >> pending_bits));
+		}
+	}
+
+	bool huffman_decode(const char *data, std::size_t size, std::string &out)
+	{
+		const auto &table = decode_table();
+		auto bytes = reinterpret_cast<const unsigned char *>(data);
+		constexpr std::uint32_t code_mask = (1u << max_code_bits) - 1;
+		std::uint64_t pending = 0;
+		int pending_bits = 0;
+		std::size_t pos = 0;
+		out.reserve(out.size() + size * 8 / 5);
+		for (;;)
+		{
+			while (pending_bits <= 56 && pos < size)
+			{
+				pending = (pending << 8) | bytes[pos++];
+				pending_bits += 8;
+			}
+			if (!pending_bits)
+			{
+				return true;
+			}
+			std::uint32_t next_bits;
+			if (pending_bits >= max_code_bits)
+			{
+				next_bits = std::uint32_t(pending >> (pending_bits - max_code_bits)) & code_mask;
+			}
+			else
+			{
+				// fill with ones, so that valid padding reads as the start of EOS
+				auto missing = max_code_bits - pending_bits;
+				next_bits = std::uint32_t((pending << missing) | ((1u << missing) - 1)) & code_mask;
+			}
+			int bits = 0;
+			for (auto cur_bits : table.lengths)
+			{
+				if (next_bits < table.limit[cur_bits])
+				{
+					bits = cur_bits;
+					break;
+				}
+			}
+			if (bits > pending_bits)
+			{
+				// the rest is padding, which must be shorter than a byte and all ones
+				std::uint64_t padding_mask = (std::uint64_t(1) << pending_bits) - 1;
+				return pending_bits < 8 && (pending & padding_mask) == padding_mask;
+			}
+			auto symbol = table.symbols[table.offset[bits] + (next_bits >> (max_code_bits - bits)) - table.first_code[bits]];
+			if (symbol == 256)
+			{
+				return false;
+			}
+			out += char(symbol);
+			pending_bits -= bits;
+		}
+	}
+
+} // namespace spiritsaway::http_server
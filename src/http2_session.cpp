@@ -0,0 +1,1157 @@
+#include "http2_session.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "admission_control.hpp"
+#include "date_cache.hpp"
+#include "metrics.hpp"
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		namespace frame_type
+		{
+			constexpr std::uint8_t data = 0x0;
+			constexpr std::uint8_t headers = 0x1;
+			constexpr std::uint8_t priority = 0x2;
+			constexpr std::uint8_t rst_stream = 0x3;
+			constexpr std::uint8_t settings = 0x4;
+			constexpr std::uint8_t push_promise = 0x5;
+			constexpr std::uint8_t ping = 0x6;
+			constexpr std::uint8_t goaway = 0x7;
+			constexpr std::uint8_t window_update = 0x8;
+			constexpr std::uint8_t continuation = 0x9;
+		}
+
+		namespace frame_flag
+		{
+			constexpr std::uint8_t end_stream = 0x1;
+			constexpr std::uint8_t ack = 0x1;
+			constexpr std::uint8_t end_headers = 0x4;
+			constexpr std::uint8_t padded = 0x8;
+			constexpr std::uint8_t priority = 0x20;
+		}
+
+		namespace setting_id
+		{
+			constexpr std::uint16_t header_table_size = 0x1;
+			constexpr std::uint16_t enable_push = 0x2;
+			constexpr std::uint16_t max_concurrent_streams = 0x3;
+			constexpr std::uint16_t initial_window_size = 0x4;
+			constexpr std::uint16_t max_frame_size = 0x5;
+			constexpr std::uint16_t max_header_list_size = 0x6;
+		}
+
+		constexpr std::size_t frame_header_size = 9;
+
+		/// Frames the server accepts, the default SETTINGS_MAX_FRAME_SIZE which it never raises.
+		constexpr std::size_t max_frame_size = 16384;
+
+		constexpr std::int64_t max_window = 0x7fffffff;
+
+		/// Bytes of decoded header fields per request, announced as SETTINGS_MAX_HEADER_LIST_SIZE.
+		constexpr std::size_t max_header_list_size = 64 * 1024;
+
+		/// DATA payloads up to this size are copied next to their frame header instead of
+		/// taking a buffer of their own in the output.
+		constexpr std::size_t max_copied_data = 1024;
+
+		/// A streamed body is read ahead while less than this is waiting for the windows.
+		constexpr std::size_t body_read_ahead = 64 * 1024;
+
+		std::uint32_t read_uint32(const char *data)
+		{
+			auto bytes = reinterpret_cast<const unsigned char *>(data);
+			return (std::uint32_t(bytes[0]) << 24) | (std::uint32_t(bytes[1]) << 16) | (std::uint32_t(bytes[2]) << 8) | bytes[3];
+		}
+
+		void append_uint32(std::string &out, std::uint32_t value)
+		{
+			out += char(value >> 24);
+			out += char((value >> 16) & 0xff);
+			out += char((value >> 8) & 0xff);
+			out += char(value & 0xff);
+		}
+
+		void append_setting(std::string &out, std::uint16_t id, std::uint32_t value)
+		{
+			out += char(id >> 8);
+			out += char(id & 0xff);
+			append_uint32(out, value);
+		}
+
+		/// Strip the Pad Length byte and the padding of a PADDED frame, false if they do not fit.
+		bool remove_padding(std::uint8_t flags, std::string_view &payload)
+		{
+			if (!(flags & frame_flag::padded))
+			{
+				return true;
+			}
+			if (payload.empty())
+			{
+				return false;
+			}
+			auto pad_length = static_cast<unsigned char>(payload[0]);
+			payload.remove_prefix(1);
+			if (pad_length > payload.size())
+			{
+				return false;
+			}
+			payload.remove_suffix(pad_length);
+			return true;
+		}
+
+		/// Decode the base64url of HTTP2-Settings, padding is optional.
+		bool decode_base64url(std::string_view input, std::string &out)
+		{
+			std::uint32_t bits = 0;
+			int bit_count = 0;
+			for (auto c : input)
+			{
+				int value;
+				if (c >= 'A' && c <= 'Z')
+				{
+					value = c - 'A';
+				}
+				else if (c >= 'a' && c <= 'z')
+				{
+					value = c - 'a' + 26;
+				}
+				else if (c >= '0' && c <= '9')
+				{
+					value = c - '0' + 52;
+				}
+				else if (c == '-' || c == '+')
+				{
+					value = 62;
+				}
+				else if (c == '_' || c == '/')
+				{
+					value = 63;
+				}
+				else if (c == '=')
+				{
+					break;
+				}
+				else
+				{
+					return false;
+				}
+				bits = (bits << 6) | std::uint32_t(value);
+				bit_count += 6;
+				if (bit_count >= 8)
+				{
+					bit_count -= 8;
+					out += char((bits >> bit_count) & 0xff);
+				}
+			}
+			return true;
+		}
+
+		/// Header fields that only mean something to an HTTP/1.x connection.
+		bool is_connection_specific(std::string_view name)
+		{
+			return name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding" || name == "upgrade";
+		}
+
+		void to_lower(std::string_view name, std::string &out)
+		{
+			out.resize(name.size());
+			for (std::size_t i = 0; i < name.size(); i++)
+			{
+				auto c = name[i];
+				out[i] = c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c;
+			}
+		}
+
+		/// Call fn with the name and value of every "Name: value\r\n" line at the start of lines,
+		/// returns the size of the lines up to and including the empty one.
+		template <typename Fn>
+		std::size_t for_each_header_line(std::string_view lines, Fn &&fn)
+		{
+			std::size_t pos = 0;
+			while (pos < lines.size())
+			{
+				auto line_end = lines.find("\r\n", pos);
+				if (line_end == std::string_view::npos)
+				{
+					return lines.size();
+				}
+				if (line_end == pos)
+				{
+					return pos + 2;
+				}
+				auto line = lines.substr(pos, line_end - pos);
+				auto colon = line.find(':');
+				if (colon != std::string_view::npos)
+				{
+					fn(line.substr(0, colon), trim_spaces(line.substr(colon + 1)));
+				}
+				pos = line_end + 2;
+			}
+			return pos;
+		}
+	}
+
+	bool is_http2_preface_start(const char *data, std::size_t size)
+	{
+		auto compared = std::min(size, http2_client_preface.size());
+		return compared && std::memcmp(data, http2_client_preface.data(), compared) == 0;
+	}
+
+	bool is_http2_upgrade(const request &req)
+	{
+		return has_token(find_header(req.headers, "Upgrade"), "h2c") && has_token(find_header(req.headers, "Connection"), "HTTP2-Settings") && find_header(req.headers, "HTTP2-Settings");
+	}
+
+	http2_session::http2_session(std::weak_ptr<http2_transport> transport, output_queue &output, const server_options &options, admission_controller &admission, const std::string &remote_address, std::weak_ptr<output_control> output_control)
+		: transport_(std::move(transport)),
+		output_(output),
+		options_(options),
+		admission_(admission),
+		metrics_(options.metrics.get()),
+		remote_address_(remote_address),
+		output_control_(std::move(output_control))
+	{
+	}
+
+	http2_session::~http2_session()
+	{
+		for (auto &one_stream : streams_)
+		{
+			if (one_stream.second.admitted)
+			{
+				admission_.release(std::chrono::steady_clock::duration::zero());
+			}
+		}
+	}
+
+	void http2_session::start()
+	{
+		std::string payload;
+		append_setting(payload, setting_id::max_concurrent_streams, options_.http2_max_concurrent_streams);
+		append_setting(payload, setting_id::initial_window_size, options_.http2_window_size);
+		append_setting(payload, setting_id::max_header_list_size, std::uint32_t(max_header_list_size));
+		queue_frame_header(payload.size(), frame_type::settings, 0, 0);
+		frames_ += payload;
+		// the connection window starts at 64k whatever the settings say
+		if (options_.http2_window_size > recv_window_)
+		{
+			queue_window_update(0, std::uint32_t(options_.http2_window_size - recv_window_));
+			recv_window_ = options_.http2_window_size;
+		}
+		commit_frames();
+	}
+
+	bool http2_session::start_upgraded(std::string_view settings, std::shared_ptr<request> req)
+	{
+		start();
+		std::string payload;
+		// the 101 reply acknowledges these settings, they get no SETTINGS ack
+		if (!decode_base64url(trim_spaces(settings), payload) || payload.size() % 6 || !apply_settings(payload))
+		{
+			connection_error(http2_error::protocol_error);
+			commit_frames();
+			return false;
+		}
+		req->remote_address = remote_address_;
+		req->output = output_control_;
+		last_stream_id_ = 1;
+		auto &cur_stream = streams_[1];
+		cur_stream.req = std::move(req);
+		cur_stream.send_window = peer_initial_window_;
+		cur_stream.head_request = cur_stream.req->method == "HEAD";
+		end_of_request(1, cur_stream);
+		commit_frames();
+		return true;
+	}
+
+	bool http2_session::on_input(const char *data, std::size_t size)
+	{
+		if (failed_)
+		{
+			return false;
+		}
+		if (input_.empty())
+		{
+			auto consumed = handle_frames(data, size);
+			input_.assign(data + consumed, size - consumed);
+		}
+		else
+		{
+			input_.append(data, size);
+			auto consumed = handle_frames(input_.data(), input_.size());
+			input_.erase(0, consumed);
+		}
+		commit_frames();
+		return !failed_;
+	}
+
+	std::size_t http2_session::handle_frames(const char *data, std::size_t size)
+	{
+		std::size_t offset = 0;
+		if (preface_remaining_)
+		{
+			auto compared = std::min(preface_remaining_, size);
+			auto preface_offset = http2_client_preface.size() - preface_remaining_;
+			if (std::memcmp(data, http2_client_preface.data() + preface_offset, compared) != 0)
+			{
+				connection_error(http2_error::protocol_error);
+				return size;
+			}
+			preface_remaining_ -= compared;
+			offset = compared;
+		}
+		while (!failed_ && size - offset >= frame_header_size)
+		{
+			auto bytes = reinterpret_cast<const unsigned char *>(data + offset);
+			std::size_t length = (std::size_t(bytes[0]) << 16) | (std::size_t(bytes[1]) << 8) | bytes[2];
+			if (length > max_frame_size)
+			{
+				connection_error(http2_error::frame_size_error);
+				break;
+			}
+			if (size - offset < frame_header_size + length)
+			{
+				break;
+			}
+			auto stream_id = read_uint32(data + offset + 5) & 0x7fffffff;
+			handle_frame(bytes[3], bytes[4], stream_id, std::string_view(data + offset + frame_header_size, length));
+			offset += frame_header_size + length;
+		}
+		return failed_ ? size : offset;
+	}
+
+	void http2_session::handle_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id, std::string_view payload)
+	{
+		if (!settings_received_ && type != frame_type::settings)
+		{
+			// the preface ends with a SETTINGS frame
+			connection_error(http2_error::protocol_error);
+			return;
+		}
+		if (continuation_stream_ && type != frame_type::continuation)
+		{
+			connection_error(http2_error::protocol_error);
+			return;
+		}
+		switch (type)
+		{
+		case frame_type::data:
+			handle_data(flags, stream_id, payload);
+			break;
+		case frame_type::headers:
+			handle_headers(flags, stream_id, payload);
+			break;
+		case frame_type::priority:
+			// streams are served in turn, priorities are not followed
+			if (!stream_id)
+			{
+				connection_error(http2_error::protocol_error);
+			}
+			else if (payload.size() != 5)
+			{
+				reset_stream(stream_id, http2_error::frame_size_error);
+			}
+			break;
+		case frame_type::rst_stream:
+			handle_rst_stream(stream_id, payload);
+			break;
+		case frame_type::settings:
+			handle_settings(flags, stream_id, payload);
+			break;
+		case frame_type::push_promise:
+			connection_error(http2_error::protocol_error);
+			break;
+		case frame_type::ping:
+			if (stream_id)
+			{
+				connection_error(http2_error::protocol_error);
+			}
+			else if (payload.size() != 8)
+			{
+				connection_error(http2_error::frame_size_error);
+			}
+			else if (!(flags & frame_flag::ack))
+			{
+				queue_frame_header(8, frame_type::ping, frame_flag::ack, 0);
+				frames_.append(payload.data(), payload.size());
+			}
+			break;
+		case frame_type::goaway:
+			if (stream_id)
+			{
+				connection_error(http2_error::protocol_error);
+			}
+			else
+			{
+				peer_going_away_ = true;
+			}
+			break;
+		case frame_type::window_update:
+			handle_window_update(stream_id, payload);
+			break;
+		case frame_type::continuation:
+			handle_continuation(flags, stream_id, payload);
+			break;
+		default:
+			// unknown frame types are ignored
+			break;
+		}
+	}
+
+	void http2_session::handle_headers(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload)
+	{
+		if (!stream_id || !remove_padding(flags, payload))
+		{
+			connection_error(http2_error::protocol_error);
+			return;
+		}
+		if (flags & frame_flag::priority)
+		{
+			if (payload.size() < 5)
+			{
+				connection_error(http2_error::protocol_error);
+				return;
+			}
+			payload.remove_prefix(5);
+		}
+		bool end_stream = (flags & frame_flag::end_stream) != 0;
+		if (flags & frame_flag::end_headers)
+		{
+			handle_header_block(stream_id, end_stream, payload);
+			return;
+		}
+		continuation_stream_ = stream_id;
+		continuation_end_stream_ = end_stream;
+		header_block_.assign(payload.data(), payload.size());
+	}
+
+	void http2_session::handle_continuation(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload)
+	{
+		if (!continuation_stream_ || stream_id != continuation_stream_ || header_block_.size() + payload.size() > max_header_list_size)
+		{
+			connection_error(http2_error::protocol_error);
+			return;
+		}
+		header_block_.append(payload.data(), payload.size());
+		if (!(flags & frame_flag::end_headers))
+		{
+			return;
+		}
+		continuation_stream_ = 0;
+		handle_header_block(stream_id, continuation_end_stream_, header_block_);
+		header_block_.clear();
+	}
+
+	void http2_session::handle_header_block(std::uint32_t stream_id, bool end_stream, std::string_view block)
+	{
+		// the block is decoded even for a stream that is refused, the table must stay in sync
+		std::vector<header> fields;
+		if (!decoder_.decode(block.data(), block.size(), fields, max_header_list_size))
+		{
+			connection_error(http2_error::compression_error);
+			return;
+		}
+		auto iter = streams_.find(stream_id);
+		if (iter != streams_.end())
+		{
+			// trailers, their fields are dropped
+			if (iter->second.remote_closed)
+			{
+				reset_stream(stream_id, http2_error::stream_closed);
+			}
+			else if (!end_stream)
+			{
+				reset_stream(stream_id, http2_error::protocol_error);
+			}
+			else
+			{
+				end_of_request(stream_id, iter->second);
+			}
+			return;
+		}
+		if (!(stream_id & 1) || stream_id <= last_stream_id_)
+		{
+			connection_error(http2_error::protocol_error);
+			return;
+		}
+		last_stream_id_ = stream_id;
+		if (going_away_ || streams_.size() >= options_.http2_max_concurrent_streams)
+		{
+			queue_rst_stream(stream_id, http2_error::refused_stream);
+			return;
+		}
+		auto req = std::make_shared<request>();
+		if (!build_request(fields, *req))
+		{
+			queue_rst_stream(stream_id, http2_error::protocol_error);
+			return;
+		}
+		auto &cur_stream = streams_[stream_id];
+		cur_stream.req = std::move(req);
+		cur_stream.send_window = peer_initial_window_;
+		cur_stream.recv_window = options_.http2_window_size;
+		cur_stream.head_request = cur_stream.req->method == "HEAD";
+		if (end_stream)
+		{
+			end_of_request(stream_id, cur_stream);
+		}
+	}
+
+	bool http2_session::build_request(std::vector<header> &fields, request &req) const
+	{
+		std::string scheme;
+		std::string authority;
+		bool regular_seen = false;
+		for (auto &field : fields)
+		{
+			if (std::any_of(field.name.begin(), field.name.end(), [](char c)
+					{ return c >= 'A' && c <= 'Z'; }))
+			{
+				return false;
+			}
+			if (!field.name.empty() && field.name[0] == ':')
+			{
+				std::string *target;
+				if (regular_seen)
+				{
+					return false;
+				}
+				if (field.name == ":method")
+				{
+					target = &req.method;
+				}
+				else if (field.name == ":path")
+				{
+					target = &req.uri;
+				}
+				else if (field.name == ":scheme")
+				{
+					target = &scheme;
+				}
+				else if (field.name == ":authority")
+				{
+					target = &authority;
+				}
+				else
+				{
+					return false;
+				}
+				if (!target->empty())
+				{
+					return false;
+				}
+				*target = std::move(field.value);
+				continue;
+			}
+			regular_seen = true;
+			if (is_connection_specific(field.name) || (field.name == "te" && field.value != "trailers"))
+			{
+				return false;
+			}
+			if (field.name == "cookie")
+			{
+				// HTTP/2 may split the cookie into several fields, handlers expect one
+				auto cookie = std::find_if(req.headers.begin(), req.headers.end(), [](const header &h)
+					{ return h.name == "cookie"; });
+				if (cookie != req.headers.end())
+				{
+					cookie->value += "; ";
+					cookie->value += field.value;
+					continue;
+				}
+			}
+			req.headers.push_back(std::move(field));
+		}
+		if (req.method.empty() || (req.method != "CONNECT" && (req.uri.empty() || scheme.empty())))
+		{
+			return false;
+		}
+		if (!authority.empty() && !find_header(req.headers, "host"))
+		{
+			req.headers.push_back(header{"host", std::move(authority)});
+		}
+		req.http_version_major = 2;
+		req.http_version_minor = 0;
+		req.remote_address = remote_address_;
+		req.output = output_control_;
+		return true;
+	}
+
+	void http2_session::end_of_request(std::uint32_t stream_id, stream &cur_stream)
+	{
+		cur_stream.remote_closed = true;
+		auto content_length = find_header(cur_stream.req->headers, "content-length");
+		if (content_length && trim_spaces(*content_length) != std::to_string(cur_stream.req->body.size()))
+		{
+			reset_stream(stream_id, http2_error::protocol_error);
+			return;
+		}
+		if (!admission_.try_admit())
+		{
+			if (metrics_)
+			{
+				metrics_->add(server_metric::shed_requests);
+			}
+			send_reply(stream_id, admission_controller::shed_reply());
+			return;
+		}
+		cur_stream.admitted = true;
+		cur_stream.begin = std::chrono::steady_clock::now();
+		if (metrics_)
+		{
+			metrics_->add(server_metric::requests);
+		}
+		auto transport = transport_.lock();
+		if (transport)
+		{
+			transport->dispatch_stream(stream_id, cur_stream.req);
+		}
+	}
+
+	void http2_session::handle_data(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload)
+	{
+		if (!stream_id)
+		{
+			connection_error(http2_error::protocol_error);
+			return;
+		}
+		// the padding counts against the windows too
+		auto length = std::int64_t(payload.size());
+		if (length > recv_window_)
+		{
+			connection_error(http2_error::flow_control_error);
+			return;
+		}
+		recv_window_ -= length;
+		std::int64_t window_size = options_.http2_window_size;
+		if (recv_window_ < window_size / 2)
+		{
+			queue_window_update(0, std::uint32_t(window_size - recv_window_));
+			recv_window_ = window_size;
+		}
+		if (!remove_padding(flags, payload))
+		{
+			connection_error(http2_error::protocol_error);
+			return;
+		}
+		auto iter = streams_.find(stream_id);
+		if (iter == streams_.end())
+		{
+			if (stream_id > last_stream_id_)
+			{
+				connection_error(http2_error::protocol_error);
+			}
+			else
+			{
+				queue_rst_stream(stream_id, http2_error::stream_closed);
+			}
+			return;
+		}
+		auto &cur_stream = iter->second;
+		if (cur_stream.remote_closed)
+		{
+			reset_stream(stream_id, http2_error::stream_closed);
+			return;
+		}
+		if (length > cur_stream.recv_window)
+		{
+			reset_stream(stream_id, http2_error::flow_control_error);
+			return;
+		}
+		cur_stream.recv_window -= length;
+		cur_stream.req->body.append(payload.data(), payload.size());
+		if (flags & frame_flag::end_stream)
+		{
+			end_of_request(stream_id, cur_stream);
+			return;
+		}
+		if (cur_stream.recv_window < window_size / 2)
+		{
+			queue_window_update(stream_id, std::uint32_t(window_size - cur_stream.recv_window));
+			cur_stream.recv_window = window_size;
+		}
+	}
+
+	void http2_session::handle_settings(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload)
+	{
+		if (stream_id)
+		{
+			connection_error(http2_error::protocol_error);
+			return;
+		}
+		if (flags & frame_flag::ack)
+		{
+			if (!payload.empty())
+			{
+				connection_error(http2_error::frame_size_error);
+			}
+			return;
+		}
+		if (payload.size() % 6)
+		{
+			connection_error(http2_error::frame_size_error);
+			return;
+		}
+		if (!apply_settings(payload))
+		{
+			return;
+		}
+		settings_received_ = true;
+		queue_frame_header(0, frame_type::settings, frame_flag::ack, 0);
+		// a larger initial window may let waiting DATA go
+		send_pending();
+	}
+
+	bool http2_session::apply_settings(std::string_view payload)
+	{
+		for (std::size_t offset = 0; offset + 6 <= payload.size(); offset += 6)
+		{
+			auto bytes = reinterpret_cast<const unsigned char *>(payload.data() + offset);
+			std::uint16_t id = std::uint16_t((bytes[0] << 8) | bytes[1]);
+			auto value = read_uint32(payload.data() + offset + 2);
+			switch (id)
+			{
+			case setting_id::header_table_size:
+				encoder_.set_peer_max_table_size(value);
+				break;
+			case setting_id::enable_push:
+				// the server never pushes, only the value is checked
+				if (value > 1)
+				{
+					connection_error(http2_error::protocol_error);
+					return false;
+				}
+				break;
+			case setting_id::initial_window_size:
+			{
+				if (value > max_window)
+				{
+					connection_error(http2_error::flow_control_error);
+					return false;
+				}
+				auto delta = std::int64_t(value) - peer_initial_window_;
+				for (auto &one_stream : streams_)
+				{
+					one_stream.second.send_window += delta;
+					if (one_stream.second.send_window > max_window)
+					{
+						connection_error(http2_error::flow_control_error);
+						return false;
+					}
+				}
+				peer_initial_window_ = value;
+				break;
+			}
+			case setting_id::max_frame_size:
+				if (value < 16384 || value > 0xffffff)
+				{
+					connection_error(http2_error::protocol_error);
+					return false;
+				}
+				peer_max_frame_size_ = value;
+				break;
+			default:
+				// max_concurrent_streams only limits pushes, unknown settings are ignored
+				break;
+			}
+		}
+		return true;
+	}
+
+	void http2_session::handle_window_update(std::uint32_t stream_id, std::string_view payload)
+	{
+		if (payload.size() != 4)
+		{
+			connection_error(http2_error::frame_size_error);
+			return;
+		}
+		std::int64_t increment = read_uint32(payload.data()) & 0x7fffffff;
+		if (!stream_id)
+		{
+			if (!increment || send_window_ + increment > max_window)
+			{
+				connection_error(increment ? http2_error::flow_control_error : http2_error::protocol_error);
+				return;
+			}
+			send_window_ += increment;
+		}
+		else
+		{
+			auto iter = streams_.find(stream_id);
+			if (iter == streams_.end())
+			{
+				// the stream may have ended while the update was on its way
+				return;
+			}
+			if (!increment || iter->second.send_window + increment > max_window)
+			{
+				reset_stream(stream_id, increment ? http2_error::flow_control_error : http2_error::protocol_error);
+				return;
+			}
+			iter->second.send_window += increment;
+		}
+		send_pending();
+	}
+
+	void http2_session::handle_rst_stream(std::uint32_t stream_id, std::string_view payload)
+	{
+		if (!stream_id || stream_id > last_stream_id_)
+		{
+			connection_error(http2_error::protocol_error);
+			return;
+		}
+		if (payload.size() != 4)
+		{
+			connection_error(http2_error::frame_size_error);
+			return;
+		}
+		// the handler still runs, its reply finds no stream
+		auto iter = streams_.find(stream_id);
+		if (iter != streams_.end())
+		{
+			erase_stream(iter);
+		}
+	}
+
+	void http2_session::send_reply(std::uint32_t stream_id, reply rep)
+	{
+		auto iter = streams_.find(stream_id);
+		if (iter == streams_.end() || iter->second.replied)
+		{
+			return;
+		}
+		auto &cur_stream = iter->second;
+		cur_stream.replied = true;
+		if (cur_stream.admitted)
+		{
+			cur_stream.admitted = false;
+			auto handler_latency = std::chrono::steady_clock::now() - cur_stream.begin;
+			admission_.release(handler_latency);
+			if (metrics_)
+			{
+				metrics_->record_latency(metrics_registry::all_routes, handler_latency);
+			}
+		}
+		auto status_code = rep.get_status_code();
+		if (metrics_)
+		{
+			metrics_->record_status(status_code);
+		}
+		// there is no protocol switch in HTTP/2, so an interim status can not end a stream
+		if (status_code < 200)
+		{
+			status_code = 500;
+		}
+
+		std::string block;
+		block.reserve(128);
+		std::string lower_name;
+		bool has_date = false;
+		bool has_server = false;
+		auto encode_field = [&](std::string_view name, std::string_view value)
+		{
+			to_lower(name, lower_name);
+			if (is_connection_specific(lower_name))
+			{
+				return;
+			}
+			has_date = has_date || lower_name == "date";
+			has_server = has_server || lower_name == "server";
+			encoder_.encode(lower_name, value, block);
+		};
+		char status_text[8];
+		auto status_size = std::snprintf(status_text, sizeof(status_text), "%d", status_code);
+		encoder_.encode(":status", std::string_view(status_text, status_size), block);
+
+		data_piece body;
+		if (rep.prebuilt)
+		{
+			const auto &remain = rep.prebuilt->remain;
+			auto head_size = for_each_header_line(remain, encode_field);
+			body.owner = rep.prebuilt;
+			body.data = asio::buffer(remain.data() + head_size, remain.size() - head_size);
+		}
+		else
+		{
+			for (const auto &h : rep.headers)
+			{
+				encode_field(h.name, h.value);
+			}
+			if (!rep.content.empty())
+			{
+				auto content = std::make_shared<const std::string>(std::move(rep.content));
+				body.data = asio::buffer(*content);
+				body.owner = std::move(content);
+			}
+		}
+		for_each_header_line(date_cache::header_lines(!has_date, !has_server), encode_field);
+
+		if (cur_stream.head_request)
+		{
+			body.data = asio::const_buffer();
+			rep.body_stream.reset();
+		}
+		bool has_body = body.data.size() || rep.body_stream;
+		queue_headers(stream_id, block, !has_body);
+		cur_stream.end_sent = !has_body;
+		cur_stream.body_complete = !rep.body_stream;
+		cur_stream.body_stream = std::move(rep.body_stream);
+		if (body.data.size())
+		{
+			cur_stream.pending_size = body.data.size();
+			cur_stream.pending.push_back(std::move(body));
+		}
+		send_pending();
+		commit_frames();
+	}
+
+	void http2_session::queue_headers(std::uint32_t stream_id, const std::string &block, bool end_stream)
+	{
+		std::size_t offset = 0;
+		auto type = frame_type::headers;
+		do
+		{
+			auto length = std::min(block.size() - offset, peer_max_frame_size_);
+			std::uint8_t flags = offset + length == block.size() ? frame_flag::end_headers : 0;
+			if (type == frame_type::headers && end_stream)
+			{
+				flags |= frame_flag::end_stream;
+			}
+			queue_frame_header(length, type, flags, stream_id);
+			frames_.append(block, offset, length);
+			offset += length;
+			type = frame_type::continuation;
+		} while (offset < block.size());
+	}
+
+	void http2_session::send_pending()
+	{
+		if (sending_)
+		{
+			send_again_ = true;
+			return;
+		}
+		sending_ = true;
+		do
+		{
+			send_again_ = false;
+			for (bool progress = true; progress;)
+			{
+				progress = false;
+				for (auto iter = streams_.begin(); iter != streams_.end();)
+				{
+					auto &cur_stream = iter->second;
+					if (cur_stream.body_failed)
+					{
+						// the headers are sent, only a reset tells the client
+						queue_rst_stream(iter->first, http2_error::internal_error);
+						iter = erase_stream(iter);
+						continue;
+					}
+					if (cur_stream.replied && !cur_stream.end_sent && !output_.full() && send_stream_frame(iter->first, cur_stream))
+					{
+						progress = true;
+					}
+					if (cur_stream.end_sent)
+					{
+						iter = erase_stream(iter);
+						continue;
+					}
+					++iter;
+				}
+			}
+		} while (send_again_);
+		sending_ = false;
+	}
+
+	bool http2_session::send_stream_frame(std::uint32_t stream_id, stream &cur_stream)
+	{
+		bool sent = false;
+		if (cur_stream.pending_size)
+		{
+			auto allowed = std::min({cur_stream.send_window, send_window_, std::int64_t(peer_max_frame_size_)});
+			if (allowed > 0)
+			{
+				auto &piece = cur_stream.pending.front();
+				auto length = std::min(std::size_t(allowed), piece.data.size());
+				bool last = cur_stream.body_complete && length == cur_stream.pending_size;
+				queue_frame_header(length, frame_type::data, last ? frame_flag::end_stream : 0, stream_id);
+				if (length <= max_copied_data)
+				{
+					frames_.append(static_cast<const char *>(piece.data.data()), length);
+				}
+				else
+				{
+					// large payloads are written from where the reply keeps them
+					commit_frames();
+					output_.push(piece.owner, asio::buffer(piece.data.data(), length));
+				}
+				piece.data += length;
+				if (!piece.data.size())
+				{
+					cur_stream.pending.pop_front();
+				}
+				cur_stream.pending_size -= length;
+				cur_stream.send_window -= length;
+				send_window_ -= length;
+				cur_stream.end_sent = last;
+				sent = true;
+			}
+		}
+		else if (cur_stream.body_complete)
+		{
+			// a streamed body that ended after its last piece was sent
+			queue_frame_header(0, frame_type::data, frame_flag::end_stream, stream_id);
+			cur_stream.end_sent = true;
+			sent = true;
+		}
+		if (cur_stream.body_stream && !cur_stream.body_complete && !cur_stream.body_reading && cur_stream.pending_size < body_read_ahead)
+		{
+			read_body(stream_id, cur_stream);
+		}
+		return sent;
+	}
+
+	void http2_session::read_body(std::uint32_t stream_id, stream &cur_stream)
+	{
+		cur_stream.body_reading = true;
+		// the source may call back on any thread, the piece goes through the connection's executor
+		auto body_stream = cur_stream.body_stream;
+		body_stream->read_shared([this, transport = transport_, stream_id](const std::string &err, std::shared_ptr<const std::string> data, bool finished)
+			{
+				auto strong_transport = transport.lock();
+				if (!strong_transport)
+				{
+					return;
+				}
+				strong_transport->run_on_connection([this, stream_id, err, data = std::move(data), finished]() mutable
+					{
+						on_body_piece(stream_id, err, std::move(data), finished);
+					});
+			});
+	}
+
+	void http2_session::on_body_piece(std::uint32_t stream_id, const std::string &err, std::shared_ptr<const std::string> data, bool finished)
+	{
+		auto iter = streams_.find(stream_id);
+		if (iter == streams_.end())
+		{
+			return;
+		}
+		auto &cur_stream = iter->second;
+		cur_stream.body_reading = false;
+		if (!err.empty())
+		{
+			cur_stream.body_failed = true;
+		}
+		else
+		{
+			if (data && !data->empty())
+			{
+				auto buffer = asio::buffer(*data);
+				cur_stream.pending_size += buffer.size();
+				cur_stream.pending.push_back(data_piece{std::move(data), buffer});
+			}
+			if (finished)
+			{
+				cur_stream.body_complete = true;
+				cur_stream.body_stream.reset();
+			}
+		}
+		send_pending();
+		commit_frames();
+	}
+
+	void http2_session::on_output_written()
+	{
+		send_pending();
+		commit_frames();
+	}
+
+	void http2_session::go_away()
+	{
+		if (going_away_ || failed_)
+		{
+			return;
+		}
+		going_away_ = true;
+		queue_goaway(http2_error::no_error);
+		commit_frames();
+	}
+
+	void http2_session::queue_frame_header(std::size_t length, std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id)
+	{
+		frames_ += char((length >> 16) & 0xff);
+		frames_ += char((length >> 8) & 0xff);
+		frames_ += char(length & 0xff);
+		frames_ += char(type);
+		frames_ += char(flags);
+		append_uint32(frames_, stream_id);
+	}
+
+	void http2_session::queue_window_update(std::uint32_t stream_id, std::uint32_t increment)
+	{
+		queue_frame_header(4, frame_type::window_update, 0, stream_id);
+		append_uint32(frames_, increment);
+	}
+
+	void http2_session::queue_rst_stream(std::uint32_t stream_id, std::uint32_t error_code)
+	{
+		queue_frame_header(4, frame_type::rst_stream, 0, stream_id);
+		append_uint32(frames_, error_code);
+	}
+
+	void http2_session::queue_goaway(std::uint32_t error_code)
+	{
+		queue_frame_header(8, frame_type::goaway, 0, 0);
+		append_uint32(frames_, last_stream_id_);
+		append_uint32(frames_, error_code);
+	}
+
+	void http2_session::reset_stream(std::uint32_t stream_id, std::uint32_t error_code)
+	{
+		queue_rst_stream(stream_id, error_code);
+		auto iter = streams_.find(stream_id);
+		if (iter != streams_.end())
+		{
+			erase_stream(iter);
+		}
+	}
+
+	http2_session::stream_map::iterator http2_session::erase_stream(stream_map::iterator iter)
+	{
+		if (iter->second.admitted)
+		{
+			admission_.release(std::chrono::steady_clock::duration::zero());
+		}
+		return streams_.erase(iter);
+	}
+
+	void http2_session::connection_error(std::uint32_t error_code)
+	{
+		if (failed_)
+		{
+			return;
+		}
+		failed_ = true;
+		if (metrics_)
+		{
+			metrics_->add(server_metric::parse_errors);
+		}
+		queue_goaway(error_code);
+	}
+
+	void http2_session::commit_frames()
+	{
+		if (frames_.empty())
+		{
+			return;
+		}
+		output_.push(std::move(frames_));
+		frames_ = output_.take_spare();
+	}
+
+} // namespace spiritsaway::http_server
@@ -1,41 +1,200 @@
 #include "http_client.h"
+#include <cstdio>
 #include <sstream>
 
 namespace spiritsaway::http_server
 {
+	namespace
+	{
+		/// The reply::body_stream of a streamed reply, reads through to the client.
+		class client_body_source : public body_source
+		{
+		public:
+			explicit client_body_source(std::shared_ptr<http_client> client)
+				: m_client(std::move(client))
+			{
+			}
+
+			void read(read_handler cb) override
+			{
+				m_client->read_reply_body(std::move(cb));
+			}
+
+		private:
+			std::shared_ptr<http_client> m_client;
+		};
+
+		/// Whether a request with method may be sent again after a failure, RFC 7231 section 4.2.2.
+		bool is_idempotent(const std::string &method)
+		{
+			return method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE" || method == "OPTIONS";
+		}
+
+		const char last_chunk[] = "0\r\n\r\n";
+		const char chunk_crlf[] = "\r\n";
+	}
+
+	http_client_pool::http_client_pool(std::size_t max_idle_per_host, std::uint32_t idle_timeout_seconds, const socket_options &options)
+		: m_max_idle_per_host(max_idle_per_host)
+		, m_idle_timeout(idle_timeout_seconds)
+		, m_socket_options(options)
+	{
+
+	}
+
+	bool http_client_pool::acquire(const std::string &server_url, const std::string &server_port, asio::ip::tcp::socket &socket)
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		auto iter = m_idle_sockets.find(server_url + ":" + server_port);
+		if (iter == m_idle_sockets.end())
+		{
+			return false;
+		}
+		auto &idle_sockets = iter->second;
+		auto now = std::chrono::steady_clock::now();
+		while (!idle_sockets.empty())
+		{
+			auto cur_idle = std::move(idle_sockets.back());
+			idle_sockets.pop_back();
+			if (now - cur_idle.idle_since > m_idle_timeout)
+			{
+				continue;
+			}
+			// a socket closed by the peer while idle is readable with eof or an error
+			asio::error_code ec;
+			char peek_byte;
+			cur_idle.socket.non_blocking(true, ec);
+			cur_idle.socket.receive(asio::buffer(&peek_byte, 1), asio::socket_base::message_peek, ec);
+			if (ec == asio::error::would_block)
+			{
+				socket = std::move(cur_idle.socket);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void http_client_pool::release(const std::string &server_url, const std::string &server_port, asio::ip::tcp::socket &&socket)
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		auto &idle_sockets = m_idle_sockets[server_url + ":" + server_port];
+		if (idle_sockets.size() >= m_max_idle_per_host)
+		{
+			idle_sockets.erase(idle_sockets.begin());
+		}
+		idle_sockets.push_back(idle_socket{std::move(socket), std::chrono::steady_clock::now()});
+	}
+
+	std::size_t http_client_pool::get_idle_count()
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		std::size_t result = 0;
+		for (const auto &one_host : m_idle_sockets)
+		{
+			result += one_host.second.size();
+		}
+		return result;
+	}
+
 	http_client::http_client(asio::io_context &io_context, const std::string &server_url, const std::string &server_port, const request &req, std::function<void(const std::string &, const reply &)> callback, std::uint32_t timeout_second)
+		: http_client(io_context, server_url, server_port, req, std::move(callback), timeout_second, nullptr)
+	{
+
+	}
+
+	http_client::http_client(asio::io_context &io_context, const std::string &server_url, const std::string &server_port, const request &req, std::function<void(const std::string &, const reply &)> callback, std::uint32_t timeout_second, std::shared_ptr<http_client_pool> pool)
 		: m_socket(io_context), m_resolver(io_context), m_callback(callback)
-		, m_req_str(req_to_str(req, server_url, server_port))
+		, m_req_str(req_to_str(req, server_url, server_port, pool != nullptr))
 		, m_timer(io_context)
 		, m_timeout_seconds(timeout_second)
 		, m_server_url(server_url)
 		, m_server_port(server_port)
+		, m_pool(std::move(pool))
+		, m_req_body_stream(req.body_stream)
+		, m_idempotent(is_idempotent(req.method))
 	{
-		
+		m_rep_parser.set_skip_body(req.method == "HEAD");
+		if (m_pool)
+		{
+			m_socket_options = m_pool->get_socket_options();
+		}
+	}
 
+	void http_client::set_socket_options(const socket_options &options)
+	{
+		m_socket_options = options;
 	}
+
+	void http_client::set_stream_reply(bool enabled)
+	{
+		m_stream_reply = enabled;
+		m_rep_parser.set_stream_body(enabled);
+	}
+
 	std::string http_client::req_to_str(const request& req, const std::string& server_url, const std::string& server_port)
+	{
+		return req_to_str(req, server_url, server_port, false);
+	}
+
+	std::string http_client::req_to_str(const request& req, const std::string& server_url, const std::string& server_port, bool keep_alive)
 	{
 		std::ostringstream request_stream;
 		request_stream << req.method << " " << req.uri << " HTTP/" << req.http_version_major << "." << req.http_version_minor << "\r\n";
-		request_stream << "Host: " << server_url <<"\r\n";
-		request_stream << "Accept: */*\r\n";
+		request_stream << "Host: " << server_url;
+		if (server_port != "80")
+		{
+			request_stream << ":" << server_port;
+		}
+		request_stream << "\r\n";
+		if (!find_header(req.headers, "Accept"))
+		{
+			request_stream << "Accept: */*\r\n";
+		}
 		for (const auto &one_header : req.headers)
 		{
+			// framing headers are generated below
+			if (iequals(one_header.name, "Host") || iequals(one_header.name, "Connection") || iequals(one_header.name, "Content-Length") || iequals(one_header.name, "Transfer-Encoding"))
+			{
+				continue;
+			}
 			request_stream << one_header.name << ": " << one_header.value << "\r\n";
 		}
-		request_stream << "Connection: close\r\n";
-		request_stream << "Content-Length: " << req.body.size() << "\r\n\r\n";
-		request_stream << req.body;
+		request_stream << (keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+		if (req.body_stream)
+		{
+			request_stream << "Transfer-Encoding: chunked\r\n\r\n";
+		}
+		else
+		{
+			request_stream << "Content-Length: " << req.body.size() << "\r\n\r\n";
+			request_stream << req.body;
+		}
 		return request_stream.str();
 	}
 
 	void http_client::run()
+	{
+		reset_timer();
+		if (m_pool && m_pool->acquire(m_server_url, m_server_port, m_socket))
+		{
+			m_reused_socket = true;
+			handle_connect(asio::error_code());
+			return;
+		}
+		do_connect();
+	}
+
+	void http_client::do_connect()
 	{
 		auto self = shared_from_this();
 		asio::ip::tcp::resolver::query query(m_server_url, m_server_port);
 		m_resolver.async_resolve(query, [self, this](const asio::error_code& error, asio::ip::tcp::resolver::iterator iterator)
 								{ handle_resolve(error, iterator); });
+	}
+
+	void http_client::reset_timer()
+	{
+		auto self = shared_from_this();
 		m_timer.expires_from_now(std::chrono::seconds(m_timeout_seconds));
 		m_timer.async_wait([self, this](const asio::error_code& error)
 		{
@@ -52,6 +211,15 @@ namespace spiritsaway::http_server
 			return;
 		}
 		auto self = shared_from_this();
+		// buffer sizes and fast open only work when set before the connect
+		asio::error_code open_ec;
+		m_socket.open(iterator->endpoint().protocol(), open_ec);
+		if (open_ec)
+		{
+			invoke_callback(open_ec.message());
+			return;
+		}
+		apply_socket_options(m_socket, m_socket_options, true);
 		m_socket.async_connect(*iterator, [self, this](const asio::error_code &err)
 							{ handle_connect(err); });
 	}
@@ -71,58 +239,263 @@ namespace spiritsaway::http_server
 	}
 	void http_client::handle_write_request(const asio::error_code &err)
 	{
+		if (m_exchange_done)
+		{
+			return;
+		}
 		if (err)
 		{
-
+			if (retry_connect(err))
+			{
+				return;
+			}
 			invoke_callback(err.message());
 			return;
 		}
+		if (m_req_body_stream)
+		{
+			// the reply is read while the body is still being sent, the server may answer early
+			write_request_body();
+		}
+		else
+		{
+			m_request_sent = true;
+		}
+		do_read_content();
+	}
+
+	void http_client::write_request_body()
+	{
+		auto self = shared_from_this();
+		m_req_body_stream->read([self, this](const std::string& err, std::string data, bool finished)
+		{
+			asio::dispatch(m_socket.get_executor(), [self, this, err, data = std::move(data), finished]() mutable
+			{
+				if (m_exchange_done)
+				{
+					return;
+				}
+				if (!err.empty())
+				{
+					invoke_callback(err);
+					return;
+				}
+				m_chunk_data = std::move(data);
+				m_chunk_header.clear();
+				if (!m_chunk_data.empty())
+				{
+					char size_buffer[32];
+					auto size_len = std::snprintf(size_buffer, sizeof(size_buffer), "%zx\r\n", m_chunk_data.size());
+					m_chunk_header.assign(size_buffer, size_len);
+				}
+				std::array<asio::const_buffer, 4> buffers = {
+					asio::buffer(m_chunk_header),
+					asio::buffer(m_chunk_data),
+					asio::buffer(chunk_crlf, m_chunk_header.empty() ? 0 : 2),
+					asio::buffer(last_chunk, finished ? sizeof(last_chunk) - 1 : 0)};
+				asio::async_write(m_socket, buffers, [self, this, finished](const asio::error_code &err, std::size_t)
+				{
+					if (m_exchange_done)
+					{
+						return;
+					}
+					if (err)
+					{
+						invoke_callback(err.message());
+						return;
+					}
+					if (finished)
+					{
+						m_request_sent = true;
+					}
+					else
+					{
+						write_request_body();
+					}
+				});
+			});
+		});
+	}
+
+	void http_client::do_read_content()
+	{
 		m_socket.async_read_some(asio::buffer(m_content_read_buffer.data(), m_content_read_buffer.size()), [self = shared_from_this(), this](const asio::error_code& err, std::size_t n)
 		{
 			handle_read_content(err, n);
 		});
 	}
-	
+
 	void http_client::handle_read_content(const asio::error_code &err, std::size_t n)
 	{
+		if (m_exchange_done)
+		{
+			return;
+		}
+		reply_parser::result_type temp_parse_result;
 		if(err)
 		{
-			if(err == asio::error::eof)
+			if (err != asio::error::eof)
 			{
-				m_reply.content = reply_oss.str();
-				invoke_callback("");
+				if (!retry_connect(err))
+				{
+					invoke_callback(err.message());
+				}
+				return;
 			}
-			else
+			if (!m_reply_started && retry_connect(err))
 			{
-				invoke_callback(err.message());
+				return;
 			}
-			return;
+			// a reply without length ends with the connection
+			temp_parse_result = m_rep_parser.finish();
+		}
+		else
+		{
+			m_reply_started = true;
+			reset_timer();
+			temp_parse_result = m_rep_parser.parse(m_content_read_buffer.data(), n);
 		}
-		std::string temp_content(m_content_read_buffer.data(), n);
-		std::cout << "read content: " << temp_content << std::endl;
-		auto temp_parse_result = m_rep_parser.parse(m_content_read_buffer.data(), n);
 		if (temp_parse_result == reply_parser::result_type::bad)
 		{
-			invoke_callback("invalid reply");
+			invoke_callback(err ? "connection closed" : "invalid reply");
+			return;
+		}
+		if (temp_parse_result == reply_parser::result_type::indeterminate)
+		{
+			do_read_content();
+			return;
+		}
+		if (m_stream_reply)
+		{
+			// the head goes out now, the body is handed out by read_reply_body
+			m_timer.cancel();
+			m_reply = m_rep_parser.m_reply;
+			m_reply.body_stream = std::make_shared<client_body_source>(shared_from_this());
+			invoke_callback("");
+			// the source holds this client, only its reader may keep it
+			m_reply.body_stream.reset();
 			return;
 		}
-		m_socket.async_read_some(asio::buffer(m_content_read_buffer.data(), m_content_read_buffer.size()),  [self=shared_from_this(), this](const asio::error_code& err, std::size_t bytes_transferred)
+		finish_exchange();
+		m_reply = std::move(m_rep_parser.m_reply);
+		invoke_callback("");
+	}
+
+	void http_client::read_reply_body(body_source::read_handler cb)
+	{
+		asio::dispatch(m_socket.get_executor(), [self = shared_from_this(), this, cb = std::move(cb)]() mutable
 		{
-			handle_read_content(err, bytes_transferred);
+			do_read_body(std::move(cb));
 		});
+	}
 
+	void http_client::do_read_body(body_source::read_handler cb)
+	{
+		auto data = m_rep_parser.take_body();
+		bool complete = m_rep_parser.m_reply_complete;
+		if (!data.empty() || complete)
+		{
+			if (complete && !m_exchange_done)
+			{
+				finish_exchange();
+			}
+			cb(std::string(), std::move(data), complete);
+			return;
+		}
+		if (m_exchange_done)
+		{
+			cb("connection closed", std::string(), false);
+			return;
+		}
+		m_body_read_cb = std::move(cb);
+		reset_timer();
+		m_socket.async_read_some(asio::buffer(m_content_read_buffer.data(), m_content_read_buffer.size()), [self = shared_from_this(), this](const asio::error_code& err, std::size_t n)
+		{
+			if (m_exchange_done)
+			{
+				return;
+			}
+			reply_parser::result_type temp_parse_result;
+			if (err)
+			{
+				if (err != asio::error::eof)
+				{
+					invoke_callback(err.message());
+					return;
+				}
+				temp_parse_result = m_rep_parser.finish();
+			}
+			else
+			{
+				temp_parse_result = m_rep_parser.parse(m_content_read_buffer.data(), n);
+			}
+			if (temp_parse_result == reply_parser::result_type::bad)
+			{
+				invoke_callback(err ? "connection closed" : "invalid reply");
+				return;
+			}
+			m_timer.cancel();
+			auto cb = std::move(m_body_read_cb);
+			m_body_read_cb = nullptr;
+			do_read_body(std::move(cb));
+		});
 	}
-	void http_client::invoke_callback(const std::string& err)
+
+	void http_client::finish_exchange()
 	{
+		m_exchange_done = true;
 		m_timer.cancel();
-		m_callback(err, m_reply);
-		m_socket.close();
+		if (m_pool && m_request_sent && m_rep_parser.should_keep_alive())
+		{
+			m_pool->release(m_server_url, m_server_port, std::move(m_socket));
+			return;
+		}
+		asio::error_code ignored_ec;
+		m_socket.close(ignored_ec);
+	}
+
+	bool http_client::retry_connect(const asio::error_code &/*err*/)
+	{
+		// the server may have acted on a request it closed the connection of without a reply
+		if (!m_reused_socket || m_reply_started || m_req_body_stream || !m_idempotent)
+		{
+			return false;
+		}
+		// the pooled connection was closed by the server while idle
+		m_reused_socket = false;
+		asio::error_code ignored_ec;
+		m_socket.close(ignored_ec);
+		do_connect();
+		return true;
+	}
 
+	void http_client::invoke_callback(const std::string& err)
+	{
+		if (!err.empty())
+		{
+			m_exchange_done = true;
+			m_timer.cancel();
+			asio::error_code ignored_ec;
+			m_socket.close(ignored_ec);
+		}
+		if (m_callback_invoked)
+		{
+			// the head is already delivered, errors go to the reader of the body
+			if (!err.empty() && m_body_read_cb)
+			{
+				auto cb = std::move(m_body_read_cb);
+				m_body_read_cb = nullptr;
+				cb(err, std::string(), false);
+			}
+			return;
+		}
+		m_callback_invoked = true;
+		m_callback(err, m_reply);
 	}
-	
+
 	void http_client::on_timeout(const asio::error_code& err)
 	{
-		if(err != asio::error::operation_aborted)
+		if(err != asio::error::operation_aborted && !m_exchange_done)
 		{
 			invoke_callback("timeout");
 		}
@@ -150,7 +523,7 @@ namespace spiritsaway::http_server
 			resource_path = path_view.substr(resource_iter);
 			path_view = path_view.substr(0, resource_iter);
 		}
-		
+
 		auto port_iter = path_view.find(":");
 		if(port_iter == std::string_view::npos)
 		{
@@ -166,4 +539,4 @@ namespace spiritsaway::http_server
 	}
 
 
-}
\ No newline at end of file
+}
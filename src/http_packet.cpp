@@ -1,4 +1,5 @@
 #include "http_packet.hpp"
+#include <cctype>
 
 namespace spiritsaway::http_server
 {
@@ -29,6 +30,8 @@ namespace spiritsaway::http_server
 			"HTTP/1.0 403 Forbidden\r\n";
 		const std::string not_found =
 			"HTTP/1.0 404 Not Found\r\n";
+		const std::string too_many_requests =
+			"HTTP/1.0 429 Too Many Requests\r\n";
 		const std::string internal_server_error =
 			"HTTP/1.0 500 Internal Server Error\r\n";
 		const std::string not_implemented =
@@ -37,6 +40,8 @@ namespace spiritsaway::http_server
 			"HTTP/1.0 502 Bad Gateway\r\n";
 		const std::string service_unavailable =
 			"HTTP/1.0 503 Service Unavailable\r\n";
+		const std::string gateway_timeout =
+			"HTTP/1.0 504 Gateway Timeout\r\n";
 
 		std::string to_string(reply::status_type status)
 		{
@@ -66,6 +71,8 @@ namespace spiritsaway::http_server
 				return forbidden;
 			case reply::status_type::not_found:
 				return not_found;
+			case reply::status_type::too_many_requests:
+				return too_many_requests;
 			case reply::status_type::internal_server_error:
 				return internal_server_error;
 			case reply::status_type::not_implemented:
@@ -74,6 +81,8 @@ namespace spiritsaway::http_server
 				return bad_gateway;
 			case reply::status_type::service_unavailable:
 				return service_unavailable;
+			case reply::status_type::gateway_timeout:
+				return gateway_timeout;
 			default:
 				return internal_server_error;
 			}
@@ -91,30 +100,151 @@ namespace spiritsaway::http_server
 
 	std::string reply::to_string()
 	{
-		std::vector<std::string> buffers;
-		buffers.push_back(status);
-		for (std::size_t i = 0; i < headers.size(); ++i)
+		auto result = serialize();
+		result.status_line += result.remain;
+		return result.status_line;
+	}
+
+	serialized_reply reply::serialize() const
+	{
+		serialized_reply result;
+		serialize_into(result);
+		return result;
+	}
+
+	void reply::serialize_into(serialized_reply& result) const
+	{
+		if (prebuilt)
 		{
-			header &h = headers[i];
-			buffers.push_back(h.name);
-			buffers.push_back(misc_strings::name_value_separator);
-			buffers.push_back(h.value);
-			buffers.push_back(misc_strings::crlf);
+			result = *prebuilt;
+			return;
 		}
-		buffers.push_back(misc_strings::crlf);
-		buffers.push_back(content);
-		std::size_t total_sz = 0;
-		for (const auto& one_str : buffers)
+		result.status_line = status;
+		std::size_t total_sz = content.size() + 2;
+		for (const auto& h : headers)
 		{
-			total_sz += one_str.size();
+			total_sz += h.name.size() + h.value.size() + 4;
 		}
-		std::string result;
-		result.reserve(total_sz);
-		for (const auto& one_str : buffers)
+		result.remain.clear();
+		result.remain.reserve(total_sz);
+		for (const auto& h : headers)
 		{
-			result += one_str;
+			result.remain += h.name;
+			result.remain.append(misc_strings::name_value_separator, sizeof(misc_strings::name_value_separator));
+			result.remain += h.value;
+			result.remain.append(misc_strings::crlf, sizeof(misc_strings::crlf));
 		}
-		return result;
+		result.remain.append(misc_strings::crlf, sizeof(misc_strings::crlf));
+		result.remain += content;
+		result.has_date = find_header(headers, "Date") != nullptr;
+		result.has_server = find_header(headers, "Server") != nullptr;
+		auto connection_header = find_header(headers, "Connection");
+		result.has_connection = connection_header != nullptr;
+		result.close_connection = connection_header && iequals(*connection_header, "close");
+	}
+
+	bool iequals(std::string_view a, std::string_view b)
+	{
+		if (a.size() != b.size())
+		{
+			return false;
+		}
+		for (std::size_t i = 0; i < a.size(); i++)
+		{
+			if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i])))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::string_view trim_spaces(std::string_view value)
+	{
+		while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+		{
+			value.remove_prefix(1);
+		}
+		while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+		{
+			value.remove_suffix(1);
+		}
+		return value;
+	}
+
+	bool has_token(const std::string* value, std::string_view token)
+	{
+		if (!value)
+		{
+			return false;
+		}
+		std::string_view remain(*value);
+		while (!remain.empty())
+		{
+			auto comma = remain.find(',');
+			if (iequals(trim_spaces(remain.substr(0, comma)), token))
+			{
+				return true;
+			}
+			if (comma == std::string_view::npos)
+			{
+				break;
+			}
+			remain.remove_prefix(comma + 1);
+		}
+		return false;
+	}
+
+	const std::string* find_header(const std::vector<header>& headers, std::string_view name)
+	{
+		for (const auto& h : headers)
+		{
+			if (iequals(h.name, name))
+			{
+				return &h.value;
+			}
+		}
+		return nullptr;
+	}
+
+	void set_header(std::vector<header>& headers, std::string_view name, std::string_view value)
+	{
+		for (auto& h : headers)
+		{
+			if (iequals(h.name, name))
+			{
+				h.value.assign(value.data(), value.size());
+				return;
+			}
+		}
+		header temp_header;
+		temp_header.name = std::string(name);
+		temp_header.value = std::string(value);
+		headers.push_back(std::move(temp_header));
+	}
+
+	int reply::get_status_code() const
+	{
+		const std::string& status_line = prebuilt ? prebuilt->status_line : status;
+		std::size_t pos = 0;
+		if (status_line.compare(0, 5, "HTTP/") == 0)
+		{
+			pos = status_line.find(' ');
+			if (pos == std::string::npos)
+			{
+				return 0;
+			}
+			pos++;
+		}
+		int code = 0;
+		std::size_t digits = 0;
+		while (pos < status_line.size() && digits < 3 && std::isdigit(static_cast<unsigned char>(status_line[pos])))
+		{
+			code = code * 10 + (status_line[pos] - '0');
+			pos++;
+			digits++;
+		}
+		return digits == 3 ? code : 0;
 	}
 
 	namespace stock_replies
@@ -176,6 +306,11 @@ namespace spiritsaway::http_server
 			"<head><title>Not Found</title></head>"
 			"<body><h1>404 Not Found</h1></body>"
 			"</html>";
+		const char too_many_requests[] =
+			"<html>"
+			"<head><title>Too Many Requests</title></head>"
+			"<body><h1>429 Too Many Requests</h1></body>"
+			"</html>";
 		const char internal_server_error[] =
 			"<html>"
 			"<head><title>Internal Server Error</title></head>"
@@ -196,6 +331,11 @@ namespace spiritsaway::http_server
 			"<head><title>Service Unavailable</title></head>"
 			"<body><h1>503 Service Unavailable</h1></body>"
 			"</html>";
+		const char gateway_timeout[] =
+			"<html>"
+			"<head><title>Gateway Timeout</title></head>"
+			"<body><h1>504 Gateway Timeout</h1></body>"
+			"</html>";
 
 		std::string to_string(reply::status_type status)
 		{
@@ -225,6 +365,8 @@ namespace spiritsaway::http_server
 				return forbidden;
 			case reply::status_type::not_found:
 				return not_found;
+			case reply::status_type::too_many_requests:
+				return too_many_requests;
 			case reply::status_type::internal_server_error:
 				return internal_server_error;
 			case reply::status_type::not_implemented:
@@ -233,6 +375,8 @@ namespace spiritsaway::http_server
 				return bad_gateway;
 			case reply::status_type::service_unavailable:
 				return service_unavailable;
+			case reply::status_type::gateway_timeout:
+				return gateway_timeout;
 			default:
 				return internal_server_error;
 			}
@@ -243,7 +387,7 @@ namespace spiritsaway::http_server
 	reply reply::stock_reply(reply::status_type status)
 	{
 		reply rep;
-		rep.status = int(status);
+		rep.status = status_strings::to_string(status);
 		rep.content = stock_replies::to_string(status);
 		rep.headers.resize(2);
 		rep.headers[0].name = "Content-Length";
@@ -9,25 +9,48 @@
 //
 
 #include "http_server.hpp"
+#include "rate_limiter.hpp"
 #include <signal.h>
 #include <utility>
 
 namespace spiritsaway::http_server
 {
 
-	server::server(asio::io_context &io_context, const std::string &address, const std::string &port, const request_handler &handler)
+	server_core::server_core(asio::io_context &io_context, const std::string &address, const std::string &port, const server_options &options)
 		: io_context_(io_context),
-		  signals_(io_context_),
-		  acceptor_(io_context_),
-		  connection_manager_(),
-		  request_handler_(handler),
+		  strand_(asio::make_strand(io_context_)),
+		  signals_(strand_),
+		  acceptor_(strand_),
 		  address_(address),
-		  port_(port)
+		  port_(port),
+		  drain_timer_(strand_),
+		  connection_manager_(),
+		  options_(std::make_shared<const server_options>(options)),
+		  admission_(options),
+		  mailbox_(io_context_),
+		  pool_(std::make_shared<connection_pool>(options.connection_pool_size))
 	{
-
+		if (options_->max_connections)
+		{
+			connection_manager_.set_stop_callback([this]()
+				{
+					resume_accept();
+				});
+		}
+		if (options_->drain_on_sigterm)
+		{
+			signals_.add(SIGTERM);
+			signals_.async_wait([this](std::error_code ec, int)
+				{
+					if (!ec)
+					{
+						drain();
+					}
+				});
+		}
 	}
 
-	void server::run()
+	void server_core::run()
 	{
 		// Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
 		asio::ip::tcp::resolver resolver(io_context_);
@@ -36,13 +59,21 @@ namespace spiritsaway::http_server
 		acceptor_.open(endpoint.protocol());
 		acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true));
 		acceptor_.bind(endpoint);
+		apply_listener_options(acceptor_, options_->sockets);
 		acceptor_.listen();
 		do_accept();
 	}
 
-	void server::do_accept()
+	void server_core::run(const asio::ip::tcp &protocol, asio::ip::tcp::acceptor::native_handle_type listener)
 	{
-		acceptor_.async_accept(
+		acceptor_.assign(protocol, listener);
+		do_accept();
+	}
+
+	void server_core::do_accept()
+	{
+		// the socket and everything built on its executor run on a strand of the connection
+		acceptor_.async_accept(asio::make_strand(io_context_),
 			[this](std::error_code ec, asio::ip::tcp::socket socket) {
 				// Check whether the server was stopped by a signal before this
 				// completion handler had a chance to run.
@@ -51,24 +82,154 @@ namespace spiritsaway::http_server
 					return;
 				}
 
+				if (!ec && options_->accept_rate_limiter && !admit_remote(socket))
+				{
+					do_accept();
+					return;
+				}
 				if (!ec)
 				{
-					connection_manager_.start(std::make_shared<connection>(
-						std::move(socket), connection_manager_, request_handler_));
+					apply_socket_options(socket, options_->sockets, false);
+					connection_manager_.start(make_connection(std::move(socket)));
 				}
 
+				if (options_->max_connections && connection_manager_.get_connection_count() >= options_->max_connections)
+				{
+					// leave further clients in the listen backlog until a connection closes,
+					// check again in case the last one closed before the flag was set
+					accept_paused_ = true;
+					if (connection_manager_.get_connection_count() >= options_->max_connections || !accept_paused_.exchange(false))
+					{
+						return;
+					}
+				}
 				do_accept();
 			});
 	}
 
+	bool server_core::admit_remote(asio::ip::tcp::socket &socket)
+	{
+		asio::error_code ec;
+		auto remote_endpoint = socket.remote_endpoint(ec);
+		if (ec || options_->accept_rate_limiter->try_acquire(remote_endpoint.address().to_string()))
+		{
+			return true;
+		}
+		// a single non-blocking write of the static reply, a client that is not ready for it just sees the close
+		const auto &limited = *rate_limiter::limited_reply().prebuilt;
+		std::array<asio::const_buffer, 2> buffers = {
+			asio::buffer(limited.status_line),
+			asio::buffer(limited.remain)};
+		socket.non_blocking(true, ec);
+		socket.write_some(buffers, ec);
+		socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+		socket.close(ec);
+		return false;
+	}
 
-	void server::stop()
+	void server_core::resume_accept()
 	{
+		if (connection_manager_.get_connection_count() < options_->max_connections && accept_paused_.exchange(false))
+		{
+			asio::post(strand_, [this]()
+				{
+					if (acceptor_.is_open())
+					{
+						do_accept();
+					}
+				});
+		}
+	}
+
+
+	void server_core::stop_accepting()
+	{
+		if (!io_context_.stopped() && !strand_.running_in_this_thread())
+		{
+			asio::dispatch(strand_, [this]()
+				{
+					stop_accepting();
+				});
+			return;
+		}
+		asio::error_code ignored_ec;
+		acceptor_.close(ignored_ec);
+	}
+
+	void server_core::stop()
+	{
+		// the accept and drain handlers may be running on another thread of the io_context
+		if (!io_context_.stopped() && !strand_.running_in_this_thread())
+		{
+			asio::dispatch(strand_, [this]()
+				{
+					stop();
+				});
+			return;
+		}
+		asio::error_code ignored_ec;
+		signals_.cancel(ignored_ec);
+		drain_timer_.cancel();
 		acceptor_.close();
 		connection_manager_.stop_all();
 	}
 
-	std::size_t server::get_connection_count()
+	void server_core::drain()
+	{
+		if (draining_.exchange(true))
+		{
+			return;
+		}
+		asio::post(strand_, [this]()
+			{
+				stop_accepting();
+				drain_begin_ = std::chrono::steady_clock::now();
+				connection_manager_.for_each([](const connection_ptr &con)
+					{
+						con->begin_drain();
+					});
+				on_drain_tick();
+			});
+	}
+
+	void server_core::on_drain_tick()
+	{
+		drain_progress progress;
+		progress.open_connections = connection_manager_.get_connection_count();
+		progress.in_flight_requests = admission_.get_in_flight();
+		progress.elapsed = std::chrono::steady_clock::now() - drain_begin_;
+		bool deadline_reached = progress.elapsed >= std::chrono::seconds(options_->drain_timeout_seconds);
+		if (progress.open_connections && deadline_reached)
+		{
+			progress.aborted_connections = progress.open_connections;
+			connection_manager_.stop_all();
+			progress.open_connections = 0;
+		}
+		progress.finished = progress.open_connections == 0;
+		// a tick every 100ms notices the last close quickly, the handler only hears every 10th
+		if (options_->drain_progress_handler && (progress.finished || drain_ticks_ % 10 == 0))
+		{
+			options_->drain_progress_handler(progress);
+		}
+		drain_ticks_++;
+		if (progress.finished)
+		{
+			// nothing but the signal wait is left to keep run() going
+			asio::error_code ignored_ec;
+			signals_.cancel(ignored_ec);
+			return;
+		}
+		drain_timer_.expires_after(std::chrono::milliseconds(100));
+		drain_timer_.async_wait([this](std::error_code ec)
+			{
+				if (!ec)
+				{
+					on_drain_tick();
+				}
+			});
+	}
+
+	std::size_t server_core::get_connection_count()
 	{
 		return connection_manager_.get_connection_count();
 	}
@@ -0,0 +1,330 @@
+#include "metrics.hpp"
+#include <cstdio>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		std::atomic<std::uint64_t> next_registry_id{1};
+
+		const char *const counter_names[] = {
+			"http_requests_total",
+			"http_received_bytes_total",
+			"http_sent_bytes_total",
+			"http_parse_errors_total",
+			"http_timeouts_total",
+			"http_shed_requests_total"};
+
+		const char *const status_class_names[] = {"1xx", "2xx", "3xx", "4xx", "5xx", "other"};
+
+		/// Histogram bucket limits of the exposition, powers of two so that they fall on bucket bounds.
+		const unsigned exposition_limit_bits[] = {6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26};
+
+		void append_escaped(std::string &result, const std::string &value)
+		{
+			for (auto c : value)
+			{
+				if (c == '\\' || c == '"')
+				{
+					result += '\\';
+					result += c;
+				}
+				else if (c == '\n')
+				{
+					result += "\\n";
+				}
+				else
+				{
+					result += c;
+				}
+			}
+		}
+
+		void append_number(std::string &result, double value)
+		{
+			char buffer[32];
+			auto len = std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+			result.append(buffer, len);
+		}
+	}
+
+	std::size_t latency_histogram::bucket_of(std::uint64_t value_us)
+	{
+		if (value_us < sub_bucket_count)
+		{
+			return value_us;
+		}
+		std::size_t exponent = 63;
+		while (!(value_us >> exponent))
+		{
+			exponent--;
+		}
+		if (exponent > max_exponent)
+		{
+			return bucket_count - 1;
+		}
+		auto mantissa = (value_us >> (exponent - sub_bucket_bits)) & (sub_bucket_count - 1);
+		return (exponent - sub_bucket_bits + 1) * sub_bucket_count + mantissa;
+	}
+
+	std::uint64_t latency_histogram::bucket_lower_bound(std::size_t index)
+	{
+		if (index < sub_bucket_count)
+		{
+			return index;
+		}
+		auto exponent = index / sub_bucket_count + sub_bucket_bits - 1;
+		auto mantissa = index % sub_bucket_count;
+		return std::uint64_t(sub_bucket_count + mantissa) << (exponent - sub_bucket_bits);
+	}
+
+	void latency_histogram::record(std::uint64_t value_us)
+	{
+		buckets_[bucket_of(value_us)].add(1);
+		sum_us_.add(value_us);
+	}
+
+	void latency_histogram::merge_into(histogram_snapshot &result) const
+	{
+		result.buckets.resize(bucket_count);
+		for (std::size_t i = 0; i < bucket_count; i++)
+		{
+			auto cur_count = buckets_[i].get();
+			result.buckets[i] += cur_count;
+			result.count += cur_count;
+		}
+		result.sum_us += sum_us_.get();
+	}
+
+	std::uint64_t histogram_snapshot::quantile(double q) const
+	{
+		if (count == 0)
+		{
+			return 0;
+		}
+		auto rank = static_cast<std::uint64_t>(q * double(count - 1));
+		std::uint64_t seen = 0;
+		for (std::size_t i = 0; i < buckets.size(); i++)
+		{
+			seen += buckets[i];
+			if (seen > rank)
+			{
+				return latency_histogram::bucket_lower_bound(i);
+			}
+		}
+		return latency_histogram::bucket_lower_bound(buckets.size() - 1);
+	}
+
+	std::uint64_t histogram_snapshot::count_below(std::uint64_t limit_us) const
+	{
+		std::uint64_t result = 0;
+		for (std::size_t i = 0; i < buckets.size() && latency_histogram::bucket_lower_bound(i) < limit_us; i++)
+		{
+			result += buckets[i];
+		}
+		return result;
+	}
+
+	metrics_registry::shard::~shard()
+	{
+		for (auto &one_latency : latencies)
+		{
+			delete one_latency.load(std::memory_order_relaxed);
+		}
+	}
+
+	metrics_registry::metrics_registry()
+		: id_(next_registry_id.fetch_add(1, std::memory_order_relaxed))
+	{
+		route_names_[all_routes] = "*";
+		route_count_.store(1, std::memory_order_release);
+	}
+
+	metrics_registry::~metrics_registry()
+	{
+		auto cur_shard = shards_.load(std::memory_order_acquire);
+		while (cur_shard)
+		{
+			auto next_shard = cur_shard->next;
+			delete cur_shard;
+			cur_shard = next_shard;
+		}
+	}
+
+	metrics_registry::shard &metrics_registry::local()
+	{
+		thread_local std::vector<std::pair<std::uint64_t, shard *>> thread_shards;
+		for (const auto &one_pair : thread_shards)
+		{
+			if (one_pair.first == id_)
+			{
+				return *one_pair.second;
+			}
+		}
+		auto new_shard = new shard();
+		new_shard->next = shards_.load(std::memory_order_relaxed);
+		while (!shards_.compare_exchange_weak(new_shard->next, new_shard, std::memory_order_release, std::memory_order_relaxed))
+		{
+		}
+		thread_shards.emplace_back(id_, new_shard);
+		return *new_shard;
+	}
+
+	std::size_t metrics_registry::add_route(const std::string &name)
+	{
+		std::lock_guard<std::mutex> guard(route_mutex_);
+		auto cur_count = route_count_.load(std::memory_order_relaxed);
+		for (std::size_t i = 0; i < cur_count; i++)
+		{
+			if (route_names_[i] == name)
+			{
+				return i;
+			}
+		}
+		if (cur_count == max_routes)
+		{
+			return all_routes;
+		}
+		route_names_[cur_count] = name;
+		route_count_.store(cur_count + 1, std::memory_order_release);
+		return cur_count;
+	}
+
+	void metrics_registry::add(server_metric metric, std::uint64_t n)
+	{
+		local().counters[static_cast<std::size_t>(metric)].add(n);
+	}
+
+	void metrics_registry::record_status(int status_code)
+	{
+		auto status_class = status_code / 100;
+		if (status_class < 1 || status_class > 5)
+		{
+			add(server_metric::replies_other);
+			return;
+		}
+		add(static_cast<server_metric>(static_cast<int>(server_metric::replies_1xx) + status_class - 1));
+	}
+
+	void metrics_registry::record_latency(std::size_t route_id, std::chrono::steady_clock::duration latency)
+	{
+		if (route_id >= max_routes)
+		{
+			return;
+		}
+		auto &cur_latency = local().latencies[route_id];
+		auto histogram = cur_latency.load(std::memory_order_relaxed);
+		if (!histogram)
+		{
+			histogram = new latency_histogram();
+			cur_latency.store(histogram, std::memory_order_release);
+		}
+		histogram->record(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+	}
+
+	std::uint64_t metrics_registry::get(server_metric metric) const
+	{
+		std::uint64_t result = 0;
+		for (auto cur_shard = shards_.load(std::memory_order_acquire); cur_shard; cur_shard = cur_shard->next)
+		{
+			result += cur_shard->counters[static_cast<std::size_t>(metric)].get();
+		}
+		return result;
+	}
+
+	histogram_snapshot metrics_registry::get_latency(std::size_t route_id) const
+	{
+		histogram_snapshot result;
+		result.buckets.resize(latency_histogram::bucket_count);
+		if (route_id >= max_routes)
+		{
+			return result;
+		}
+		for (auto cur_shard = shards_.load(std::memory_order_acquire); cur_shard; cur_shard = cur_shard->next)
+		{
+			auto histogram = cur_shard->latencies[route_id].load(std::memory_order_acquire);
+			if (histogram)
+			{
+				histogram->merge_into(result);
+			}
+		}
+		return result;
+	}
+
+	std::string metrics_registry::to_prometheus() const
+	{
+		std::string result;
+		for (std::size_t i = 0; i < static_cast<std::size_t>(server_metric::replies_1xx); i++)
+		{
+			result += "# TYPE ";
+			result += counter_names[i];
+			result += " counter\n";
+			result += counter_names[i];
+			result += ' ';
+			result += std::to_string(get(static_cast<server_metric>(i)));
+			result += '\n';
+		}
+		result += "# TYPE http_replies_total counter\n";
+		for (std::size_t i = 0; i < sizeof(status_class_names) / sizeof(status_class_names[0]); i++)
+		{
+			result += "http_replies_total{code=\"";
+			result += status_class_names[i];
+			result += "\"} ";
+			result += std::to_string(get(static_cast<server_metric>(static_cast<std::size_t>(server_metric::replies_1xx) + i)));
+			result += '\n';
+		}
+
+		result += "# TYPE http_request_duration_seconds histogram\n";
+		auto cur_route_count = route_count_.load(std::memory_order_acquire);
+		for (std::size_t i = 0; i < cur_route_count; i++)
+		{
+			auto snapshot = get_latency(i);
+			std::string label = "route=\"";
+			append_escaped(label, route_names_[i]);
+			label += '"';
+			for (auto one_bits : exposition_limit_bits)
+			{
+				auto limit_us = std::uint64_t(1) << one_bits;
+				result += "http_request_duration_seconds_bucket{" + label + ",le=\"";
+				append_number(result, double(limit_us) / 1e6);
+				result += "\"} ";
+				result += std::to_string(snapshot.count_below(limit_us));
+				result += '\n';
+			}
+			result += "http_request_duration_seconds_bucket{" + label + ",le=\"+Inf\"} " + std::to_string(snapshot.count) + '\n';
+			result += "http_request_duration_seconds_sum{" + label + "} ";
+			append_number(result, double(snapshot.sum_us) / 1e6);
+			result += '\n';
+			result += "http_request_duration_seconds_count{" + label + "} " + std::to_string(snapshot.count) + '\n';
+		}
+		return result;
+	}
+
+	request_handler make_metrics_handler(request_handler next, std::shared_ptr<metrics_registry> registry, const std::string &route_name)
+	{
+		auto route_id = registry->add_route(route_name);
+		return [next = std::move(next), registry, route_id](std::weak_ptr<request> weak_req, reply_handler cb)
+		{
+			auto begin_ts = std::chrono::steady_clock::now();
+			next(std::move(weak_req), [registry, route_id, begin_ts, cb = std::move(cb)](const reply &rep)
+				 {
+					 registry->record_latency(route_id, std::chrono::steady_clock::now() - begin_ts);
+					 cb(rep);
+				 });
+		};
+	}
+
+	request_handler make_metrics_endpoint_handler(std::shared_ptr<metrics_registry> registry)
+	{
+		return [registry](std::weak_ptr<request> /*weak_req*/, reply_handler cb)
+		{
+			// the scrape only reads the per thread values, request threads are never stopped for it
+			reply rep = reply::stock_reply(reply::status_type::ok);
+			rep.content = registry->to_prometheus();
+			rep.headers[0].value = std::to_string(rep.content.size());
+			rep.headers[1].value = "text/plain; version=0.0.4";
+			cb(rep);
+		};
+	}
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,384 @@
+#include "multipart.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		const char invalid_body_error[] = "invalid multipart body";
+		const char truncated_body_error[] = "multipart body ends before its closing boundary";
+
+		/// Longest boundary RFC 2046 allows.
+		constexpr std::size_t max_boundary_size = 70;
+
+		/// The value of parameter key in a header value such as form-data; name="a", unquoted.
+		/// Returns false if there is no such parameter.
+		bool find_parameter(std::string_view value, std::string_view key, std::string &result)
+		{
+			auto semicolon = value.find(';');
+			while (semicolon != std::string_view::npos)
+			{
+				value.remove_prefix(semicolon + 1);
+				auto equal = value.find_first_of("=;");
+				if (equal == std::string_view::npos || value[equal] == ';')
+				{
+					semicolon = equal;
+					continue;
+				}
+				auto name = trim_spaces(value.substr(0, equal));
+				value.remove_prefix(equal + 1);
+				value = trim_spaces(value);
+				std::string param_value;
+				if (!value.empty() && value.front() == '"')
+				{
+					std::size_t i = 1;
+					for (; i < value.size() && value[i] != '"'; i++)
+					{
+						if (value[i] == '\\' && i + 1 < value.size())
+						{
+							i++;
+						}
+						param_value += value[i];
+					}
+					value.remove_prefix(std::min(i + 1, value.size()));
+					semicolon = value.find(';');
+				}
+				else
+				{
+					semicolon = value.find(';');
+					param_value = trim_spaces(value.substr(0, semicolon));
+				}
+				if (iequals(name, key))
+				{
+					result = std::move(param_value);
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void read_multipart_piece(std::shared_ptr<body_source> body, std::shared_ptr<multipart_parser> parser, bool parsed, std::function<void(const std::string &err)> done)
+		{
+			auto &source = *body;
+			source.read([body = std::move(body), parser = std::move(parser), parsed, done = std::move(done)](const std::string &err, std::string data, bool finished) mutable
+				{
+					if (!err.empty())
+					{
+						done(err);
+						return;
+					}
+					if (!parsed)
+					{
+						auto result = parser->parse(data.data(), data.size());
+						if (result == multipart_parser::result_type::bad)
+						{
+							done(invalid_body_error);
+							return;
+						}
+						parsed = result == multipart_parser::result_type::good;
+					}
+					if (finished)
+					{
+						done(parsed ? std::string() : std::string(truncated_body_error));
+						return;
+					}
+					// the epilogue is read as well, so that the connection may carry another request
+					read_multipart_piece(std::move(body), std::move(parser), parsed, std::move(done));
+				});
+		}
+	}
+
+	std::string multipart_boundary(std::string_view content_type)
+	{
+		auto media_type = trim_spaces(content_type.substr(0, content_type.find(';')));
+		if (!iequals(media_type.substr(0, 10), "multipart/"))
+		{
+			return std::string();
+		}
+		std::string boundary;
+		if (!find_parameter(content_type, "boundary", boundary) || boundary.empty() || boundary.size() > max_boundary_size || boundary.back() == ' ')
+		{
+			return std::string();
+		}
+		for (char c : boundary)
+		{
+			if (!std::isalnum(static_cast<unsigned char>(c)) && !std::strchr("'()+_,-./:=? ", c))
+			{
+				return std::string();
+			}
+		}
+		return boundary;
+	}
+
+	multipart_parser::multipart_parser(std::string_view boundary, part_handler on_part, data_handler on_data, part_end_handler on_part_end, std::size_t max_header_size)
+		: on_part_(std::move(on_part)),
+		on_data_(std::move(on_data)),
+		on_part_end_(std::move(on_part_end)),
+		max_header_size_(max_header_size)
+	{
+		if (boundary.empty() || boundary.size() > max_boundary_size || boundary.find_first_of("\r\n") != std::string_view::npos)
+		{
+			state_ = state::failed;
+			return;
+		}
+		delimiter_ = "\r\n--";
+		delimiter_ += boundary;
+		// the first delimiter may start the body, as if a CRLF came before it
+		partial_ = "\r\n";
+		skip_.fill(delimiter_.size());
+		for (std::size_t i = 0; i + 1 < delimiter_.size(); i++)
+		{
+			skip_[static_cast<unsigned char>(delimiter_[i])] = delimiter_.size() - 1 - i;
+		}
+	}
+
+	multipart_parser::result_type multipart_parser::parse(const char *input, std::size_t len)
+	{
+		std::string_view remain(input, len);
+		while (!remain.empty())
+		{
+			switch (state_)
+			{
+			case state::preamble:
+			case state::part_data:
+				remain.remove_prefix(scan_data(remain));
+				continue;
+			case state::part_headers:
+				remain.remove_prefix(scan_headers(remain));
+				continue;
+			case state::epilogue:
+				return result_type::good;
+			case state::failed:
+				return result_type::bad;
+			default:
+				break;
+			}
+			// the rest of the delimiter line: "--" for the closing one, else optional padding and CRLF
+			char c = remain.front();
+			remain.remove_prefix(1);
+			switch (state_)
+			{
+			case state::boundary_end:
+				state_ = c == '-' ? state::close_dash : c == '\r' ? state::boundary_lf : (c == ' ' || c == '\t') ? state::boundary_padding : state::failed;
+				break;
+			case state::boundary_padding:
+				state_ = c == '\r' ? state::boundary_lf : (c == ' ' || c == '\t') ? state::boundary_padding : state::failed;
+				break;
+			case state::boundary_lf:
+				if (c != '\n')
+				{
+					state_ = state::failed;
+					break;
+				}
+				state_ = state::part_headers;
+				header_block_ = "\r\n";
+				part_ = multipart_part();
+				break;
+			case state::close_dash:
+				state_ = c == '-' ? state::epilogue : state::failed;
+				break;
+			default:
+				break;
+			}
+		}
+		switch (state_)
+		{
+		case state::epilogue:
+			return result_type::good;
+		case state::failed:
+			return result_type::bad;
+		default:
+			return result_type::indeterminate;
+		}
+	}
+
+	std::size_t multipart_parser::scan_data(std::string_view input)
+	{
+		if (!partial_.empty())
+		{
+			auto needed = delimiter_.size() - partial_.size();
+			auto compared = std::min(needed, input.size());
+			if (input.compare(0, compared, delimiter_, partial_.size(), compared) == 0)
+			{
+				if (compared < needed)
+				{
+					partial_.append(input.data(), compared);
+				}
+				else
+				{
+					partial_.clear();
+					on_delimiter();
+				}
+				return compared;
+			}
+			// only the CR at its front can start a delimiter, so none of the held back bytes do
+			std::string held_back;
+			held_back.swap(partial_);
+			emit_data(held_back);
+		}
+		auto pos = find_delimiter(input);
+		if (pos != std::string_view::npos)
+		{
+			emit_data(input.substr(0, pos));
+			on_delimiter();
+			return pos + delimiter_.size();
+		}
+		auto keep = partial_delimiter(input);
+		emit_data(input.substr(0, keep));
+		partial_.assign(input.substr(keep));
+		return input.size();
+	}
+
+	std::size_t multipart_parser::find_delimiter(std::string_view input) const
+	{
+		const auto pattern_size = delimiter_.size();
+		const auto last = static_cast<unsigned char>(delimiter_.back());
+		std::size_t pos = 0;
+		while (pos + pattern_size <= input.size())
+		{
+			auto cur = static_cast<unsigned char>(input[pos + pattern_size - 1]);
+			if (cur == last && std::memcmp(input.data() + pos, delimiter_.data(), pattern_size - 1) == 0)
+			{
+				return pos;
+			}
+			pos += skip_[cur];
+		}
+		return std::string_view::npos;
+	}
+
+	std::size_t multipart_parser::partial_delimiter(std::string_view input) const
+	{
+		auto pos = input.size() - std::min(input.size(), delimiter_.size() - 1);
+		while ((pos = input.find('\r', pos)) != std::string_view::npos)
+		{
+			if (delimiter_.compare(0, input.size() - pos, input.data() + pos, input.size() - pos) == 0)
+			{
+				return pos;
+			}
+			pos++;
+		}
+		return input.size();
+	}
+
+	void multipart_parser::emit_data(std::string_view data)
+	{
+		// the preamble is dropped
+		if (state_ == state::part_data && !data.empty() && on_data_)
+		{
+			on_data_(data);
+		}
+	}
+
+	void multipart_parser::on_delimiter()
+	{
+		if (state_ == state::part_data && on_part_end_)
+		{
+			on_part_end_();
+		}
+		state_ = state::boundary_end;
+	}
+
+	std::size_t multipart_parser::scan_headers(std::string_view input)
+	{
+		// the empty line may start in the bytes taken before, look for it across both
+		auto old_size = header_block_.size();
+		auto tail_size = std::min<std::size_t>(old_size, 3);
+		std::string joined = header_block_.substr(old_size - tail_size);
+		joined.append(input.data(), std::min<std::size_t>(input.size(), 3));
+		auto end = joined.find("\r\n\r\n");
+		std::size_t taken;
+		if (end != std::string::npos)
+		{
+			taken = end + 4 - tail_size;
+		}
+		else
+		{
+			end = input.find("\r\n\r\n");
+			taken = end == std::string_view::npos ? input.size() : end + 4;
+		}
+		if (old_size + taken > max_header_size_ + 2)
+		{
+			state_ = state::failed;
+			return input.size();
+		}
+		header_block_.append(input.data(), taken);
+		if (header_block_.size() >= 4 && header_block_.compare(header_block_.size() - 4, 4, "\r\n\r\n") == 0)
+		{
+			if (!parse_headers())
+			{
+				state_ = state::failed;
+				return input.size();
+			}
+			state_ = state::part_data;
+			if (on_part_)
+			{
+				on_part_(part_);
+			}
+		}
+		return taken;
+	}
+
+	bool multipart_parser::parse_headers()
+	{
+		// between the CRLF of the delimiter line and the empty line, every line ends with CRLF
+		std::string_view lines(header_block_);
+		lines = lines.substr(2, lines.size() - 4);
+		while (!lines.empty())
+		{
+			auto line_end = lines.find("\r\n");
+			auto line = lines.substr(0, line_end);
+			lines.remove_prefix(line.size() + 2);
+			if (line.front() == ' ' || line.front() == '\t')
+			{
+				// obsolete line folding continues the previous value
+				if (part_.headers.empty())
+				{
+					return false;
+				}
+				part_.headers.back().value += ' ';
+				part_.headers.back().value += trim_spaces(line);
+				continue;
+			}
+			auto colon = line.find(':');
+			if (colon == std::string_view::npos || colon == 0 || line.substr(0, colon).find_first_of(" \t") != std::string_view::npos)
+			{
+				return false;
+			}
+			part_.headers.push_back(header{std::string(line.substr(0, colon)), std::string(trim_spaces(line.substr(colon + 1)))});
+		}
+		if (auto disposition = find_header(part_.headers, "Content-Disposition"))
+		{
+			find_parameter(*disposition, "name", part_.name);
+			find_parameter(*disposition, "filename", part_.filename);
+		}
+		if (auto content_type = find_header(part_.headers, "Content-Type"))
+		{
+			part_.content_type = *content_type;
+		}
+		return true;
+	}
+
+	void read_multipart_body(std::shared_ptr<request> req, std::shared_ptr<multipart_parser> parser, std::function<void(const std::string &err)> done)
+	{
+		if (req->body_stream)
+		{
+			read_multipart_piece(req->body_stream, std::move(parser), false, std::move(done));
+			return;
+		}
+		switch (parser->parse(req->body.data(), req->body.size()))
+		{
+		case multipart_parser::result_type::good:
+			done(std::string());
+			break;
+		case multipart_parser::result_type::bad:
+			done(invalid_body_error);
+			break;
+		default:
+			done(truncated_body_error);
+			break;
+		}
+	}
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,97 @@
+#include "output_queue.hpp"
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		/// Written strings kept by take_spare, a reply needs about three.
+		const std::size_t max_spares = 4;
+	}
+
+	output_queue::output_queue(std::size_t max_bytes, std::size_t max_segments)
+		: max_bytes_(max_bytes ? max_bytes : 1), max_segments_(max_segments ? max_segments : 1)
+	{
+	}
+
+	void output_queue::push(std::string data)
+	{
+		if (data.empty())
+		{
+			return;
+		}
+		size_ += data.size();
+		segments_.emplace_back();
+		auto &cur_segment = segments_.back();
+		cur_segment.data = std::move(data);
+		cur_segment.buffer = asio::buffer(cur_segment.data);
+	}
+
+	void output_queue::push(std::shared_ptr<const void> owner, asio::const_buffer data)
+	{
+		if (data.size() == 0)
+		{
+			return;
+		}
+		size_ += data.size();
+		segments_.emplace_back();
+		auto &cur_segment = segments_.back();
+		cur_segment.owner = std::move(owner);
+		cur_segment.buffer = data;
+	}
+
+	const std::vector<asio::const_buffer> &output_queue::prepare()
+	{
+		prepared_.clear();
+		std::size_t total = 0;
+		for (const auto &one_segment : segments_)
+		{
+			if (prepared_.size() == max_segments_ || (total >= max_bytes_ && !prepared_.empty()))
+			{
+				break;
+			}
+			prepared_.push_back(one_segment.buffer);
+			total += one_segment.buffer.size();
+		}
+		return prepared_;
+	}
+
+	void output_queue::consume(std::size_t bytes_transferred)
+	{
+		size_ -= bytes_transferred;
+		while (bytes_transferred)
+		{
+			auto &front = segments_.front();
+			if (bytes_transferred < front.buffer.size())
+			{
+				front.buffer += bytes_transferred;
+				return;
+			}
+			bytes_transferred -= front.buffer.size();
+			if (front.data.capacity() && front.data.capacity() <= max_bytes_ && spares_.size() < max_spares)
+			{
+				front.data.clear();
+				spares_.push_back(std::move(front.data));
+			}
+			segments_.pop_front();
+		}
+	}
+
+	void output_queue::clear()
+	{
+		segments_.clear();
+		prepared_.clear();
+		size_ = 0;
+	}
+
+	std::string output_queue::take_spare()
+	{
+		if (spares_.empty())
+		{
+			return std::string();
+		}
+		auto result = std::move(spares_.back());
+		spares_.pop_back();
+		return result;
+	}
+
+} // namespace spiritsaway::http_server
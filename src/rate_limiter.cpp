@@ -0,0 +1,152 @@
+#include "rate_limiter.hpp"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		std::int64_t now_us()
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+	}
+
+	rate_limiter::rate_limiter(const rate_limit_options &options)
+		: options_(options),
+		  emission_interval_us_(std::max<std::int64_t>(1, std::int64_t(1e6 / std::max(options.requests_per_second, 1e-6)))),
+		  burst_tolerance_us_(emission_interval_us_ * std::max<std::uint32_t>(options.burst, 1)),
+		  idle_us_(std::int64_t(options.idle_seconds) * 1000000)
+	{
+		for (std::size_t i = 0; i < std::max<std::size_t>(options.shard_count, 1); i++)
+		{
+			shards_.push_back(std::make_unique<shard>());
+		}
+	}
+
+	const reply &rate_limiter::limited_reply()
+	{
+		static const reply result = []()
+		{
+			auto rep = reply::stock_reply(reply::status_type::too_many_requests);
+			rep.headers.push_back(header{"Retry-After", "1"});
+			rep.headers.push_back(header{"Connection", "close"});
+			reply prebuilt_rep;
+			prebuilt_rep.prebuilt = std::make_shared<const serialized_reply>(rep.serialize());
+			return prebuilt_rep;
+		}();
+		return result;
+	}
+
+	std::string_view rate_limiter::key_of(const request &req) const
+	{
+		if (!options_.key_header.empty())
+		{
+			auto value = find_header(req.headers, options_.key_header);
+			if (value)
+			{
+				return *value;
+			}
+		}
+		return req.remote_address;
+	}
+
+	bool rate_limiter::try_acquire(std::string_view key)
+	{
+		auto &cur_shard = *shards_[std::hash<std::string_view>()(key) % shards_.size()];
+		auto now = now_us();
+		if (now >= cur_shard.next_eviction_us.load(std::memory_order_relaxed))
+		{
+			evict_idle(cur_shard, now);
+		}
+
+		{
+			// the bucket is updated under the shared lock only so that eviction can not free it meanwhile
+			std::shared_lock<std::shared_mutex> guard(cur_shard.mutex);
+			auto iter = cur_shard.buckets.find(key);
+			if (iter != cur_shard.buckets.end())
+			{
+				return take_token(iter->second->tat_us, now);
+			}
+		}
+		std::unique_lock<std::shared_mutex> guard(cur_shard.mutex);
+		auto iter = cur_shard.buckets.find(key);
+		if (iter == cur_shard.buckets.end())
+		{
+			auto new_bucket = std::make_unique<bucket>(key);
+			std::string_view new_key(new_bucket->key);
+			iter = cur_shard.buckets.emplace(new_key, std::move(new_bucket)).first;
+		}
+		return take_token(iter->second->tat_us, now);
+	}
+
+	bool rate_limiter::take_token(std::atomic<std::int64_t> &tat, std::int64_t now) const
+	{
+		auto cur_tat = tat.load(std::memory_order_relaxed);
+		while (true)
+		{
+			auto new_tat = std::max(cur_tat, now) + emission_interval_us_;
+			if (new_tat - now > burst_tolerance_us_)
+			{
+				return false;
+			}
+			if (tat.compare_exchange_weak(cur_tat, new_tat, std::memory_order_relaxed))
+			{
+				return true;
+			}
+		}
+	}
+
+	void rate_limiter::evict_idle(shard &cur_shard, std::int64_t now)
+	{
+		auto next_eviction = cur_shard.next_eviction_us.load(std::memory_order_relaxed);
+		if (!cur_shard.next_eviction_us.compare_exchange_strong(next_eviction, now + std::max<std::int64_t>(idle_us_ / 2, 1000000), std::memory_order_relaxed))
+		{
+			return;
+		}
+		std::unique_lock<std::shared_mutex> guard(cur_shard.mutex);
+		for (auto iter = cur_shard.buckets.begin(); iter != cur_shard.buckets.end();)
+		{
+			// a bucket that has been full for idle_seconds is the same as a missing one
+			if (iter->second->tat_us.load(std::memory_order_relaxed) + idle_us_ < now)
+			{
+				iter = cur_shard.buckets.erase(iter);
+			}
+			else
+			{
+				iter++;
+			}
+		}
+	}
+
+	std::size_t rate_limiter::get_entry_count()
+	{
+		std::size_t result = 0;
+		for (auto &one_shard : shards_)
+		{
+			std::shared_lock<std::shared_mutex> guard(one_shard->mutex);
+			result += one_shard->buckets.size();
+		}
+		return result;
+	}
+
+	request_handler make_rate_limit_handler(request_handler next, std::shared_ptr<rate_limiter> limiter)
+	{
+		return [next = std::move(next), limiter](std::weak_ptr<request> weak_req, reply_handler cb)
+		{
+			auto req_ptr = weak_req.lock();
+			if (!req_ptr)
+			{
+				return;
+			}
+			if (!limiter->try_acquire(limiter->key_of(*req_ptr)))
+			{
+				cb(rate_limiter::limited_reply());
+				return;
+			}
+			next(std::move(weak_req), std::move(cb));
+		};
+	}
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,124 @@
+#include "reply_mailbox.hpp"
+#include "connection.hpp"
+
+namespace spiritsaway::http_server
+{
+	reply_mailbox::reply_mailbox(asio::io_context &io_context)
+		: io_context_(io_context),
+		  head_(&stub_),
+		  tail_(&stub_)
+	{
+	}
+
+	reply_mailbox::~reply_mailbox()
+	{
+		while (auto cur_node = pop())
+		{
+			delete cur_node;
+		}
+	}
+
+	void reply_mailbox::deliver(std::shared_ptr<connection> con, std::uint64_t request_id, reply rep)
+	{
+		auto new_node = new node();
+		new_node->con = std::move(con);
+		new_node->request_id = request_id;
+		new_node->rep = std::move(rep);
+		push(new_node);
+		schedule_drain();
+	}
+
+	void reply_mailbox::push(node *new_node)
+	{
+		new_node->next.store(nullptr, std::memory_order_relaxed);
+		auto prev = head_.exchange(new_node, std::memory_order_seq_cst);
+		// until this store the consumer sees the queue end at prev
+		prev->next.store(new_node, std::memory_order_release);
+	}
+
+	reply_mailbox::node *reply_mailbox::pop()
+	{
+		auto tail = tail_;
+		auto next = tail->next.load(std::memory_order_acquire);
+		if (tail == &stub_)
+		{
+			if (!next)
+			{
+				return nullptr;
+			}
+			tail_ = next;
+			tail = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+		if (next)
+		{
+			tail_ = next;
+			return tail;
+		}
+		if (tail != head_.load(std::memory_order_acquire))
+		{
+			return nullptr;
+		}
+		// tail is the last node, put the stub behind it so that it can be handed out
+		push(&stub_);
+		next = tail->next.load(std::memory_order_acquire);
+		if (next)
+		{
+			tail_ = next;
+			return tail;
+		}
+		return nullptr;
+	}
+
+	void reply_mailbox::schedule_drain()
+	{
+		if (!scheduled_.exchange(true, std::memory_order_seq_cst))
+		{
+			asio::post(io_context_, [this]()
+				{
+					drain();
+				});
+		}
+	}
+
+	void reply_mailbox::drain()
+	{
+		drain_count_.fetch_add(1, std::memory_order_relaxed);
+		std::size_t batch_size = 0;
+		while (batch_size < max_batch)
+		{
+			auto cur_node = pop();
+			if (!cur_node)
+			{
+				break;
+			}
+			batch_size++;
+			// runs at once unless another thread is inside the connection's strand
+			auto executor = cur_node->con->get_executor();
+			asio::dispatch(executor, [con = std::move(cur_node->con), request_id = cur_node->request_id, rep = std::move(cur_node->rep)]() mutable
+				{
+					con->deliver_reply(request_id, std::move(rep));
+				});
+			delete cur_node;
+		}
+		delivered_count_.fetch_add(batch_size, std::memory_order_relaxed);
+		if (batch_size == max_batch)
+		{
+			// still the only consumer, let other handlers run before the rest
+			asio::post(io_context_, [this]()
+				{
+					drain();
+				});
+			return;
+		}
+		// tail_ belongs to the next drain once scheduled_ is cleared, so compare with a copy
+		auto last_tail = tail_;
+		scheduled_.store(false, std::memory_order_seq_cst);
+		// a push that still saw the drain scheduled relies on this check
+		if (head_.load(std::memory_order_seq_cst) != last_tail)
+		{
+			schedule_drain();
+		}
+	}
+
+} // namespace spiritsaway::http_server
@@ -16,19 +16,33 @@ namespace spiritsaway::http_server
         {
             auto& t = *reinterpret_cast<reply_parser*>(parser->data);
 
-            t.m_reply.status = std::string(at, length);
+            t.m_status_reason.append(at, length);
             return 0;
         }
         int on_body_cb(http_parser *parser, const char *at, std::size_t length)
         {
             auto &t = *reinterpret_cast<reply_parser *>(parser->data);
 
-            t.m_reply.content.append(at, length);
+            if (t.m_stream_body)
+            {
+                t.m_pending_body.append(at, length);
+            }
+            else
+            {
+                t.m_reply.content.append(at, length);
+            }
             return 0;
         }
         int on_header_field_cb(http_parser *parser, const char *at, std::size_t length)
         {
             auto &t = *reinterpret_cast<reply_parser *>(parser->data);
+            // a field split over two reads comes in two calls
+            if (t.m_last_was_field)
+            {
+                t.m_reply.headers.back().name.append(at, length);
+                return 0;
+            }
+            t.m_last_was_field = true;
             header temp_header;
             temp_header.name = std::string(at, length);
             t.m_reply.headers.push_back(temp_header);
@@ -38,12 +52,17 @@ namespace spiritsaway::http_server
         {
             auto &t = *reinterpret_cast<reply_parser *>(parser->data);
 
-            t.m_reply.headers.back().value = std::string(at, length);
+            t.m_last_was_field = false;
+            t.m_reply.headers.back().value.append(at, length);
             return 0;
         }
         int on_header_complete_cb(http_parser *parser)
         {
-            return 0;
+            auto &t = *reinterpret_cast<reply_parser *>(parser->data);
+            t.m_reply.status = "HTTP/" + std::to_string(parser->http_major) + "." + std::to_string(parser->http_minor) + " " + std::to_string(parser->status_code) + " " + t.m_status_reason + "\r\n";
+            t.m_headers_complete = true;
+            // returning 1 tells http_parser that the reply has no body
+            return t.m_skip_body ? 1 : 0;
         }
         int on_message_complete_cb(http_parser *parser)
         {
@@ -69,11 +88,30 @@ namespace spiritsaway::http_server
     reply_parser::result_type reply_parser::parse(const char *input, std::size_t len)
     {
         std::size_t nparsed = http_parser_execute(&m_parser, &m_parser_settings, input, len);
+        return check_result(nparsed, len);
+    }
+    reply_parser::result_type reply_parser::finish()
+    {
+        if (m_reply_complete)
+        {
+            return reply_parser::result_type::good;
+        }
+        std::size_t nparsed = http_parser_execute(&m_parser, &m_parser_settings, nullptr, 0);
+        auto result = check_result(nparsed, 0);
+        if (result == reply_parser::result_type::indeterminate)
+        {
+            // the peer closed in the middle of a reply
+            return reply_parser::result_type::bad;
+        }
+        return result;
+    }
+    reply_parser::result_type reply_parser::check_result(std::size_t nparsed, std::size_t len)
+    {
         if (m_parser.upgrade)
         {
             return reply_parser::result_type::bad;
         }
-        if (nparsed != len)
+        if (nparsed != len || HTTP_PARSER_ERRNO(&m_parser) != HPE_OK)
         {
             std::cout << http_errno_name(http_errno(m_parser.http_errno)) << std::endl;
             return reply_parser::result_type::bad;
@@ -82,10 +120,30 @@ namespace spiritsaway::http_server
         {
             return reply_parser::result_type::good;
         }
-        else
+        if (m_stream_body && m_headers_complete && !m_headers_reported)
         {
-            return reply_parser::result_type::indeterminate;
+            m_headers_reported = true;
+            return reply_parser::result_type::headers_ready;
         }
+        return reply_parser::result_type::indeterminate;
+    }
+    void reply_parser::set_stream_body(bool enabled)
+    {
+        m_stream_body = enabled;
+    }
+    void reply_parser::set_skip_body(bool skip)
+    {
+        m_skip_body = skip;
+    }
+    bool reply_parser::should_keep_alive() const
+    {
+        return http_should_keep_alive(&m_parser) != 0;
+    }
+    std::string reply_parser::take_body()
+    {
+        std::string result;
+        result.swap(m_pending_body);
+        return result;
     }
 
 } // namespace spiritsaway::http_server
@@ -0,0 +1,127 @@
+#include "request_coalescer.hpp"
+
+namespace spiritsaway::http_server
+{
+	request_coalescer::request_coalescer(request_handler next, const coalescing_options &options)
+		: next_(std::move(next)), options_(options)
+	{
+	}
+
+	bool request_coalescer::is_coalescable(const request &req)
+	{
+		if (req.method != "GET" && req.method != "HEAD")
+		{
+			return false;
+		}
+		// an upgrade gets a connection of its own, e.g. WebSocket or h2c
+		if (!req.body.empty() || req.body_stream || find_header(req.headers, "Upgrade"))
+		{
+			return false;
+		}
+		// replies to credentialed requests may differ per user
+		return !find_header(req.headers, "Authorization") && !find_header(req.headers, "Cookie");
+	}
+
+	std::string request_coalescer::make_key(const request &req) const
+	{
+		std::string key = req.method;
+		key += ' ';
+		key += req.uri;
+		for (const auto &one_name : options_.key_headers)
+		{
+			key += '\n';
+			auto value = find_header(req.headers, one_name);
+			if (value)
+			{
+				key += *value;
+			}
+		}
+		return key;
+	}
+
+	void request_coalescer::handle_request(std::weak_ptr<request> weak_req, reply_handler cb)
+	{
+		auto req_ptr = weak_req.lock();
+		if (!req_ptr)
+		{
+			return;
+		}
+		if (!is_coalescable(*req_ptr))
+		{
+			next_(weak_req, std::move(cb));
+			return;
+		}
+		auto key = make_key(*req_ptr);
+		std::shared_ptr<flight> cur_flight;
+		{
+			std::lock_guard<std::mutex> guard(flight_mutex_);
+			auto iter = flights_.find(key);
+			if (iter != flights_.end())
+			{
+				iter->second->waiters.push_back(waiter{weak_req, std::move(cb)});
+				coalesced_count_.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			cur_flight = std::make_shared<flight>();
+			cur_flight->waiters.push_back(waiter{weak_req, std::move(cb)});
+			flights_.emplace(key, cur_flight);
+		}
+		invoke_count_.fetch_add(1, std::memory_order_relaxed);
+
+		// the handler gets its own copy of the request, the connection that started the
+		// flight may close while the other waiters still need the reply
+		auto flight_req = std::make_shared<request>(*req_ptr);
+		next_(flight_req, [self = shared_from_this(), flight_req, key = std::move(key), cur_flight](const reply &rep)
+			  { self->on_reply(key, cur_flight, rep); });
+	}
+
+	void request_coalescer::on_reply(const std::string &key, const std::shared_ptr<flight> &cur_flight, const reply &rep)
+	{
+		{
+			std::lock_guard<std::mutex> guard(flight_mutex_);
+			auto iter = flights_.find(key);
+			// a handler that replies twice must not complete a later flight of the same key
+			if (iter == flights_.end() || iter->second != cur_flight)
+			{
+				return;
+			}
+			flights_.erase(iter);
+		}
+		auto &waiters = cur_flight->waiters;
+		if (waiters.size() == 1)
+		{
+			waiters[0].cb(rep);
+			return;
+		}
+		if (rep.body_stream || rep.websocket)
+		{
+			// a body read once or a protocol switch belongs to one connection, the other
+			// waiters get replies of their own
+			waiters[0].cb(rep);
+			for (std::size_t i = 1; i < waiters.size(); i++)
+			{
+				if (!waiters[i].req.expired())
+				{
+					next_(std::move(waiters[i].req), std::move(waiters[i].cb));
+				}
+			}
+			return;
+		}
+		reply shared_rep;
+		shared_rep.prebuilt = std::make_shared<const serialized_reply>(rep.serialize());
+		for (auto &one_waiter : waiters)
+		{
+			one_waiter.cb(shared_rep);
+		}
+	}
+
+	request_handler make_coalescing_handler(request_handler next, const coalescing_options &options)
+	{
+		auto coalescer = std::make_shared<request_coalescer>(std::move(next), options);
+		return [coalescer](std::weak_ptr<request> weak_req, reply_handler cb)
+		{
+			coalescer->handle_request(std::move(weak_req), std::move(cb));
+		};
+	}
+
+} // namespace spiritsaway::http_server
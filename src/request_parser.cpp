@@ -1,4 +1,5 @@
 #include "request_parser.hpp"
+#include <climits>
 
 namespace spiritsaway::http_server
 {
@@ -14,12 +15,26 @@ namespace spiritsaway::http_server
         {
             auto &t = *reinterpret_cast<request_parser *>(parser->data);
 
-            t.req_.body.append(at, length);
+            if (t.body_streamed_)
+            {
+                t.pending_body_.append(at, length);
+            }
+            else
+            {
+                t.req_.body.append(at, length);
+            }
             return 0;
         }
         int on_header_field_cb(http_parser *parser, const char *at, std::size_t length)
         {
             auto &t = *reinterpret_cast<request_parser *>(parser->data);
+            // a field split over two reads comes in two calls
+            if (t.last_was_field_)
+            {
+                t.req_.headers.back().name.append(at, length);
+                return 0;
+            }
+            t.last_was_field_ = true;
             header temp_header;
             temp_header.name = std::string(at, length);
             t.req_.headers.push_back(temp_header);
@@ -29,17 +44,31 @@ namespace spiritsaway::http_server
         {
             auto &t = *reinterpret_cast<request_parser *>(parser->data);
 
-            t.req_.headers.back().value = std::string(at, length);
+            t.last_was_field_ = false;
+            t.req_.headers.back().value.append(at, length);
             return 0;
         }
         int on_header_complete_cb(http_parser *parser)
         {
+            auto &t = *reinterpret_cast<request_parser *>(parser->data);
+            t.req_.method = http_method_str(http_method(parser->method));
+            t.req_.http_version_major = parser->http_major;
+            t.req_.http_version_minor = parser->http_minor;
+            t.headers_complete_ = true;
+            t.keep_alive_ = http_should_keep_alive(parser) != 0;
+            if (t.stream_body_enabled_)
+            {
+                bool chunked = (parser->flags & F_CHUNKED) != 0;
+                t.body_streamed_ = chunked || (parser->content_length != ULLONG_MAX && parser->content_length > t.stream_body_threshold_);
+            }
             return 0;
         }
         int on_message_complete_cb(http_parser *parser)
         {
             auto &t = *reinterpret_cast<request_parser *>(parser->data);
             t.req_complete_ = true;
+            // stop at the end of the message, the bytes after it belong to the next request
+            http_parser_pause(parser, 1);
             return 0;
         }
     } // namespace
@@ -58,11 +87,11 @@ namespace spiritsaway::http_server
     request_parser::result_type request_parser::parse(const char *input, std::size_t len)
     {
         std::size_t nparsed = http_parser_execute(&parser_, &parse_settings_, input, len);
-        if (parser_.upgrade)
+        if (HTTP_PARSER_ERRNO(&parser_) == HPE_PAUSED)
         {
-            return request_parser::result_type::bad;
+            pending_input_.append(input + nparsed, len - nparsed);
         }
-        if (nparsed != len)
+        else if (nparsed != len)
         {
             return request_parser::result_type::bad;
         }
@@ -70,14 +99,67 @@ namespace spiritsaway::http_server
         {
             return request_parser::result_type::good;
         }
+        if (body_streamed_ && !headers_reported_)
+        {
+            headers_reported_ = true;
+            return request_parser::result_type::headers_ready;
+        }
         else
         {
             return request_parser::result_type::indeterminate;
         }
     }
+    void request_parser::set_stream_body(bool enabled, std::size_t threshold)
+    {
+        stream_body_enabled_ = enabled;
+        stream_body_threshold_ = threshold;
+    }
+    std::string request_parser::take_body()
+    {
+        std::string result;
+        result.swap(pending_body_);
+        return result;
+    }
     void request_parser::move_req(request &dest)
     {
         dest = std::move(req_);
     }
+    void request_parser::reset()
+    {
+        next_message();
+        pending_input_.clear();
+    }
+    void request_parser::next_message()
+    {
+        http_parser_init(&parser_, http_parser_type::HTTP_REQUEST);
+        parser_.data = reinterpret_cast<void *>(this);
+        req_ = request();
+        req_complete_ = false;
+        headers_complete_ = false;
+        headers_reported_ = false;
+        body_streamed_ = false;
+        keep_alive_ = false;
+        last_was_field_ = false;
+        pending_body_.clear();
+    }
+    std::string request_parser::take_pending_input()
+    {
+        std::string result;
+        result.swap(pending_input_);
+        return result;
+    }
+    request_parser::result_type request_parser::parse_pending_input()
+    {
+        std::string input;
+        input.swap(pending_input_);
+        auto result = parse(input.data(), input.size());
+        if (pending_input_.empty())
+        {
+            // keep the capacity for the next leftover
+            input.clear();
+            pending_input_.swap(input);
+        }
+        return result;
+    }
 
 } // namespace spiritsaway::http_server
@@ -0,0 +1,448 @@
+#include "response_cache.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		/// Bookkeeping overhead charged to every entry and variant on top of their strings.
+		const std::size_t entry_overhead = 128;
+
+		/// Call visitor with every trimmed element of a comma separated header value.
+		template <typename T>
+		void for_each_element(std::string_view value, T visitor)
+		{
+			while (!value.empty())
+			{
+				auto comma_pos = value.find(',');
+				auto element = trim_spaces(value.substr(0, comma_pos));
+				value.remove_prefix(comma_pos == std::string_view::npos ? value.size() : comma_pos + 1);
+				if (!element.empty())
+				{
+					visitor(element);
+				}
+			}
+		}
+
+		struct cache_control
+		{
+			bool no_store = false;
+			bool no_cache = false;
+			bool is_private = false;
+			int max_age = -1;
+			int shared_max_age = -1;
+			int stale_while_revalidate = 0;
+		};
+
+		int parse_seconds(std::string_view value)
+		{
+			std::string temp(trim_spaces(value));
+			if (!temp.empty() && temp.front() == '"')
+			{
+				temp.erase(0, 1);
+			}
+			return std::max(0, std::atoi(temp.c_str()));
+		}
+
+		cache_control parse_cache_control(const std::vector<header> &headers)
+		{
+			cache_control result;
+			for (const auto &one_header : headers)
+			{
+				if (!iequals(one_header.name, "Cache-Control"))
+				{
+					continue;
+				}
+				for_each_element(one_header.value, [&result](std::string_view element)
+								 {
+									 auto eq_pos = element.find('=');
+									 auto name = trim_spaces(element.substr(0, eq_pos));
+									 auto value = eq_pos == std::string_view::npos ? std::string_view() : element.substr(eq_pos + 1);
+									 if (iequals(name, "no-store"))
+									 {
+										 result.no_store = true;
+									 }
+									 else if (iequals(name, "no-cache"))
+									 {
+										 result.no_cache = true;
+									 }
+									 else if (iequals(name, "private"))
+									 {
+										 result.is_private = true;
+									 }
+									 else if (iequals(name, "max-age"))
+									 {
+										 result.max_age = parse_seconds(value);
+									 }
+									 else if (iequals(name, "s-maxage"))
+									 {
+										 result.shared_max_age = parse_seconds(value);
+									 }
+									 else if (iequals(name, "stale-while-revalidate"))
+									 {
+										 result.stale_while_revalidate = parse_seconds(value);
+									 }
+								 });
+			}
+			return result;
+		}
+
+		bool is_cacheable_status(int status_code)
+		{
+			switch (status_code)
+			{
+			case 200:
+			case 203:
+			case 204:
+			case 300:
+			case 301:
+			case 404:
+			case 410:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		std::string to_lower(std::string_view value)
+		{
+			std::string result(value);
+			for (auto &c : result)
+			{
+				c = char(std::tolower(static_cast<unsigned char>(c)));
+			}
+			return result;
+		}
+	} // namespace
+
+	response_cache::response_cache(const response_cache_options &options)
+		: options_(options), shard_memory_(options.max_memory / std::max<std::size_t>(options.shard_count, 1))
+	{
+		for (std::size_t i = 0; i < std::max<std::size_t>(options.shard_count, 1); i++)
+		{
+			shards_.push_back(std::make_unique<shard>());
+		}
+	}
+
+	bool response_cache::is_cacheable_request(const request &req)
+	{
+		return req.method == "GET" && !find_header(req.headers, "Authorization");
+	}
+
+	std::string response_cache::make_key(const request &req)
+	{
+		std::string key;
+		key.reserve(req.method.size() + req.uri.size() + 1);
+		key += req.method;
+		key += ' ';
+		key += req.uri;
+		return key;
+	}
+
+	std::string response_cache::make_vary_key(const request &req, const std::vector<std::string> &vary_names)
+	{
+		std::string result;
+		for (const auto &one_name : vary_names)
+		{
+			auto value = find_header(req.headers, one_name);
+			if (value)
+			{
+				result += *value;
+			}
+			result += '\n';
+		}
+		return result;
+	}
+
+	std::size_t response_cache::memory_of(const variant &cur_variant)
+	{
+		return cur_variant.vary_key.size() + cur_variant.buffer->status_line.size() + cur_variant.buffer->remain.size() + entry_overhead;
+	}
+
+	response_cache::shard &response_cache::shard_for(const std::string &key)
+	{
+		return *shards_[std::hash<std::string>()(key) % shards_.size()];
+	}
+
+	response_cache::lookup_result response_cache::lookup(const request &req, std::shared_ptr<const serialized_reply> &result)
+	{
+		auto req_control = parse_cache_control(req.headers);
+		auto pragma = find_header(req.headers, "Pragma");
+		if (req_control.no_cache || req_control.no_store || (pragma && iequals(trim_spaces(*pragma), "no-cache")))
+		{
+			misses_++;
+			return lookup_result::miss;
+		}
+		auto key = make_key(req);
+		auto &cur_shard = shard_for(key);
+		auto now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> guard(cur_shard.mutex);
+		auto iter = cur_shard.index.find(key);
+		if (iter == cur_shard.index.end())
+		{
+			misses_++;
+			return lookup_result::miss;
+		}
+		auto &cur_entry = *iter->second;
+		auto vary_key = make_vary_key(req, cur_entry.vary_names);
+		for (auto variant_iter = cur_entry.variants.begin(); variant_iter != cur_entry.variants.end(); ++variant_iter)
+		{
+			auto &one_variant = *variant_iter;
+			if (one_variant.vary_key != vary_key)
+			{
+				continue;
+			}
+			if (now >= one_variant.stale_until)
+			{
+				erase_variant(cur_shard, cur_entry, variant_iter);
+				break;
+			}
+			cur_shard.lru.splice(cur_shard.lru.begin(), cur_shard.lru, iter->second);
+			result = one_variant.buffer;
+			if (now < one_variant.fresh_until)
+			{
+				hits_++;
+				return lookup_result::fresh;
+			}
+			stale_hits_++;
+			if (one_variant.revalidating)
+			{
+				return lookup_result::stale;
+			}
+			one_variant.revalidating = true;
+			return lookup_result::stale_revalidate;
+		}
+		misses_++;
+		return lookup_result::miss;
+	}
+
+	std::shared_ptr<const serialized_reply> response_cache::store(const request &req, const reply &rep)
+	{
+		if (!is_cacheable_request(req) || !is_cacheable_status(rep.get_status_code()))
+		{
+			return {};
+		}
+		// serialize would keep only the head of a streamed body or a protocol switch
+		if (rep.body_stream || rep.websocket)
+		{
+			return {};
+		}
+		auto control = parse_cache_control(rep.headers);
+		int max_age = control.shared_max_age >= 0 ? control.shared_max_age : control.max_age;
+		if (control.no_store || control.no_cache || control.is_private || max_age <= 0)
+		{
+			return {};
+		}
+		if (find_header(rep.headers, "Set-Cookie"))
+		{
+			return {};
+		}
+		std::vector<std::string> vary_names;
+		bool vary_all = false;
+		for (const auto &one_header : rep.headers)
+		{
+			if (!iequals(one_header.name, "Vary"))
+			{
+				continue;
+			}
+			for_each_element(one_header.value, [&vary_names, &vary_all](std::string_view element)
+							 {
+								 if (element == "*")
+								 {
+									 vary_all = true;
+								 }
+								 vary_names.push_back(to_lower(element));
+							 });
+		}
+		if (vary_all)
+		{
+			return {};
+		}
+		std::sort(vary_names.begin(), vary_names.end());
+		vary_names.erase(std::unique(vary_names.begin(), vary_names.end()), vary_names.end());
+
+		auto buffer = std::make_shared<const serialized_reply>(rep.serialize());
+		auto key = make_key(req);
+		variant new_variant;
+		new_variant.vary_key = make_vary_key(req, vary_names);
+		new_variant.buffer = buffer;
+		new_variant.fresh_until = std::chrono::steady_clock::now() + std::chrono::seconds(max_age);
+		new_variant.stale_until = new_variant.fresh_until + std::chrono::seconds(control.stale_while_revalidate);
+		auto variant_memory = memory_of(new_variant);
+		if (variant_memory + key.size() + entry_overhead > std::min(options_.max_entry_size, shard_memory_))
+		{
+			return {};
+		}
+
+		auto &cur_shard = shard_for(key);
+		std::lock_guard<std::mutex> guard(cur_shard.mutex);
+		auto iter = cur_shard.index.find(key);
+		if (iter == cur_shard.index.end())
+		{
+			entry new_entry;
+			new_entry.key = key;
+			new_entry.memory = key.size() + entry_overhead;
+			cur_shard.lru.push_front(std::move(new_entry));
+			cur_shard.memory += cur_shard.lru.front().memory;
+			iter = cur_shard.index.emplace(key, cur_shard.lru.begin()).first;
+		}
+		else
+		{
+			cur_shard.lru.splice(cur_shard.lru.begin(), cur_shard.lru, iter->second);
+		}
+		auto &cur_entry = *iter->second;
+		if (cur_entry.vary_names != vary_names)
+		{
+			// the selecting headers changed, the old variants are keyed by other headers
+			for (const auto &one_variant : cur_entry.variants)
+			{
+				auto old_memory = memory_of(one_variant);
+				cur_entry.memory -= old_memory;
+				cur_shard.memory -= old_memory;
+			}
+			cur_entry.variants.clear();
+			cur_entry.vary_names = std::move(vary_names);
+		}
+		// drop the variant being replaced and the expired ones, then the oldest beyond the limit
+		auto now = std::chrono::steady_clock::now();
+		for (auto variant_iter = cur_entry.variants.begin(); variant_iter != cur_entry.variants.end();)
+		{
+			if (variant_iter->vary_key == new_variant.vary_key || now >= variant_iter->stale_until)
+			{
+				variant_iter = erase_variant(cur_shard, cur_entry, variant_iter);
+			}
+			else
+			{
+				++variant_iter;
+			}
+		}
+		while (!cur_entry.variants.empty() && cur_entry.variants.size() >= std::max<std::size_t>(options_.max_variants, 1))
+		{
+			erase_variant(cur_shard, cur_entry, cur_entry.variants.begin());
+		}
+		cur_entry.variants.push_back(std::move(new_variant));
+		cur_entry.memory += variant_memory;
+		cur_shard.memory += variant_memory;
+		stores_++;
+		evict(cur_shard);
+		return buffer;
+	}
+
+	void response_cache::abort_revalidate(const request &req)
+	{
+		auto key = make_key(req);
+		auto &cur_shard = shard_for(key);
+		std::lock_guard<std::mutex> guard(cur_shard.mutex);
+		auto iter = cur_shard.index.find(key);
+		if (iter == cur_shard.index.end())
+		{
+			return;
+		}
+		auto vary_key = make_vary_key(req, iter->second->vary_names);
+		for (auto &one_variant : iter->second->variants)
+		{
+			if (one_variant.vary_key == vary_key)
+			{
+				one_variant.revalidating = false;
+			}
+		}
+	}
+
+	void response_cache::evict(shard &cur_shard)
+	{
+		// the entry just stored is at the front and goes last, but it goes if it is over the limit alone
+		while (cur_shard.memory > shard_memory_ && !cur_shard.lru.empty())
+		{
+			auto &victim = cur_shard.lru.back();
+			cur_shard.memory -= victim.memory;
+			cur_shard.index.erase(victim.key);
+			cur_shard.lru.pop_back();
+			evictions_++;
+		}
+	}
+
+	std::vector<response_cache::variant>::iterator response_cache::erase_variant(shard &cur_shard, entry &cur_entry, std::vector<variant>::iterator variant_iter)
+	{
+		auto old_memory = memory_of(*variant_iter);
+		cur_entry.memory -= old_memory;
+		cur_shard.memory -= old_memory;
+		return cur_entry.variants.erase(variant_iter);
+	}
+
+	response_cache::statistics response_cache::get_statistics()
+	{
+		statistics result;
+		result.hits = hits_.load();
+		result.stale_hits = stale_hits_.load();
+		result.misses = misses_.load();
+		result.stores = stores_.load();
+		result.evictions = evictions_.load();
+		result.memory = 0;
+		result.entry_count = 0;
+		for (auto &one_shard : shards_)
+		{
+			std::lock_guard<std::mutex> guard(one_shard->mutex);
+			result.memory += one_shard->memory;
+			result.entry_count += one_shard->lru.size();
+		}
+		return result;
+	}
+
+	request_handler make_cache_handler(request_handler next, std::shared_ptr<response_cache> cache)
+	{
+		return [next = std::move(next), cache](std::weak_ptr<request> weak_req, reply_handler cb)
+		{
+			auto req_ptr = weak_req.lock();
+			if (!req_ptr)
+			{
+				return;
+			}
+			if (!response_cache::is_cacheable_request(*req_ptr))
+			{
+				next(weak_req, std::move(cb));
+				return;
+			}
+			std::shared_ptr<const serialized_reply> cached_buffer;
+			auto result = cache->lookup(*req_ptr, cached_buffer);
+			if (result != response_cache::lookup_result::miss)
+			{
+				reply cached_rep;
+				cached_rep.prebuilt = std::move(cached_buffer);
+				cb(cached_rep);
+				if (result == response_cache::lookup_result::stale_revalidate)
+				{
+					// the copy of the request lives until the refreshed reply arrives
+					auto revalidate_req = std::make_shared<request>(*req_ptr);
+					next(revalidate_req, [cache, revalidate_req](const reply &rep)
+						 {
+							 if (!cache->store(*revalidate_req, rep))
+							 {
+								 cache->abort_revalidate(*revalidate_req);
+							 }
+						 });
+				}
+				return;
+			}
+			next(weak_req, [cache, weak_req, cb = std::move(cb)](const reply &rep)
+				 {
+					 std::shared_ptr<const serialized_reply> stored_buffer;
+					 auto req_ptr = weak_req.lock();
+					 if (req_ptr)
+					 {
+						 stored_buffer = cache->store(*req_ptr, rep);
+					 }
+					 if (!stored_buffer)
+					 {
+						 cb(rep);
+						 return;
+					 }
+					 reply cached_rep;
+					 cached_rep.prebuilt = std::move(stored_buffer);
+					 cb(cached_rep);
+				 });
+		};
+	}
+
+} // namespace spiritsaway::http_server
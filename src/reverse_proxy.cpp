@@ -0,0 +1,137 @@
+#include "reverse_proxy.hpp"
+#include <algorithm>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		const char *const hop_by_hop_names[] = {
+			"Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate", "Proxy-Authorization",
+			"TE", "Trailer", "Transfer-Encoding", "Upgrade"};
+
+		void append_header_value(std::vector<header> &headers, std::string_view name, const std::string &value)
+		{
+			auto cur_value = find_header(headers, name);
+			if (cur_value)
+			{
+				set_header(headers, name, *cur_value + ", " + value);
+			}
+			else
+			{
+				set_header(headers, name, value);
+			}
+		}
+	}
+
+	void strip_hop_by_hop_headers(std::vector<header> &headers)
+	{
+		// tokens of the Connection headers name further per-connection headers
+		std::vector<std::string> connection_tokens;
+		for (const auto &one_header : headers)
+		{
+			if (!iequals(one_header.name, "Connection"))
+			{
+				continue;
+			}
+			std::string_view value(one_header.value);
+			while (!value.empty())
+			{
+				auto comma_pos = value.find(',');
+				auto token = trim_spaces(value.substr(0, comma_pos));
+				value.remove_prefix(comma_pos == std::string_view::npos ? value.size() : comma_pos + 1);
+				if (!token.empty())
+				{
+					connection_tokens.emplace_back(token);
+				}
+			}
+		}
+		headers.erase(std::remove_if(headers.begin(), headers.end(), [&connection_tokens](const header &one_header)
+									 {
+										 for (auto one_name : hop_by_hop_names)
+										 {
+											 if (iequals(one_header.name, one_name))
+											 {
+												 return true;
+											 }
+										 }
+										 for (const auto &one_token : connection_tokens)
+										 {
+											 if (iequals(one_header.name, one_token))
+											 {
+												 return true;
+											 }
+										 }
+										 return false;
+									 }),
+					  headers.end());
+	}
+
+	request_handler make_proxy_handler(asio::io_context &io_context, const proxy_options &options)
+	{
+		upstream_group_options group_options;
+		group_options.max_idle_per_host = options.max_idle_per_host;
+		group_options.idle_timeout_seconds = options.idle_timeout_seconds;
+		auto group = std::make_shared<upstream_group>(io_context, std::vector<upstream_endpoint>{{options.upstream_host, options.upstream_port}}, group_options);
+		return make_proxy_handler(std::move(group), options);
+	}
+
+	request_handler make_proxy_handler(std::shared_ptr<upstream_group> group, const proxy_options &options)
+	{
+		auto shared_options = std::make_shared<const proxy_options>(options);
+		return [group, shared_options](std::weak_ptr<request> weak_req, reply_handler cb)
+		{
+			auto req_ptr = weak_req.lock();
+			if (!req_ptr)
+			{
+				return;
+			}
+			const auto &options = *shared_options;
+			request upstream_req;
+			upstream_req.method = req_ptr->method;
+			upstream_req.uri = req_ptr->uri;
+			upstream_req.http_version_major = 1;
+			upstream_req.http_version_minor = 1;
+			upstream_req.headers = req_ptr->headers;
+			// the body is only needed by the upstream request, moving it avoids holding it twice
+			upstream_req.body = std::move(req_ptr->body);
+			upstream_req.body_stream = req_ptr->body_stream;
+			strip_hop_by_hop_headers(upstream_req.headers);
+			auto original_host = find_header(req_ptr->headers, "Host");
+			if (original_host)
+			{
+				set_header(upstream_req.headers, "X-Forwarded-Host", *original_host);
+			}
+			if (!options.via.empty())
+			{
+				append_header_value(upstream_req.headers, "Via", options.via);
+			}
+			std::string_view key = req_ptr->uri;
+			if (!options.hash_key_header.empty())
+			{
+				auto key_value = find_header(req_ptr->headers, options.hash_key_header);
+				if (key_value)
+				{
+					key = *key_value;
+				}
+			}
+
+			group->send_request(upstream_req, key, [cb, shared_options](const std::string &err, const reply &rep)
+								{
+									if (!err.empty())
+									{
+										cb(reply::stock_reply(err == "timeout" ? reply::status_type::gateway_timeout : reply::status_type::bad_gateway));
+										return;
+									}
+									reply downstream_rep = rep;
+									strip_hop_by_hop_headers(downstream_rep.headers);
+									if (!shared_options->via.empty())
+									{
+										append_header_value(downstream_rep.headers, "Via", shared_options->via);
+									}
+									cb(downstream_rep);
+								},
+								options.timeout_seconds, options.stream_reply);
+		};
+	}
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,85 @@
+#include "socket_options.hpp"
+
+#if !defined(_WIN32)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		template <typename Socket>
+		void set_int_option(Socket &socket, int level, int name, int value)
+		{
+#if !defined(_WIN32)
+			::setsockopt(socket.native_handle(), level, name, &value, sizeof(value));
+#endif
+		}
+
+		template <typename Socket>
+		void apply_buffer_sizes(Socket &socket, const socket_options &options)
+		{
+			asio::error_code ignored_ec;
+			if (options.send_buffer_size)
+			{
+				socket.set_option(asio::socket_base::send_buffer_size(int(options.send_buffer_size)), ignored_ec);
+			}
+			if (options.receive_buffer_size)
+			{
+				socket.set_option(asio::socket_base::receive_buffer_size(int(options.receive_buffer_size)), ignored_ec);
+			}
+		}
+	}
+
+	void apply_listener_options(asio::ip::tcp::acceptor &acceptor, const socket_options &options)
+	{
+		apply_buffer_sizes(acceptor, options);
+#if defined(TCP_DEFER_ACCEPT)
+		if (options.defer_accept_seconds)
+		{
+			set_int_option(acceptor, IPPROTO_TCP, TCP_DEFER_ACCEPT, int(options.defer_accept_seconds));
+		}
+#endif
+#if defined(TCP_FASTOPEN)
+		if (options.fast_open_queue)
+		{
+			set_int_option(acceptor, IPPROTO_TCP, TCP_FASTOPEN, int(options.fast_open_queue));
+		}
+#endif
+	}
+
+	void apply_socket_options(asio::ip::tcp::socket &socket, const socket_options &options, bool client)
+	{
+		asio::error_code ignored_ec;
+		if (options.no_delay)
+		{
+			socket.set_option(asio::ip::tcp::no_delay(true), ignored_ec);
+		}
+		if (client)
+		{
+			// accepted sockets inherit the buffer sizes of the listener
+			apply_buffer_sizes(socket, options);
+#if defined(TCP_FASTOPEN_CONNECT)
+			if (options.fast_open_queue)
+			{
+				set_int_option(socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+			}
+#endif
+		}
+#if defined(TCP_QUICKACK)
+		if (options.quick_ack)
+		{
+			set_int_option(socket, IPPROTO_TCP, TCP_QUICKACK, 1);
+		}
+#endif
+#if defined(SO_BUSY_POLL)
+		if (options.busy_poll_us)
+		{
+			set_int_option(socket, SOL_SOCKET, SO_BUSY_POLL, int(options.busy_poll_us));
+		}
+#endif
+	}
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,283 @@
+#include "sse_channel.hpp"
+#include <deque>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		const char slow_subscriber_error[] = "subscriber too slow";
+	}
+
+	/// The body of one subscriber's reply. Events wait in its queue until the connection
+	/// reads them, or go straight to a read that is already waiting.
+	class sse_channel::subscriber : public body_source
+	{
+	public:
+		enum class push_result
+		{
+			queued,
+			dropped,
+			disconnected
+		};
+
+		bool shares_pieces() const override
+		{
+			return true;
+		}
+
+		void read(read_handler cb) override
+		{
+			// only readers that wrap the stream get here, e.g. a compressing handler
+			read_shared([cb = std::move(cb)](const std::string &err, std::shared_ptr<const std::string> data, bool finished)
+				{
+					cb(err, data ? *data : std::string(), finished);
+				});
+		}
+
+		void read_shared(shared_read_handler cb) override
+		{
+			std::unique_lock<std::mutex> guard(mutex_);
+			if (disconnected_)
+			{
+				guard.unlock();
+				cb(slow_subscriber_error, nullptr, false);
+				return;
+			}
+			if (!events_.empty())
+			{
+				auto event = std::move(events_.front());
+				events_.pop_front();
+				guard.unlock();
+				cb(std::string(), std::move(event), false);
+				return;
+			}
+			if (closed_)
+			{
+				guard.unlock();
+				cb(std::string(), nullptr, true);
+				return;
+			}
+			waiting_read_ = std::move(cb);
+		}
+
+		/// Queue event, or move the waiting read into ready so that the caller can give it
+		/// the event once no lock is held.
+		push_result push(const sse_event &event, const sse_channel_options &options, shared_read_handler &ready)
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			if (closed_ || disconnected_)
+			{
+				return push_result::queued;
+			}
+			if (waiting_read_)
+			{
+				ready = std::move(waiting_read_);
+				waiting_read_ = nullptr;
+				return push_result::queued;
+			}
+			if (events_.size() < options.max_queued_events)
+			{
+				events_.push_back(event);
+				return push_result::queued;
+			}
+			if (options.slow_policy == slow_subscriber_policy::drop_oldest)
+			{
+				events_.pop_front();
+				events_.push_back(event);
+				return push_result::dropped;
+			}
+			// the connection is stuck behind its own full output, it stops on its next read
+			// or by its write timeout
+			disconnected_ = true;
+			events_.clear();
+			return push_result::disconnected;
+		}
+
+		/// End the stream, ready gets the read to finish if one is waiting.
+		void close(shared_read_handler &ready)
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			closed_ = true;
+			if (waiting_read_ && events_.empty())
+			{
+				ready = std::move(waiting_read_);
+				waiting_read_ = nullptr;
+			}
+		}
+
+	private:
+		std::mutex mutex_;
+		std::deque<sse_event> events_;
+		shared_read_handler waiting_read_;
+		bool closed_ = false;
+		bool disconnected_ = false;
+	};
+
+	sse_channel::sse_channel(const sse_channel_options &options)
+		: options_(options)
+	{
+	}
+
+	sse_channel::~sse_channel()
+	{
+		close();
+	}
+
+	reply sse_channel::subscribe(const request &/*req*/)
+	{
+		auto new_subscriber = std::make_shared<subscriber>();
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			if (closed_)
+			{
+				// nothing reads from it yet, so no read can be waiting
+				body_source::shared_read_handler no_read;
+				new_subscriber->close(no_read);
+			}
+			else
+			{
+				subscribers_.push_back(new_subscriber);
+			}
+		}
+		reply rep;
+		// an event stream has no length, HTTP/1.1 lets it be chunked and kept alive
+		rep.status = "HTTP/1.1 200 OK\r\n";
+		rep.headers.push_back(header{"Content-Type", "text/event-stream"});
+		rep.headers.push_back(header{"Cache-Control", "no-cache"});
+		rep.body_stream = std::move(new_subscriber);
+		return rep;
+	}
+
+	sse_event sse_channel::make_event(std::string_view data, std::string_view event_type, std::string_view id)
+	{
+		std::string result;
+		result.reserve(data.size() + event_type.size() + id.size() + 32);
+		if (!event_type.empty())
+		{
+			result += "event: ";
+			result += event_type;
+			result += '\n';
+		}
+		if (!id.empty())
+		{
+			result += "id: ";
+			result += id;
+			result += '\n';
+		}
+		for (;;)
+		{
+			auto line_end = data.find('\n');
+			result += "data: ";
+			result += data.substr(0, line_end);
+			result += '\n';
+			if (line_end == std::string_view::npos)
+			{
+				break;
+			}
+			data.remove_prefix(line_end + 1);
+		}
+		result += '\n';
+		return std::make_shared<const std::string>(std::move(result));
+	}
+
+	void sse_channel::publish(sse_event event)
+	{
+		std::vector<body_source::shared_read_handler> ready_reads;
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			if (closed_)
+			{
+				return;
+			}
+			for (std::size_t i = 0; i < subscribers_.size();)
+			{
+				auto cur_subscriber = subscribers_[i].lock();
+				if (!cur_subscriber)
+				{
+					subscribers_[i] = std::move(subscribers_.back());
+					subscribers_.pop_back();
+					continue;
+				}
+				body_source::shared_read_handler ready;
+				switch (cur_subscriber->push(event, options_, ready))
+				{
+				case subscriber::push_result::dropped:
+					dropped_events_.fetch_add(1, std::memory_order_relaxed);
+					break;
+				case subscriber::push_result::disconnected:
+					disconnected_subscribers_.fetch_add(1, std::memory_order_relaxed);
+					subscribers_[i] = std::move(subscribers_.back());
+					subscribers_.pop_back();
+					continue;
+				default:
+					break;
+				}
+				if (ready)
+				{
+					ready_reads.push_back(std::move(ready));
+				}
+				i++;
+			}
+		}
+		// the reads hand the event to the executors of their connections, outside the lock
+		// because a read on this thread goes on to read the next piece
+		for (auto &one_read : ready_reads)
+		{
+			one_read(std::string(), event, false);
+		}
+	}
+
+	void sse_channel::heartbeat()
+	{
+		static const sse_event comment = std::make_shared<const std::string>(":\n\n");
+		publish(comment);
+	}
+
+	void sse_channel::close()
+	{
+		std::vector<body_source::shared_read_handler> ready_reads;
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			closed_ = true;
+			for (const auto &one_subscriber : subscribers_)
+			{
+				auto cur_subscriber = one_subscriber.lock();
+				if (!cur_subscriber)
+				{
+					continue;
+				}
+				body_source::shared_read_handler ready;
+				cur_subscriber->close(ready);
+				if (ready)
+				{
+					ready_reads.push_back(std::move(ready));
+				}
+			}
+			subscribers_.clear();
+		}
+		for (auto &one_read : ready_reads)
+		{
+			one_read(std::string(), nullptr, true);
+		}
+	}
+
+	std::size_t sse_channel::subscriber_count() const
+	{
+		std::lock_guard<std::mutex> guard(mutex_);
+		return subscribers_.size();
+	}
+
+	request_handler make_sse_handler(std::shared_ptr<sse_channel> channel)
+	{
+		return [channel](std::weak_ptr<request> weak_req, reply_handler cb)
+		{
+			auto req = weak_req.lock();
+			if (!req)
+			{
+				return;
+			}
+			cb(channel->subscribe(*req));
+		};
+	}
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,330 @@
+#include "upstream_group.hpp"
+#include <algorithm>
+#include <random>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		/// FNV-1a with a final mix, stable across platforms so that every proxy maps a key
+		/// to the same host. FNV alone spreads keys that differ in the last bytes badly.
+		std::uint64_t hash_key(std::string_view key)
+		{
+			std::uint64_t result = 14695981039346656037ull;
+			for (auto c : key)
+			{
+				result ^= static_cast<unsigned char>(c);
+				result *= 1099511628211ull;
+			}
+			result ^= result >> 33;
+			result *= 0xff51afd7ed558ccdull;
+			result ^= result >> 33;
+			return result;
+		}
+
+		std::minstd_rand &thread_random()
+		{
+			thread_local std::minstd_rand engine(std::random_device{}());
+			return engine;
+		}
+
+		/// Index of the first available host at or after start in rotation order.
+		std::size_t next_available(const upstream_group &group, std::size_t start)
+		{
+			auto host_count = group.host_count();
+			if (host_count == 0)
+			{
+				return upstream_group::no_host;
+			}
+			for (std::size_t i = 0; i < host_count; i++)
+			{
+				auto index = (start + i) % host_count;
+				if (group.is_available(index))
+				{
+					return index;
+				}
+			}
+			return start % host_count;
+		}
+
+		class round_robin_balancer : public load_balancer
+		{
+		public:
+			std::size_t pick(const upstream_group &group, std::string_view /*key*/) override
+			{
+				return next_available(group, m_next.fetch_add(1, std::memory_order_relaxed));
+			}
+
+		private:
+			std::atomic<std::size_t> m_next{0};
+		};
+
+		class least_outstanding_balancer : public load_balancer
+		{
+		public:
+			std::size_t pick(const upstream_group &group, std::string_view /*key*/) override
+			{
+				// start the scan at a rotating offset so that ties do not all go to the first host
+				auto host_count = group.host_count();
+				auto start = m_next.fetch_add(1, std::memory_order_relaxed);
+				std::size_t result = next_available(group, start);
+				if (result == upstream_group::no_host)
+				{
+					return result;
+				}
+				auto result_outstanding = group.outstanding(result);
+				for (std::size_t i = 0; i < host_count; i++)
+				{
+					auto index = (start + i) % host_count;
+					if (group.is_available(index) && group.outstanding(index) < result_outstanding)
+					{
+						result = index;
+						result_outstanding = group.outstanding(index);
+					}
+				}
+				return result;
+			}
+
+		private:
+			std::atomic<std::size_t> m_next{0};
+		};
+
+		class power_of_two_balancer : public load_balancer
+		{
+		public:
+			std::size_t pick(const upstream_group &group, std::string_view /*key*/) override
+			{
+				auto host_count = group.host_count();
+				auto &engine = thread_random();
+				auto first = next_available(group, engine());
+				if (host_count <= 1)
+				{
+					return first;
+				}
+				auto second = next_available(group, first + 1 + engine() % (host_count - 1));
+				return cost(group, second) < cost(group, first) ? second : first;
+			}
+
+		private:
+			/// Outstanding requests weighted by latency, a slow host with a short queue still looks busy.
+			static std::uint64_t cost(const upstream_group &group, std::size_t index)
+			{
+				return (std::uint64_t(group.outstanding(index)) + 1) * (group.latency_us(index) + 1);
+			}
+		};
+
+		class consistent_hash_balancer : public load_balancer
+		{
+		public:
+			consistent_hash_balancer(const std::vector<upstream_endpoint> &endpoints, std::size_t virtual_nodes)
+			{
+				for (std::size_t i = 0; i < endpoints.size(); i++)
+				{
+					auto name = endpoints[i].host + ":" + endpoints[i].port + "#";
+					for (std::size_t j = 0; j < virtual_nodes; j++)
+					{
+						m_ring.emplace_back(hash_key(name + std::to_string(j)), i);
+					}
+				}
+				std::sort(m_ring.begin(), m_ring.end());
+			}
+
+			std::size_t pick(const upstream_group &group, std::string_view key) override
+			{
+				if (m_ring.empty())
+				{
+					return upstream_group::no_host;
+				}
+				auto key_hash = hash_key(key);
+				auto iter = std::lower_bound(m_ring.begin(), m_ring.end(), std::make_pair(key_hash, std::size_t(0)));
+				// walk the ring past ejected hosts, their keys move to the next host only
+				for (std::size_t i = 0; i < m_ring.size(); i++, iter++)
+				{
+					if (iter == m_ring.end())
+					{
+						iter = m_ring.begin();
+					}
+					if (group.is_available(iter->second))
+					{
+						return iter->second;
+					}
+				}
+				return m_ring.front().second;
+			}
+
+		private:
+			std::vector<std::pair<std::uint64_t, std::size_t>> m_ring;
+		};
+	}
+
+	std::unique_ptr<load_balancer> make_load_balancer(balance_policy policy, const std::vector<upstream_endpoint> &endpoints, std::size_t virtual_nodes)
+	{
+		switch (policy)
+		{
+		case balance_policy::least_outstanding:
+			return std::make_unique<least_outstanding_balancer>();
+		case balance_policy::power_of_two_choices:
+			return std::make_unique<power_of_two_balancer>();
+		case balance_policy::consistent_hash:
+			return std::make_unique<consistent_hash_balancer>(endpoints, virtual_nodes);
+		default:
+			return std::make_unique<round_robin_balancer>();
+		}
+	}
+
+	upstream_group::upstream_group(asio::io_context &io_context, const std::vector<upstream_endpoint> &endpoints, const upstream_group_options &options)
+		: upstream_group(io_context, endpoints, options, make_load_balancer(options.policy, endpoints, options.virtual_nodes))
+	{
+
+	}
+
+	upstream_group::upstream_group(asio::io_context &io_context, const std::vector<upstream_endpoint> &endpoints, const upstream_group_options &options, std::unique_ptr<load_balancer> balancer)
+		: m_io_context(io_context)
+		, m_options(options)
+		, m_balancer(std::move(balancer))
+		, m_pool(std::make_shared<http_client_pool>(options.max_idle_per_host, options.idle_timeout_seconds, options.sockets))
+	{
+		for (const auto &one_endpoint : endpoints)
+		{
+			auto new_host = std::make_unique<host_state>();
+			new_host->endpoint = one_endpoint;
+			m_hosts.push_back(std::move(new_host));
+		}
+	}
+
+	std::int64_t upstream_group::now_ms()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	bool upstream_group::is_available(std::size_t index) const
+	{
+		if (m_hosts[index]->ejected_until_ms.load(std::memory_order_relaxed) == 0)
+		{
+			return true;
+		}
+		return m_ejected_count.load(std::memory_order_relaxed) >= m_hosts.size();
+	}
+
+	std::size_t upstream_group::request_started(std::string_view key)
+	{
+		auto next_reinstate = m_next_reinstate_ms.load(std::memory_order_relaxed);
+		if (next_reinstate != 0 && now_ms() >= next_reinstate)
+		{
+			reinstate_due_hosts();
+		}
+		if (m_hosts.empty())
+		{
+			return no_host;
+		}
+		auto index = m_balancer->pick(*this, key);
+		if (index >= m_hosts.size())
+		{
+			return no_host;
+		}
+		m_hosts[index]->outstanding.fetch_add(1, std::memory_order_relaxed);
+		return index;
+	}
+
+	void upstream_group::request_finished(std::size_t index, const std::string &err, int status_code, std::chrono::steady_clock::duration latency)
+	{
+		if (index >= m_hosts.size())
+		{
+			return;
+		}
+		auto &host = *m_hosts[index];
+		host.outstanding.fetch_sub(1, std::memory_order_relaxed);
+
+		// exponentially weighted moving average with a weight of 1/8 for the new sample
+		std::uint64_t sample = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+		auto prev = host.ewma_latency_us.load(std::memory_order_relaxed);
+		host.ewma_latency_us.store(prev == 0 ? sample : prev - prev / 8 + sample / 8, std::memory_order_relaxed);
+
+		bool failed = !err.empty() || (m_options.gateway_errors_are_failures && status_code >= 502 && status_code <= 504);
+		if (!failed)
+		{
+			if (host.consecutive_failures.exchange(0, std::memory_order_relaxed) != 0 || host.ejection_count != 0)
+			{
+				std::lock_guard<std::mutex> guard(m_ejection_mutex);
+				host.ejection_count = 0;
+			}
+			return;
+		}
+		if (host.consecutive_failures.fetch_add(1, std::memory_order_relaxed) + 1 >= m_options.consecutive_failures_to_eject)
+		{
+			eject(host);
+		}
+	}
+
+	void upstream_group::eject(host_state &host)
+	{
+		std::lock_guard<std::mutex> guard(m_ejection_mutex);
+		if (host.ejected_until_ms.load(std::memory_order_relaxed) != 0)
+		{
+			return;
+		}
+		auto max_ejected = std::max<std::size_t>(1, m_hosts.size() * m_options.max_ejection_percent / 100);
+		if (m_ejected_count.load(std::memory_order_relaxed) >= max_ejected)
+		{
+			return;
+		}
+		host.ejection_count++;
+		auto ejection_seconds = std::min<std::uint64_t>(std::uint64_t(m_options.base_ejection_seconds) * host.ejection_count, m_options.max_ejection_seconds);
+		auto until = now_ms() + std::int64_t(ejection_seconds * 1000);
+		host.ejected_until_ms.store(until, std::memory_order_relaxed);
+		host.consecutive_failures.store(0, std::memory_order_relaxed);
+		m_ejected_count.fetch_add(1, std::memory_order_relaxed);
+		auto next_reinstate = m_next_reinstate_ms.load(std::memory_order_relaxed);
+		if (next_reinstate == 0 || until < next_reinstate)
+		{
+			m_next_reinstate_ms.store(until, std::memory_order_relaxed);
+		}
+	}
+
+	void upstream_group::reinstate_due_hosts()
+	{
+		std::lock_guard<std::mutex> guard(m_ejection_mutex);
+		auto now = now_ms();
+		std::int64_t next_reinstate = 0;
+		for (auto &one_host : m_hosts)
+		{
+			auto until = one_host->ejected_until_ms.load(std::memory_order_relaxed);
+			if (until == 0)
+			{
+				continue;
+			}
+			if (now >= until)
+			{
+				one_host->ejected_until_ms.store(0, std::memory_order_relaxed);
+				m_ejected_count.fetch_sub(1, std::memory_order_relaxed);
+			}
+			else if (next_reinstate == 0 || until < next_reinstate)
+			{
+				next_reinstate = until;
+			}
+		}
+		m_next_reinstate_ms.store(next_reinstate, std::memory_order_relaxed);
+	}
+
+	void upstream_group::send_request(const request &req, std::string_view key, std::function<void(const std::string &, const reply &)> callback, std::uint32_t timeout_seconds, bool stream_reply)
+	{
+		auto index = request_started(key);
+		if (index == no_host)
+		{
+			callback("no upstream host", reply());
+			return;
+		}
+		const auto &cur_endpoint = m_hosts[index]->endpoint;
+		auto begin_ts = std::chrono::steady_clock::now();
+		auto client = std::make_shared<http_client>(m_io_context, cur_endpoint.host, cur_endpoint.port, req,
+			[self = shared_from_this(), index, begin_ts, callback = std::move(callback)](const std::string &err, const reply &rep)
+			{
+				self->request_finished(index, err, err.empty() ? rep.get_status_code() : 0, std::chrono::steady_clock::now() - begin_ts);
+				callback(err, rep);
+			},
+			timeout_seconds, m_pool);
+		client->set_stream_reply(stream_reply);
+		client->run();
+	}
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,196 @@
+#include "uri.hpp"
+#include <cstring>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		int hex_value(char c)
+		{
+			if (c >= '0' && c <= '9')
+			{
+				return c - '0';
+			}
+			if (c >= 'a' && c <= 'f')
+			{
+				return c - 'a' + 10;
+			}
+			if (c >= 'A' && c <= 'F')
+			{
+				return c - 'A' + 10;
+			}
+			return -1;
+		}
+	}
+
+	uri_view::uri_view()
+	{
+		http_parser_url_init(&url_);
+	}
+
+	uri_view::uri_view(std::string_view target, bool is_connect)
+		: target_(target)
+	{
+		http_parser_url_init(&url_);
+		// the offsets of http_parser_url are 16 bits
+		if (target.empty() || target.size() > UINT16_MAX || http_parser_parse_url(target.data(), target.size(), is_connect ? 1 : 0, &url_) != 0)
+		{
+			http_parser_url_init(&url_);
+			return;
+		}
+		valid_ = true;
+	}
+
+	void query_params::iterator::advance()
+	{
+		while (!remain_.empty())
+		{
+			auto amp = remain_.find('&');
+			auto param = remain_.substr(0, amp);
+			remain_.remove_prefix(amp == std::string_view::npos ? remain_.size() : amp + 1);
+			if (param.empty())
+			{
+				continue;
+			}
+			auto equal = param.find('=');
+			current_.name = param.substr(0, equal);
+			current_.value = equal == std::string_view::npos ? std::string_view() : param.substr(equal + 1);
+			if (remain_.empty())
+			{
+				// keep the end of the last parameter apart from end()
+				remain_ = std::string_view(param.data() + param.size(), 0);
+			}
+			return;
+		}
+		remain_ = std::string_view();
+		current_ = query_param();
+	}
+
+	bool query_params::get(std::string_view name, std::string_view &value) const
+	{
+		for (const auto &param : *this)
+		{
+			if (param.name == name)
+			{
+				value = param.value;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	std::size_t percent_decode_in_place(char *data, std::size_t size, bool plus_as_space)
+	{
+		if (plus_as_space)
+		{
+			// a plain loop the compiler vectorizes
+			for (std::size_t i = 0; i < size; i++)
+			{
+				data[i] = data[i] == '+' ? ' ' : data[i];
+			}
+		}
+		auto escape = static_cast<char *>(std::memchr(data, '%', size));
+		if (!escape)
+		{
+			return size;
+		}
+		char *read_pos = escape;
+		char *const end = data + size;
+		char *write_pos = escape;
+		while (escape)
+		{
+			if (end - escape < 3)
+			{
+				return std::string::npos;
+			}
+			auto high = hex_value(escape[1]);
+			auto low = hex_value(escape[2]);
+			if (high < 0 || low < 0)
+			{
+				return std::string::npos;
+			}
+			*write_pos++ = static_cast<char>(high * 16 + low);
+			read_pos = escape + 3;
+			escape = static_cast<char *>(std::memchr(read_pos, '%', end - read_pos));
+			auto run = (escape ? escape : end) - read_pos;
+			std::memmove(write_pos, read_pos, run);
+			write_pos += run;
+		}
+		return write_pos - data;
+	}
+
+	bool percent_decode(std::string_view input, std::string &out, bool plus_as_space)
+	{
+		auto old_size = out.size();
+		out.append(input.data(), input.size());
+		auto decoded_size = percent_decode_in_place(&out[old_size], input.size(), plus_as_space);
+		if (decoded_size == std::string::npos)
+		{
+			out.resize(old_size);
+			return false;
+		}
+		out.resize(old_size + decoded_size);
+		return true;
+	}
+
+	std::size_t normalize_path_in_place(char *data, std::size_t size)
+	{
+		if (size == 0 || data[0] != '/')
+		{
+			return size;
+		}
+		// the output is a run of "/segment" pieces, never longer than the input read so far
+		std::size_t read_pos = 0;
+		std::size_t write_pos = 0;
+		while (read_pos < size)
+		{
+			auto segment_begin = read_pos + 1;
+			auto slash = static_cast<const char *>(std::memchr(data + segment_begin, '/', size - segment_begin));
+			auto segment_end = slash ? static_cast<std::size_t>(slash - data) : size;
+			std::string_view segment(data + segment_begin, segment_end - segment_begin);
+			read_pos = segment_end;
+			if (segment == "." || segment == "..")
+			{
+				if (segment.size() == 2)
+				{
+					while (write_pos > 0 && data[--write_pos] != '/')
+					{
+					}
+				}
+				if (read_pos == size)
+				{
+					// the path names a directory, keep its trailing slash
+					data[write_pos++] = '/';
+				}
+				continue;
+			}
+			data[write_pos++] = '/';
+			std::memmove(data + write_pos, segment.data(), segment.size());
+			write_pos += segment.size();
+		}
+		return write_pos;
+	}
+
+	bool decode_path(std::string_view path, std::string &out)
+	{
+		if (path.empty() || path.front() != '/')
+		{
+			return false;
+		}
+		auto old_size = out.size();
+		if (!percent_decode(path, out))
+		{
+			return false;
+		}
+		auto decoded = &out[old_size];
+		auto decoded_size = out.size() - old_size;
+		if (std::memchr(decoded, '\0', decoded_size))
+		{
+			out.resize(old_size);
+			return false;
+		}
+		out.resize(old_size + normalize_path_in_place(decoded, decoded_size));
+		return true;
+	}
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,346 @@
+#include "websocket.hpp"
+#include <array>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HTTP_SERVER_UNMASK_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HTTP_SERVER_UNMASK_NEON
+#endif
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		const char websocket_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+		const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+		std::uint32_t rotate_left(std::uint32_t value, int bits)
+		{
+			return (value << bits) | (value >> (32 - bits));
+		}
+
+		/// SHA-1 of data, only used for the handshake so it favours size over speed.
+		std::array<unsigned char, 20> sha1(std::string_view data)
+		{
+			std::uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+			std::string message(data);
+			message += char(0x80);
+			while (message.size() % 64 != 56)
+			{
+				message += char(0);
+			}
+			std::uint64_t bit_size = std::uint64_t(data.size()) * 8;
+			for (int i = 7; i >= 0; i--)
+			{
+				message += char((bit_size >> (i * 8)) & 0xff);
+			}
+			for (std::size_t chunk = 0; chunk < message.size(); chunk += 64)
+			{
+				std::uint32_t w[80];
+				for (int i = 0; i < 16; i++)
+				{
+					auto p = reinterpret_cast<const unsigned char *>(message.data() + chunk + i * 4);
+					w[i] = (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) | (std::uint32_t(p[2]) << 8) | p[3];
+				}
+				for (int i = 16; i < 80; i++)
+				{
+					w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+				}
+				auto a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+				for (int i = 0; i < 80; i++)
+				{
+					std::uint32_t f, k;
+					if (i < 20)
+					{
+						f = (b & c) | (~b & d);
+						k = 0x5A827999;
+					}
+					else if (i < 40)
+					{
+						f = b ^ c ^ d;
+						k = 0x6ED9EBA1;
+					}
+					else if (i < 60)
+					{
+						f = (b & c) | (b & d) | (c & d);
+						k = 0x8F1BBCDC;
+					}
+					else
+					{
+						f = b ^ c ^ d;
+						k = 0xCA62C1D6;
+					}
+					auto temp = rotate_left(a, 5) + f + e + k + w[i];
+					e = d;
+					d = c;
+					c = rotate_left(b, 30);
+					b = a;
+					a = temp;
+				}
+				h[0] += a;
+				h[1] += b;
+				h[2] += c;
+				h[3] += d;
+				h[4] += e;
+			}
+			std::array<unsigned char, 20> result;
+			for (int i = 0; i < 20; i++)
+			{
+				result[i] = (h[i / 4] >> (24 - (i % 4) * 8)) & 0xff;
+			}
+			return result;
+		}
+
+		std::string base64_encode(const unsigned char *data, std::size_t size)
+		{
+			std::string result;
+			result.reserve((size + 2) / 3 * 4);
+			for (std::size_t i = 0; i < size; i += 3)
+			{
+				std::uint32_t triple = std::uint32_t(data[i]) << 16;
+				if (i + 1 < size)
+				{
+					triple |= std::uint32_t(data[i + 1]) << 8;
+				}
+				if (i + 2 < size)
+				{
+					triple |= data[i + 2];
+				}
+				result += base64_chars[(triple >> 18) & 0x3f];
+				result += base64_chars[(triple >> 12) & 0x3f];
+				result += i + 1 < size ? base64_chars[(triple >> 6) & 0x3f] : '=';
+				result += i + 2 < size ? base64_chars[triple & 0x3f] : '=';
+			}
+			return result;
+		}
+
+		reply websocket_error_reply(const char *status, const char *content)
+		{
+			reply rep;
+			rep.status = status;
+			rep.content = content;
+			rep.headers.push_back(header{"Content-Length", std::to_string(rep.content.size())});
+			rep.headers.push_back(header{"Content-Type", "text/plain"});
+			return rep;
+		}
+	}
+
+	websocket_parse_result parse_websocket_frame(char *data, std::size_t size, websocket_frame &frame, std::size_t &frame_size)
+	{
+		frame_size = 0;
+		if (size < 2)
+		{
+			return websocket_parse_result::incomplete;
+		}
+		auto bytes = reinterpret_cast<unsigned char *>(data);
+		// no extension is negotiated, so the reserved bits must be clear, and clients must mask
+		if ((bytes[0] & 0x70) || !(bytes[1] & 0x80))
+		{
+			return websocket_parse_result::bad;
+		}
+		frame.fin = (bytes[0] & 0x80) != 0;
+		frame.opcode = static_cast<websocket_opcode>(bytes[0] & 0x0f);
+		switch (frame.opcode)
+		{
+		case websocket_opcode::continuation:
+		case websocket_opcode::text:
+		case websocket_opcode::binary:
+			break;
+		case websocket_opcode::close:
+		case websocket_opcode::ping:
+		case websocket_opcode::pong:
+			// control frames are never fragmented and fit the 7 bit length
+			if (!frame.fin || (bytes[1] & 0x7f) > 125)
+			{
+				return websocket_parse_result::bad;
+			}
+			break;
+		default:
+			return websocket_parse_result::bad;
+		}
+
+		std::uint64_t payload_size = bytes[1] & 0x7f;
+		std::size_t header_size = 2;
+		if (payload_size == 126)
+		{
+			header_size = 4;
+		}
+		else if (payload_size == 127)
+		{
+			header_size = 10;
+		}
+		header_size += 4;
+		if (size < header_size)
+		{
+			return websocket_parse_result::incomplete;
+		}
+		if (header_size > 6)
+		{
+			payload_size = 0;
+			for (std::size_t i = 2; i < header_size - 4; i++)
+			{
+				payload_size = (payload_size << 8) | bytes[i];
+			}
+			if (payload_size >> 63)
+			{
+				return websocket_parse_result::bad;
+			}
+		}
+		if (payload_size > std::uint64_t(SIZE_MAX - header_size))
+		{
+			return websocket_parse_result::bad;
+		}
+		frame_size = header_size + std::size_t(payload_size);
+		if (size < frame_size)
+		{
+			return websocket_parse_result::incomplete;
+		}
+		auto payload = data + header_size;
+		unmask_websocket_payload(payload, std::size_t(payload_size), bytes + header_size - 4);
+		frame.payload = std::string_view(payload, std::size_t(payload_size));
+		return websocket_parse_result::complete;
+	}
+
+	void unmask_websocket_payload(char *data, std::size_t size, const unsigned char mask[4])
+	{
+		std::size_t i = 0;
+#if defined(HTTP_SERVER_UNMASK_SSE2) || defined(HTTP_SERVER_UNMASK_NEON)
+		if (size >= 16)
+		{
+			unsigned char wide_mask[16];
+			for (int j = 0; j < 16; j++)
+			{
+				wide_mask[j] = mask[j % 4];
+			}
+#if defined(HTTP_SERVER_UNMASK_SSE2)
+			auto mask_vector = _mm_loadu_si128(reinterpret_cast<const __m128i *>(wide_mask));
+			for (; i + 16 <= size; i += 16)
+			{
+				auto p = reinterpret_cast<__m128i *>(data + i);
+				_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask_vector));
+			}
+#else
+			auto mask_vector = vld1q_u8(wide_mask);
+			for (; i + 16 <= size; i += 16)
+			{
+				auto p = reinterpret_cast<std::uint8_t *>(data + i);
+				vst1q_u8(p, veorq_u8(vld1q_u8(p), mask_vector));
+			}
+#endif
+		}
+#else
+		if (size >= 8)
+		{
+			// the mask repeats every 4 bytes, so one 8 byte word covers two of them in any byte order
+			unsigned char wide_mask[8];
+			for (int j = 0; j < 8; j++)
+			{
+				wide_mask[j] = mask[j % 4];
+			}
+			std::uint64_t mask_word;
+			std::memcpy(&mask_word, wide_mask, 8);
+			for (; i + 8 <= size; i += 8)
+			{
+				std::uint64_t word;
+				std::memcpy(&word, data + i, 8);
+				word ^= mask_word;
+				std::memcpy(data + i, &word, 8);
+			}
+		}
+#endif
+		// i is a multiple of 4 here, so the tail starts at mask byte 0
+		for (; i < size; i++)
+		{
+			data[i] = char(data[i] ^ mask[i % 4]);
+		}
+	}
+
+	std::size_t write_websocket_frame_header(char *out, websocket_opcode opcode, std::size_t payload_size)
+	{
+		auto bytes = reinterpret_cast<unsigned char *>(out);
+		bytes[0] = 0x80 | static_cast<unsigned char>(opcode);
+		if (payload_size < 126)
+		{
+			bytes[1] = static_cast<unsigned char>(payload_size);
+			return 2;
+		}
+		if (payload_size <= 0xffff)
+		{
+			bytes[1] = 126;
+			bytes[2] = static_cast<unsigned char>(payload_size >> 8);
+			bytes[3] = static_cast<unsigned char>(payload_size);
+			return 4;
+		}
+		bytes[1] = 127;
+		auto size64 = std::uint64_t(payload_size);
+		for (int i = 0; i < 8; i++)
+		{
+			bytes[2 + i] = static_cast<unsigned char>(size64 >> ((7 - i) * 8));
+		}
+		return 10;
+	}
+
+	std::string websocket_accept_key(std::string_view client_key)
+	{
+		std::string input(trim_spaces(client_key));
+		input += websocket_guid;
+		auto digest = sha1(input);
+		return base64_encode(digest.data(), digest.size());
+	}
+
+	bool is_websocket_upgrade(const request &req)
+	{
+		return req.method == "GET" && has_token(find_header(req.headers, "Upgrade"), "websocket") && has_token(find_header(req.headers, "Connection"), "upgrade");
+	}
+
+	reply make_websocket_reply(const request &req, std::shared_ptr<websocket_handler> handler)
+	{
+		auto key = find_header(req.headers, "Sec-WebSocket-Key");
+		if (!is_websocket_upgrade(req) || !key || trim_spaces(*key).empty())
+		{
+			return reply::stock_reply(reply::status_type::bad_request);
+		}
+		auto version = find_header(req.headers, "Sec-WebSocket-Version");
+		if (!version || trim_spaces(*version) != "13")
+		{
+			auto rep = websocket_error_reply("HTTP/1.1 426 Upgrade Required\r\n", "unsupported WebSocket version");
+			rep.headers.push_back(header{"Sec-WebSocket-Version", "13"});
+			return rep;
+		}
+		reply rep;
+		rep.status = "HTTP/1.1 101 Switching Protocols\r\n";
+		rep.headers.push_back(header{"Upgrade", "websocket"});
+		rep.headers.push_back(header{"Connection", "Upgrade"});
+		rep.headers.push_back(header{"Sec-WebSocket-Accept", websocket_accept_key(*key)});
+		rep.websocket = std::move(handler);
+		return rep;
+	}
+
+	request_handler make_websocket_upgrade_handler(request_handler next, std::function<std::shared_ptr<websocket_handler>(const request &)> accept)
+	{
+		return [next = std::move(next), accept = std::move(accept)](std::weak_ptr<request> weak_req, reply_handler cb)
+		{
+			auto req = weak_req.lock();
+			if (!req)
+			{
+				return;
+			}
+			if (!is_websocket_upgrade(*req))
+			{
+				next(std::move(weak_req), std::move(cb));
+				return;
+			}
+			auto handler = accept(*req);
+			if (!handler)
+			{
+				cb(reply::stock_reply(reply::status_type::forbidden));
+				return;
+			}
+			cb(make_websocket_reply(*req, std::move(handler)));
+		};
+	}
+
+} // namespace spiritsaway::http_server
@@ -0,0 +1,131 @@
+#include "work_stealing_pool.hpp"
+#include <algorithm>
+
+namespace spiritsaway::http_server
+{
+	namespace
+	{
+		/// The pool and queue of the worker running on this thread.
+		thread_local const work_stealing_pool *current_pool = nullptr;
+		thread_local std::size_t current_index = 0;
+	}
+
+	work_stealing_pool::work_stealing_pool(std::size_t thread_count)
+	{
+		if (thread_count == 0)
+		{
+			thread_count = std::max(1u, std::thread::hardware_concurrency());
+		}
+		for (std::size_t i = 0; i < thread_count; i++)
+		{
+			queues_.push_back(std::make_unique<worker_queue>());
+		}
+		for (std::size_t i = 0; i < thread_count; i++)
+		{
+			threads_.emplace_back([this, i]()
+				{
+					worker_loop(i);
+				});
+		}
+	}
+
+	work_stealing_pool::~work_stealing_pool()
+	{
+		stop();
+		for (auto &one_thread : threads_)
+		{
+			one_thread.join();
+		}
+	}
+
+	void work_stealing_pool::stop()
+	{
+		stopping_.store(true);
+		std::lock_guard<std::mutex> guard(sleep_mutex_);
+		sleep_cv_.notify_all();
+	}
+
+	void work_stealing_pool::post(task new_task)
+	{
+		if (stopping_.load(std::memory_order_relaxed))
+		{
+			return;
+		}
+		// a worker keeps its own tasks, other threads spread them over the queues
+		auto index = current_pool == this ? current_index : next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+		{
+			std::lock_guard<std::mutex> guard(queues_[index]->mutex);
+			queues_[index]->tasks.push_back(std::move(new_task));
+			// counted under the lock that try_pop takes, so the count never drops below zero
+			pending_.fetch_add(1);
+		}
+		// a worker counts itself as sleeping before it checks pending_, so one of the two sides sees the other
+		if (sleeping_.load() != 0)
+		{
+			std::lock_guard<std::mutex> guard(sleep_mutex_);
+			sleep_cv_.notify_one();
+		}
+	}
+
+	bool work_stealing_pool::try_pop(std::size_t index, task &result)
+	{
+		for (std::size_t i = 0; i < queues_.size(); i++)
+		{
+			auto &cur_queue = *queues_[(index + i) % queues_.size()];
+			std::lock_guard<std::mutex> guard(cur_queue.mutex);
+			if (cur_queue.tasks.empty())
+			{
+				continue;
+			}
+			// oldest first from every queue, requests are served in about the order they came
+			result = std::move(cur_queue.tasks.front());
+			cur_queue.tasks.pop_front();
+			if (i != 0)
+			{
+				steal_count_.fetch_add(1, std::memory_order_relaxed);
+			}
+			pending_.fetch_sub(1);
+			return true;
+		}
+		return false;
+	}
+
+	void work_stealing_pool::worker_loop(std::size_t index)
+	{
+		current_pool = this;
+		current_index = index;
+		task cur_task;
+		while (true)
+		{
+			if (try_pop(index, cur_task))
+			{
+				cur_task();
+				cur_task = nullptr;
+				continue;
+			}
+			std::unique_lock<std::mutex> guard(sleep_mutex_);
+			sleeping_.fetch_add(1);
+			sleep_cv_.wait(guard, [this]()
+				{
+					return pending_.load() != 0 || stopping_.load();
+				});
+			sleeping_.fetch_sub(1);
+			if (pending_.load() == 0 && stopping_.load())
+			{
+				return;
+			}
+		}
+	}
+
+	request_handler make_pool_handler(request_handler next, std::shared_ptr<work_stealing_pool> pool)
+	{
+		return [next = std::move(next), pool](std::weak_ptr<request> weak_req, reply_handler cb)
+		{
+			pool->post([next, weak_req = std::move(weak_req), cb = std::move(cb)]()
+				{
+					next(weak_req, cb);
+				});
+		};
+	}
+
+} // namespace spiritsaway::http_server
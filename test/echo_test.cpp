@@ -1,4 +1,6 @@
 ﻿#include <http_server.hpp>
+#include <date_cache.hpp>
+#include <compression.hpp>
 #include <iostream>
 using namespace spiritsaway::http_server;
 using namespace std;
@@ -27,17 +29,17 @@ int main()
 				return;
 			}
 			auto& req = *req_ptr;
-			reply rep;
 			// Fill out the reply to be sent to the client.
-			
+			reply rep = reply::stock_reply(reply::status_type::ok);
 			rep.content = "echo request uri: " + req.uri + " body: " + req.body;
-			rep.stock_reply(reply::status_type::ok);
+			rep.headers[0].value = std::to_string(rep.content.size());
 			
 			cb(rep);
 		};
 		std::string address = "127.0.0.1";
 		std::string port = "8080";
-		server s(cur_context, address, port, echo_handler_ins);
+		date_cache::set_server_name("spiritsaway-http");
+		server s(cur_context, address, port, make_compression_handler(echo_handler_ins));
 
 		// Run the server until stopped.
 		s.run();
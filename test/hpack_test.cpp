@@ -0,0 +1,200 @@
+#include <hpack.hpp>
+#include <iostream>
+using namespace spiritsaway::http_server;
+using namespace std;
+
+// the examples of RFC 7541 appendix C, returns non zero if one of them fails
+
+namespace
+{
+	int failures = 0;
+
+	void check(bool ok, const std::string& what)
+	{
+		if (!ok)
+		{
+			std::cout << "failed: " << what << std::endl;
+			failures++;
+		}
+	}
+
+	std::string from_hex(std::string_view hex)
+	{
+		std::string result;
+		int high = -1;
+		for (char c : hex)
+		{
+			int digit;
+			if (c >= '0' && c <= '9')
+			{
+				digit = c - '0';
+			}
+			else if (c >= 'a' && c <= 'f')
+			{
+				digit = c - 'a' + 10;
+			}
+			else
+			{
+				continue;
+			}
+			if (high < 0)
+			{
+				high = digit;
+			}
+			else
+			{
+				result += char(high * 16 + digit);
+				high = -1;
+			}
+		}
+		return result;
+	}
+
+	std::string to_hex(std::string_view data)
+	{
+		const char digits[] = "0123456789abcdef";
+		std::string result;
+		for (unsigned char c : data)
+		{
+			result += digits[c >> 4];
+			result += digits[c & 15];
+		}
+		return result;
+	}
+
+	/// Decode one header block and compare it with the expected fields.
+	void check_block(hpack_decoder& decoder, std::string_view hex, const std::vector<header>& expected, const std::string& what)
+	{
+		auto block = from_hex(hex);
+		std::vector<header> headers;
+		if (!decoder.decode(block.data(), block.size(), headers, 64 * 1024))
+		{
+			check(false, what + " decode");
+			return;
+		}
+		bool same = headers.size() == expected.size();
+		for (std::size_t i = 0; same && i < headers.size(); i++)
+		{
+			same = headers[i].name == expected[i].name && headers[i].value == expected[i].value;
+		}
+		check(same, what);
+	}
+
+	void test_integers()
+	{
+		// C.1.1 to C.1.3
+		std::string out;
+		hpack_encode_integer(10, 5, 0, out);
+		check(to_hex(out) == "0a", "C.1.1 integer 10 with a 5 bit prefix");
+		out.clear();
+		hpack_encode_integer(1337, 5, 0, out);
+		check(to_hex(out) == "1f9a0a", "C.1.2 integer 1337 with a 5 bit prefix");
+		out.clear();
+		hpack_encode_integer(42, 8, 0, out);
+		check(to_hex(out) == "2a", "C.1.3 integer 42 at a byte boundary");
+	}
+
+	void test_huffman()
+	{
+		const std::pair<std::string, std::string> samples[] = {
+			{"www.example.com", "f1e3c2e5f23a6ba0ab90f4ff"},
+			{"no-cache", "a8eb10649cbf"},
+			{"custom-key", "25a849e95ba97d7f"},
+			{"custom-value", "25a849e95bb8e8b4bf"},
+			{"302", "6402"},
+			{"private", "aec3771a4b"},
+			{"Mon, 21 Oct 2013 20:13:21 GMT", "d07abe941054d444a8200595040b8166e082a62d1bff"},
+			{"https://www.example.com", "9d29ad171863c78f0b97c8e9ae82ae43d3"},
+			{"foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1", "94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007"},
+		};
+		for (const auto& [text, hex] : samples)
+		{
+			std::string encoded;
+			huffman_encode(text, encoded);
+			check(to_hex(encoded) == hex, "huffman encode " + text);
+			check(huffman_encoded_size(text) == encoded.size(), "huffman size " + text);
+			std::string decoded;
+			check(huffman_decode(encoded.data(), encoded.size(), decoded) && decoded == text, "huffman decode " + text);
+		}
+
+		// every byte value, the long codes included
+		std::string all_bytes;
+		for (int i = 0; i < 256; i++)
+		{
+			all_bytes += char(i);
+		}
+		std::string encoded;
+		huffman_encode(all_bytes, encoded);
+		std::string decoded;
+		check(huffman_decode(encoded.data(), encoded.size(), decoded) && decoded == all_bytes, "huffman round trip of all bytes");
+
+		// padding longer than 7 bits and padding that is not all ones, section 5.2
+		decoded.clear();
+		auto long_padding = from_hex("6402ff");
+		check(!huffman_decode(long_padding.data(), long_padding.size(), decoded), "huffman padding of a whole byte");
+		decoded.clear();
+		auto zero_padding = from_hex("f1e3c2e5f23a6ba0ab90f4fe");
+		check(!huffman_decode(zero_padding.data(), zero_padding.size(), decoded), "huffman padding with a zero bit");
+	}
+
+	void test_requests()
+	{
+		const std::vector<header> first = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}};
+		const std::vector<header> second = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}, {"cache-control", "no-cache"}};
+		const std::vector<header> third = {{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"}, {"custom-key", "custom-value"}};
+
+		// C.3, the requests of one connection without Huffman coding
+		hpack_decoder plain;
+		check_block(plain, "828684410f7777772e6578616d706c652e636f6d", first, "C.3.1");
+		check_block(plain, "828684be58086e6f2d6361636865", second, "C.3.2");
+		check_block(plain, "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565", third, "C.3.3");
+
+		// C.4, the same requests with Huffman coding
+		hpack_decoder huffman;
+		check_block(huffman, "828684418cf1e3c2e5f23a6ba0ab90f4ff", first, "C.4.1");
+		check_block(huffman, "828684be5886a8eb10649cbf", second, "C.4.2");
+		check_block(huffman, "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf", third, "C.4.3");
+	}
+
+	void test_responses()
+	{
+		const std::vector<header> first = {{":status", "302"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"}, {"location", "https://www.example.com"}};
+		const std::vector<header> second = {{":status", "307"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"}, {"location", "https://www.example.com"}};
+		const std::vector<header> third = {{":status", "200"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"}, {"location", "https://www.example.com"}, {"content-encoding", "gzip"}, {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}};
+
+		// C.6, responses with Huffman coding through a table of 256 bytes that evicts entries
+		hpack_decoder decoder(256);
+		check_block(decoder, "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f0b97c8e9ae82ae43d3", first, "C.6.1");
+		check_block(decoder, "4883640effc1c0bf", second, "C.6.2");
+		check_block(decoder, "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007", third, "C.6.3");
+
+		// the encoder chooses its own representations, its blocks must decode to the same fields
+		hpack_encoder encoder;
+		encoder.set_peer_max_table_size(256);
+		hpack_decoder peer(256);
+		for (const auto* fields : {&first, &second, &third, &first})
+		{
+			std::string block;
+			for (const auto& field : *fields)
+			{
+				encoder.encode(field.name, field.value, block);
+			}
+			check_block(peer, to_hex(block), *fields, "encoder round trip of " + (*fields)[0].value);
+		}
+	}
+}
+
+int main()
+{
+	test_integers();
+	test_huffman();
+	test_requests();
+	test_responses();
+	if (failures)
+	{
+		std::cout << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "all checks passed" << std::endl;
+	return 0;
+}
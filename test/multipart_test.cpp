@@ -0,0 +1,209 @@
+#include <multipart.hpp>
+#include <iostream>
+using namespace spiritsaway::http_server;
+using namespace std;
+
+// multipart_parser fed whole and in pieces, returns non zero if a check fails
+
+namespace
+{
+	int failures = 0;
+
+	void check(bool ok, const std::string& what)
+	{
+		if (!ok)
+		{
+			std::cout << "failed: " << what << std::endl;
+			failures++;
+		}
+	}
+
+	/// What the handlers of one parser saw, every part as name, filename, content type and data.
+	struct collected_parts
+	{
+		std::vector<multipart_part> parts;
+		std::vector<std::string> data;
+		std::size_t ended = 0;
+	};
+
+	std::unique_ptr<multipart_parser> make_parser(std::string_view boundary, collected_parts& result, std::size_t max_header_size = 16 * 1024)
+	{
+		return std::make_unique<multipart_parser>(boundary,
+			[&result](const multipart_part& part)
+			{
+				result.parts.push_back(part);
+				result.data.emplace_back();
+			},
+			[&result](std::string_view data)
+			{
+				result.data.back().append(data.data(), data.size());
+			},
+			[&result]()
+			{
+				result.ended++;
+			},
+			max_header_size);
+	}
+
+	/// Feed body in the given pieces, returns the result of the last parse.
+	multipart_parser::result_type parse_pieces(multipart_parser& parser, const std::vector<std::string>& pieces)
+	{
+		auto result = multipart_parser::result_type::indeterminate;
+		for (const auto& piece : pieces)
+		{
+			result = parser.parse(piece.data(), piece.size());
+		}
+		return result;
+	}
+
+	const std::string form_body =
+		"preamble that is dropped\r\n"
+		"--XyZ\r\n"
+		"Content-Disposition: form-data; name=\"field\"\r\n"
+		"\r\n"
+		"value with \r\n--XyY and \r\n--Xy inside\r\n"
+		"--XyZ\r\n"
+		"Content-Disposition: form-data; name=\"file\"; filename=\"a \\\"b\\\".txt\"\r\n"
+		"Content-Type: text/plain\r\n"
+		"\r\n"
+		"\r\n\r\nfile\rdata\r\n"
+		"--XyZ--\r\n"
+		"epilogue that is ignored --XyZ";
+
+	bool same_as_form(const collected_parts& result)
+	{
+		return result.parts.size() == 2 && result.ended == 2
+			&& result.parts[0].name == "field" && result.parts[0].filename.empty()
+			&& result.data[0] == "value with \r\n--XyY and \r\n--Xy inside"
+			&& result.parts[1].name == "file" && result.parts[1].filename == "a \"b\".txt"
+			&& result.parts[1].content_type == "text/plain" && result.parts[1].headers.size() == 2
+			&& result.data[1] == "\r\n\r\nfile\rdata";
+	}
+
+	void test_whole_body()
+	{
+		collected_parts result;
+		auto parser = make_parser("XyZ", result);
+		check(parse_pieces(*parser, {form_body}) == multipart_parser::result_type::good, "whole body is good");
+		check(same_as_form(result), "whole body parts");
+		check(parser->parse("more", 4) == multipart_parser::result_type::good, "input after the close delimiter is ignored");
+	}
+
+	void test_split_body()
+	{
+		// every split point, so that the delimiter, its CRLF and the CRLFCRLF of the
+		// headers are cut at each of their bytes once
+		for (std::size_t split = 0; split <= form_body.size(); split++)
+		{
+			collected_parts result;
+			auto parser = make_parser("XyZ", result);
+			auto parsed = parse_pieces(*parser, {form_body.substr(0, split), form_body.substr(split)});
+			check(parsed == multipart_parser::result_type::good && same_as_form(result), "body split at " + std::to_string(split));
+		}
+
+		collected_parts result;
+		auto parser = make_parser("XyZ", result);
+		std::vector<std::string> bytes;
+		for (char c : form_body)
+		{
+			bytes.emplace_back(1, c);
+		}
+		check(parse_pieces(*parser, bytes) == multipart_parser::result_type::good && same_as_form(result), "body fed byte by byte");
+	}
+
+	void test_delimiter_line()
+	{
+		{
+			// the first delimiter may start the body, transport padding follows a boundary
+			collected_parts result;
+			auto parser = make_parser("b", result);
+			auto parsed = parse_pieces(*parser, {"--b \t\r\nA: 1\r\n\r\nx\r\n--b  ", "\r\n\r\ny\r\n--b--"});
+			check(parsed == multipart_parser::result_type::good, "transport padding is good");
+			check(result.parts.size() == 2 && result.data[0] == "x" && result.data[1] == "y", "transport padding parts");
+			check(result.parts.size() == 2 && result.parts[1].headers.empty(), "part without headers");
+		}
+		{
+			collected_parts result;
+			auto parser = make_parser("b", result);
+			check(parse_pieces(*parser, {"--b\r\n\r\nx\r\n--b"}) == multipart_parser::result_type::indeterminate, "missing close delimiter is indeterminate");
+			check(result.ended == 1 && result.data[0] == "x", "part before a missing close delimiter");
+		}
+
+		const std::string invalid_bodies[] = {
+			"--bX\r\n\r\nx\r\n--b--",
+			"--b \tX\r\n\r\nx\r\n--b--",
+			"--b\rX\r\nx\r\n--b--",
+			"--b-X",
+			"--b\r\nno colon\r\n\r\nx\r\n--b--",
+			"--b\r\n: empty name\r\n\r\nx\r\n--b--",
+			"--b\r\nA B: space in name\r\n\r\nx\r\n--b--",
+			"--b\r\n folded first line\r\n\r\nx\r\n--b--",
+		};
+		for (const auto& body : invalid_bodies)
+		{
+			collected_parts result;
+			auto parser = make_parser("b", result);
+			check(parse_pieces(*parser, {body}) == multipart_parser::result_type::bad, "invalid body " + body);
+		}
+	}
+
+	void test_headers()
+	{
+		{
+			collected_parts result;
+			auto parser = make_parser("b", result);
+			parse_pieces(*parser, {"--b\r\nContent-Disposition: form-data;\r\n name=a\r\nX-Other:  v \r\n\r\n\r\n--b--"});
+			check(result.parts.size() == 1 && result.parts[0].name == "a" && result.parts[0].headers.size() == 2, "folded header line");
+			check(result.parts.size() == 1 && result.parts[0].headers.back().value == "v", "header value is trimmed");
+			check(result.data.size() == 1 && result.data[0].empty(), "empty part data");
+		}
+
+		const std::string headers = "--b\r\nA: 0123456789\r\n\r\nx\r\n--b--";
+		// the header line and the empty line after it take 17 bytes
+		for (std::size_t limit : {17, 16})
+		{
+			for (std::size_t split = 0; split <= headers.size(); split++)
+			{
+				collected_parts result;
+				auto parser = make_parser("b", result, limit);
+				auto parsed = parse_pieces(*parser, {headers.substr(0, split), headers.substr(split)});
+				auto expected = limit == 17 ? multipart_parser::result_type::good : multipart_parser::result_type::bad;
+				check(parsed == expected, "header limit " + std::to_string(limit) + " split at " + std::to_string(split));
+			}
+		}
+	}
+
+	void test_boundary()
+	{
+		check(multipart_boundary("multipart/form-data; boundary=abc") == "abc", "plain boundary");
+		check(multipart_boundary("Multipart/Mixed ; charset=utf-8; Boundary=\"a b:c\"") == "a b:c", "quoted boundary");
+		check(multipart_boundary("text/plain; boundary=abc").empty(), "boundary of a type that is not multipart");
+		check(multipart_boundary("multipart/form-data").empty(), "missing boundary");
+		check(multipart_boundary("multipart/form-data; boundary=\"\"").empty(), "empty boundary");
+		check(multipart_boundary("multipart/form-data; boundary=\"ab \"").empty(), "boundary ending with a space");
+		check(multipart_boundary("multipart/form-data; boundary=a;b") == "a", "boundary ends at a semicolon");
+		check(multipart_boundary("multipart/form-data; boundary=a@b").empty(), "boundary with an invalid character");
+		check(!multipart_boundary("multipart/form-data; boundary=" + std::string(70, 'a')).empty(), "boundary of 70 characters");
+		check(multipart_boundary("multipart/form-data; boundary=" + std::string(71, 'a')).empty(), "boundary of 71 characters");
+
+		collected_parts result;
+		auto parser = make_parser("", result);
+		check(parser->parse("--\r\n", 4) == multipart_parser::result_type::bad, "empty boundary makes the parser fail");
+	}
+}
+
+int main()
+{
+	test_whole_body();
+	test_split_body();
+	test_delimiter_line();
+	test_headers();
+	test_boundary();
+	if (failures)
+	{
+		std::cout << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "all checks passed" << std::endl;
+	return 0;
+}
@@ -0,0 +1,161 @@
+#include <response_cache.hpp>
+#include <iostream>
+#include <thread>
+using namespace spiritsaway::http_server;
+using namespace std;
+
+// variants, expiry and eviction of response_cache, returns non zero if a check fails
+
+namespace
+{
+	int failures = 0;
+
+	void check(bool ok, const std::string& what)
+	{
+		if (!ok)
+		{
+			std::cout << "failed: " << what << std::endl;
+			failures++;
+		}
+	}
+
+	class empty_source : public body_source
+	{
+	public:
+		void read(read_handler cb) override
+		{
+			cb(std::string(), std::string(), true);
+		}
+	};
+
+	request make_request(const std::string& uri, const std::string& language = std::string())
+	{
+		request req;
+		req.method = "GET";
+		req.uri = uri;
+		req.http_version_major = 1;
+		req.http_version_minor = 1;
+		if (!language.empty())
+		{
+			req.headers.push_back(header{"Accept-Language", language});
+		}
+		return req;
+	}
+
+	reply make_reply(const std::string& cache_control, std::size_t body_size = 100)
+	{
+		reply rep = reply::stock_reply(reply::status_type::ok);
+		rep.content.assign(body_size, 'x');
+		rep.headers[0].value = std::to_string(rep.content.size());
+		rep.headers.push_back(header{"Cache-Control", cache_control});
+		rep.headers.push_back(header{"Vary", "Accept-Language"});
+		return rep;
+	}
+
+	bool is_hit(response_cache& cache, const request& req)
+	{
+		std::shared_ptr<const serialized_reply> result;
+		return cache.lookup(req, result) == response_cache::lookup_result::fresh && result;
+	}
+
+	void test_store_and_lookup()
+	{
+		response_cache cache;
+		check(!is_hit(cache, make_request("/a", "en")), "empty cache misses");
+		check(cache.store(make_request("/a", "en"), make_reply("max-age=60")) != nullptr, "cacheable reply is stored");
+		check(is_hit(cache, make_request("/a", "en")), "stored reply hits");
+		check(!is_hit(cache, make_request("/a", "de")), "other Vary value misses");
+		check(!cache.store(make_request("/a", "en"), make_reply("no-store")), "no-store is not stored");
+
+		auto cookie_reply = make_reply("max-age=60");
+		cookie_reply.headers.push_back(header{"Set-Cookie", "a=b"});
+		check(!cache.store(make_request("/b"), cookie_reply), "Set-Cookie is not stored");
+
+		auto streamed_reply = make_reply("max-age=60");
+		streamed_reply.body_stream = std::make_shared<empty_source>();
+		check(!cache.store(make_request("/c"), streamed_reply), "streamed body is not stored");
+	}
+
+	void test_variant_limit()
+	{
+		response_cache_options options;
+		options.shard_count = 1;
+		options.max_variants = 4;
+		response_cache cache(options);
+		cache.store(make_request("/a", "lang0"), make_reply("max-age=60"));
+		auto one_variant_memory = cache.get_statistics().memory;
+		for (int i = 1; i < 100; i++)
+		{
+			cache.store(make_request("/a", "lang" + std::to_string(i)), make_reply("max-age=60"));
+		}
+		check(!is_hit(cache, make_request("/a", "lang0")), "oldest variant is dropped");
+		check(!is_hit(cache, make_request("/a", "lang95")), "variant beyond the limit is dropped");
+		for (int i = 96; i < 100; i++)
+		{
+			check(is_hit(cache, make_request("/a", "lang" + std::to_string(i))), "newest variants are kept");
+		}
+		check(cache.get_statistics().memory < one_variant_memory * 4 + 100, "memory stays within the variant limit");
+
+		// storing a variant again replaces it instead of adding one
+		auto before = cache.get_statistics().memory;
+		cache.store(make_request("/a", "lang99"), make_reply("max-age=60"));
+		check(cache.get_statistics().memory == before, "restored variant replaces the old one");
+		check(is_hit(cache, make_request("/a", "lang96")), "restore keeps the other variants");
+	}
+
+	void test_expired_variants()
+	{
+		response_cache_options options;
+		options.shard_count = 1;
+		response_cache cache(options);
+		cache.store(make_request("/a", "aa"), make_reply("max-age=1"));
+		auto one_variant_memory = cache.get_statistics().memory;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+		cache.store(make_request("/a", "bb"), make_reply("max-age=9"));
+		check(cache.get_statistics().memory == one_variant_memory, "expired variant is removed by a store");
+		check(!is_hit(cache, make_request("/a", "aa")), "expired variant misses");
+		check(is_hit(cache, make_request("/a", "bb")), "fresh variant hits");
+	}
+
+	void test_eviction()
+	{
+		response_cache_options options;
+		options.shard_count = 1;
+		options.max_memory = 2000;
+		response_cache cache(options);
+		cache.store(make_request("/a"), make_reply("max-age=60", 500));
+		cache.store(make_request("/b"), make_reply("max-age=60", 500));
+		check(is_hit(cache, make_request("/a")), "first entry is cached");
+		cache.store(make_request("/c"), make_reply("max-age=60", 500));
+		check(is_hit(cache, make_request("/a")), "recently used entry is kept");
+		check(!is_hit(cache, make_request("/b")), "least recently used entry is evicted");
+		check(is_hit(cache, make_request("/c")), "new entry is cached");
+		check(cache.get_statistics().memory <= options.max_memory, "memory stays within the limit");
+
+		// the variants of one entry add up beyond the limit, the entry itself is evicted
+		for (int i = 0; i < 5; i++)
+		{
+			cache.store(make_request("/d", "lang" + std::to_string(i)), make_reply("max-age=60", 500));
+		}
+		auto stats = cache.get_statistics();
+		check(stats.memory <= options.max_memory, "an entry over the limit alone is evicted");
+		check(!is_hit(cache, make_request("/d", "lang0")), "evicted entry misses");
+
+		check(!cache.store(make_request("/e"), make_reply("max-age=60", 4000)), "reply larger than the shard is not stored");
+	}
+}
+
+int main()
+{
+	test_store_and_lookup();
+	test_variant_limit();
+	test_expired_variants();
+	test_eviction();
+	if (failures)
+	{
+		std::cout << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "all checks passed" << std::endl;
+	return 0;
+}
@@ -0,0 +1,158 @@
+#include <uri.hpp>
+#include <iostream>
+#include <vector>
+using namespace spiritsaway::http_server;
+using namespace std;
+
+// uri_view, query_params and the percent decoding and path normalization, returns non zero if a check fails
+
+namespace
+{
+	int failures = 0;
+
+	void check(bool ok, const std::string& what)
+	{
+		if (!ok)
+		{
+			std::cout << "failed: " << what << std::endl;
+			failures++;
+		}
+	}
+
+	std::string decoded(std::string input, bool plus_as_space = false)
+	{
+		auto size = percent_decode_in_place(input.data(), input.size(), plus_as_space);
+		if (size == std::string::npos)
+		{
+			return "<invalid>";
+		}
+		input.resize(size);
+		return input;
+	}
+
+	std::string normalized(std::string path)
+	{
+		path.resize(normalize_path_in_place(path.data(), path.size()));
+		return path;
+	}
+
+	std::string decoded_path(std::string_view path)
+	{
+		std::string out;
+		return decode_path(path, out) ? out : "<invalid>";
+	}
+
+	/// The parameters of query joined as name=value; pairs, to compare them at once.
+	std::string joined_params(std::string_view query)
+	{
+		std::string result;
+		for (const auto& param : query_params(query))
+		{
+			result.append(param.name.data(), param.name.size());
+			result += '=';
+			result.append(param.value.data(), param.value.size());
+			result += ';';
+		}
+		return result;
+	}
+
+	void test_uri_view()
+	{
+		uri_view origin("/a/b?c=1&d#frag");
+		check(origin.valid() && origin.path() == "/a/b" && origin.query() == "c=1&d" && origin.fragment() == "frag", "origin form");
+		check(origin.host().empty() && origin.schema().empty() && origin.port() == 0, "origin form has no authority");
+
+		uri_view absolute("http://user@example.com:8080/p?q");
+		check(absolute.valid() && absolute.schema() == "http" && absolute.userinfo() == "user" && absolute.host() == "example.com", "absolute form");
+		check(absolute.port() == 8080 && absolute.path() == "/p" && absolute.query() == "q", "absolute form port, path and query");
+
+		uri_view authority("example.com:443", true);
+		check(authority.valid() && authority.host() == "example.com" && authority.port() == 443, "authority form of CONNECT");
+
+		uri_view invalid("not a target");
+		check(!invalid.valid() && invalid.path().empty(), "invalid target");
+		check(!uri_view().valid(), "default view is invalid");
+	}
+
+	void test_query_params()
+	{
+		check(joined_params("a=1&b=&c&d=x=y") == "a=1;b=;c=;d=x=y;", "parameters");
+		check(joined_params("&&a=1&&b=2&") == "a=1;b=2;", "empty parameters are skipped");
+		check(joined_params("").empty() && joined_params("&&&").empty(), "query without parameters");
+
+		// the iterator on the last parameter is not end(), whether or not a '&' follows it
+		for (std::string_view query : {"a", "a=1", "a=1&", "x=0&a"})
+		{
+			query_params params(query);
+			auto it = params.begin();
+			auto last = it;
+			while (it != params.end())
+			{
+				last = it++;
+			}
+			check(last != params.end() && last->name == "a", "last parameter of " + std::string(query));
+			check(it == params.end() && ++last == params.end(), "end after the last parameter of " + std::string(query));
+		}
+		check(query_params("").begin() == query_params("").end(), "empty query begins at its end");
+		check(query_params("&").begin() == query_params("&").end(), "query of separators begins at its end");
+
+		query_params params("x=1&name=first&name=second&bare");
+		std::string_view value;
+		check(params.get("name", value) && value == "first", "get returns the first value");
+		check(params.get("bare", value) && value.empty(), "get of a bare name");
+		check(!params.get("missing", value), "get of a missing name");
+		check(!params.get("nam", value), "get does not match a prefix");
+	}
+
+	void test_percent_decode()
+	{
+		check(decoded("plain") == "plain", "nothing to decode");
+		check(decoded("%41%62c%2f%2F") == "Abc//", "escapes of both cases");
+		check(decoded("a+b%2B", true) == "a b+", "plus as space, an escaped plus stays");
+		check(decoded("a+b") == "a+b", "plus is kept in paths");
+		check(decoded("%") == "<invalid>" && decoded("a%4") == "<invalid>", "truncated escape");
+		check(decoded("%zz") == "<invalid>" && decoded("%4g") == "<invalid>" && decoded("%g4") == "<invalid>", "escape with a non hex digit");
+		check(decoded("%41%") == "<invalid>", "truncated escape after a valid one");
+
+		std::string out = "kept";
+		check(!percent_decode("x%4", out) && out == "kept", "failed decode leaves out unchanged");
+		check(percent_decode("%20y", out) && out == "kept y", "decode appends to out");
+	}
+
+	void test_normalize_path()
+	{
+		check(normalized("/..") == "/", "/.. stays at the root");
+		check(normalized("/../../a") == "/a", "climbing above the root");
+		check(normalized("/a/../") == "/", "/a/../");
+		check(normalized("/a/..") == "/", "/a/..");
+		check(normalized("/a/./b/.") == "/a/b/", "dot segments");
+		check(normalized("/a/b/../c") == "/a/c", "dot dot segment");
+		check(normalized("//") == "//", "empty segments are kept");
+		check(normalized("/a//../b") == "/a/b", "dot dot removes an empty segment");
+		check(normalized("/.a/..b/...") == "/.a/..b/...", "segments that only start with dots");
+		check(normalized("relative/../x") == "relative/../x", "relative path is left as it is");
+		check(normalized("").empty(), "empty path");
+
+		check(decoded_path("/%2e%2e/x") == "/x", "escaped dot dot");
+		check(decoded_path("/a/%2E%2e/%2e/b") == "/b", "escaped dot segments");
+		check(decoded_path("/a%2f..%2fb") == "/b", "escaped slashes are normalized after decoding");
+		check(decoded_path("/a%00b") == "<invalid>", "escaped NUL");
+		check(decoded_path("/a%zz") == "<invalid>", "invalid escape in a path");
+		check(decoded_path("a/b") == "<invalid>" && decoded_path("") == "<invalid>", "path that is not absolute");
+	}
+}
+
+int main()
+{
+	test_uri_view();
+	test_query_params();
+	test_percent_decode();
+	test_normalize_path();
+	if (failures)
+	{
+		std::cout << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "all checks passed" << std::endl;
+	return 0;
+}